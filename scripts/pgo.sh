@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Builds a link-time optimised, profile-guided release build on Linux, using
+# the headless runner playing the training replay as the training workload.
+#
+# The training replay is recorded from the training script with a plain -O2
+# build, and then played back by each build. The plain build and the LTO+PGO
+# build both print their speed playing it, so the builds can be compared. Both
+# builds are made at -O2 in the same build directory, so LTO and PGO are the
+# only difference between them.
+#
+# Usage: scripts/pgo.sh
+#
+set -e
+
+cd "$(dirname "$0")/.."
+
+SCRIPT=src/replays/training.txt
+BUILD_DIR=../fips-build/rygar/linux-ninja-pgo
+PGO_DIR=$BUILD_DIR/pgo
+TRAINING_DIR=$(pwd)/$BUILD_DIR/training
+REPLAY=$TRAINING_DIR/training.rep
+
+# the number of frames played by the training script
+FRAMES=$(awk '$1 == "run" { n += $2 } END { print n }' "$SCRIPT")
+
+./fips set config linux-ninja-pgo
+./fips gen
+rm -rf "$PGO_DIR" "$TRAINING_DIR"
+mkdir -p "$TRAINING_DIR"
+
+# The replay is recorded rather than bundled, because replays are only valid
+# for the snapshot format they were recorded with.
+{
+  echo "record $REPLAY"
+  grep -v '^stats' "$SCRIPT"
+  echo "record-stop"
+} > "$TRAINING_DIR/record.txt"
+
+printf 'replay %s\nrun %s\nstats\n' "$REPLAY" "$FRAMES" > "$TRAINING_DIR/play.txt"
+
+echo "=== plain -O2 build"
+cmake -DCMAKE_C_FLAGS_RELEASE="-O2 -DNDEBUG" -DRYGAR_LTO=OFF -DRYGAR_PGO= "$BUILD_DIR"
+./fips build
+./fips run rygar-headless -- "$TRAINING_DIR/record.txt" | grep replay:
+./fips run rygar-headless -- "$TRAINING_DIR/play.txt" | grep realtime
+
+echo "=== instrumented build"
+cmake -DRYGAR_LTO=ON -DRYGAR_PGO=generate "$BUILD_DIR"
+./fips build
+
+echo "=== training run"
+./fips run rygar-headless -- "$TRAINING_DIR/play.txt" | grep realtime
+
+# clang writes raw profiles, which must be merged before they can be used
+if ls "$PGO_DIR"/*.profraw > /dev/null 2>&1; then
+  llvm-profdata merge -output="$PGO_DIR/default.profdata" "$PGO_DIR"/*.profraw
+fi
+
+echo "=== LTO+PGO build"
+cmake -DRYGAR_PGO=use "$BUILD_DIR"
+./fips build
+./fips run rygar-headless -- "$TRAINING_DIR/play.txt" | grep realtime
@@ -0,0 +1,107 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* allocations are aligned to cache lines */
+#define ARENA_ALIGN 64
+
+/* rounds a size up to the arena alignment */
+#define ARENA_ALIGN_SIZE(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* A fixed-size arena, which is allocated once up front. Allocations are never
+ * freed individually, the whole arena is freed at once. */
+typedef struct {
+  const char *name;
+  uint8_t *base;
+  size_t size;
+  size_t used;
+  int count;
+} arena_t;
+
+/**
+ * Initialises an arena with the given capacity, and clears it.
+ */
+void arena_init(arena_t *arena, const char *name, size_t size) {
+  memset(arena, 0, sizeof(arena_t));
+  arena->name = name;
+  arena->size = ARENA_ALIGN_SIZE(size);
+  arena->base = aligned_alloc(ARENA_ALIGN, arena->size);
+  assert(arena->base);
+  memset(arena->base, 0, arena->size);
+}
+
+void arena_shutdown(arena_t *arena) {
+  free(arena->base);
+  arena->base = 0;
+  arena->size = 0;
+  arena->used = 0;
+}
+
+/**
+ * Allocates a block of zeroed memory from the arena.
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = ARENA_ALIGN_SIZE(size);
+  assert(arena->used + size <= arena->size);
+
+  void *ptr = arena->base + arena->used;
+  arena->used += size;
+  arena->count++;
+
+  return ptr;
+}
+
+/**
+ * Prints the memory footprint of the arena.
+ */
+void arena_report(arena_t *arena) {
+  printf("%s: %zu bytes (%.1fKB) in %d allocations, %zu bytes free\n",
+    arena->name,
+    arena->used,
+    arena->used / 1024.0,
+    arena->count,
+    arena->size - arena->used);
+}
@@ -41,11 +41,29 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+
+/* Rows are padded, so that each row starts on a cache line, and so that rows
+ * of the wide layers aren't a power of two bytes apart (which would map them
+ * to the same cache sets). */
+#define BITMAP_ROW_PADDING 64
+
+/* the stride (in pixels) of a bitmap with the given width */
+#define BITMAP_STRIDE(width) ((width) + BITMAP_ROW_PADDING)
+
+/* the arena size needed for a bitmap with the given dimensions */
+#define BITMAP_SIZE(width, height) \
+  (ARENA_ALIGN_SIZE(BITMAP_STRIDE(width) * (height) * sizeof(uint16_t)) + \
+   ARENA_ALIGN_SIZE(BITMAP_STRIDE(width) * (height) * sizeof(uint8_t)))
+
 typedef struct {
   /* dimensions */
   int width;
   int height;
 
+  /* distance between rows (in pixels) */
+  int stride;
+
   /* bitmap data */
   uint16_t *data;
 
@@ -53,53 +71,61 @@ typedef struct {
   uint8_t *priority;
 } bitmap_t;
 
-void bitmap_init(bitmap_t *bitmap, int width, int height) {
+/**
+ * Initialises a bitmap, allocating the pixel data from the given arena.
+ */
+void bitmap_init(bitmap_t *bitmap, int width, int height, arena_t *arena) {
   memset(bitmap, 0, sizeof(bitmap_t));
   bitmap->width = width;
   bitmap->height = height;
-  bitmap->data = calloc(width * height, sizeof(uint16_t));
-  bitmap->priority = calloc(width * height, sizeof(uint8_t));
+  bitmap->stride = BITMAP_STRIDE(width);
+  bitmap->data = arena_alloc(arena, bitmap->stride * height * sizeof(uint16_t));
+  bitmap->priority = arena_alloc(arena, bitmap->stride * height * sizeof(uint8_t));
 }
 
+/**
+ * Tears down the bitmap. The pixel data is owned by the arena it was
+ * allocated from.
+ */
 void bitmap_shutdown(bitmap_t *bitmap) {
-  free(bitmap->data);
-  free(bitmap->priority);
   bitmap->data = 0;
   bitmap->priority = 0;
 }
 
 uint16_t *bitmap_data(bitmap_t *bitmap, int x, int y) {
-  return (bitmap->data + y * bitmap->width) + x;
+  return (bitmap->data + y * bitmap->stride) + x;
 }
 
 uint8_t *bitmap_priority(bitmap_t *bitmap, int x, int y) {
-  return (bitmap->priority + y * bitmap->width) + x;
+  return (bitmap->priority + y * bitmap->stride) + x;
 }
 
 void bitmap_fill(bitmap_t *bitmap, uint16_t color) {
-  uint16_t *data = bitmap->data;
-  uint8_t *priority = bitmap->priority;
+  for (int y = 0; y < bitmap->height; y++) {
+    uint16_t *data = bitmap_data(bitmap, 0, y);
 
-  for (int i = 0; i < bitmap->width * bitmap->height; i++) {
-    *data++ = color;
-    *priority++ = 0;
+    for (int x = 0; x < bitmap->width; x++) {
+      *data++ = color;
+    }
   }
+
+  memset(bitmap->priority, 0, bitmap->stride * bitmap->height);
 }
 
 /**
  * Copies a bitmap, respecting the priority of the pixels.
  */
 void bitmap_copy(bitmap_t *src, bitmap_t *dst, int scroll_x, int scroll_y) {
-  uint16_t *data = dst->data;
-  uint8_t *priority = dst->priority;
-
   for (int y = 0; y < dst->height; y++) {
+    uint16_t *data = bitmap_data(dst, 0, y);
+    uint8_t *priority = bitmap_priority(dst, 0, y);
+
     for (int x = 0; x < dst->width; x++) {
       /* Calculate the wrapped coordinates in tilemap space. Wrapping occurs
        * when the visible area is outside of the tilemap. */
       uint32_t wrapped_x = (x + scroll_x) % src->width;
       uint32_t wrapped_y = (y + scroll_y) % src->height;
-      uint32_t addr = (wrapped_y * src->width) + wrapped_x;
+      uint32_t addr = (wrapped_y * src->stride) + wrapped_x;
 
       if (src->priority[addr]) {
         *data = src->data[addr];
@@ -6,14 +6,45 @@ void clock_init(void);
 uint32_t clock_frame_time(void);
 uint32_t clock_frame_count_60hz(void);
 
+/*
+    Frame delay: sleeps at the start of a host frame, so that the emulation
+    runs (and samples input) as late as possible before the frame is
+    presented. A positive delay is fixed in microseconds, and
+    CLOCK_FRAME_DELAY_AUTO derives the delay from the measured refresh period
+    and work duration. Both are limited to CLOCK_FRAME_DELAY_MAX_US.
+*/
+#define CLOCK_FRAME_DELAY_AUTO (-1)
+// the delay must leave time for the frame's work within a 60Hz frame
+#define CLOCK_FRAME_DELAY_MAX_US (14000)
+void clock_set_frame_delay(int delay_us);
+void clock_frame_begin(void);
+void clock_frame_end(void);
+uint32_t clock_frame_delay(void);
+
 /*== IMPLEMENTATION ==========================================================*/
 #ifdef COMMON_IMPL
 #include "sokol_app.h"
+#include "sokol_time.h"
 #include <assert.h>
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+#include <time.h>
+#define CLOCK_CAN_SLEEP (1)
+#endif
+
+// safety margin between the end of the frame's work and the vsync, this
+// covers sleep overshoot and the time to submit the frame
+#define CLOCK_FRAME_DELAY_MARGIN_US (2000)
 
 typedef struct {
     bool valid;
     uint64_t cur_time;
+    struct {
+        int setting;
+        uint32_t delay_us;
+        uint64_t work_start;
+        double work_peak_us;
+        double period_us;
+    } delay;
 } clock_state_t;
 static clock_state_t clck;
 
@@ -24,6 +55,62 @@ void clock_init(void) {
     };
 }
 
+void clock_set_frame_delay(int delay_us) {
+    assert(clck.valid);
+    clck.delay.setting = delay_us;
+    clck.delay.delay_us = (delay_us > 0) ? (uint32_t) delay_us : 0;
+    if (clck.delay.delay_us > CLOCK_FRAME_DELAY_MAX_US) {
+        clck.delay.delay_us = CLOCK_FRAME_DELAY_MAX_US;
+    }
+}
+
+void clock_frame_begin(void) {
+    assert(clck.valid);
+    #if defined(CLOCK_CAN_SLEEP)
+    if (clck.delay.delay_us > 0) {
+        struct timespec ts = {
+            .tv_sec = 0,
+            .tv_nsec = (long) clck.delay.delay_us * 1000,
+        };
+        nanosleep(&ts, 0);
+    }
+    #endif
+    clck.delay.work_start = stm_now();
+}
+
+void clock_frame_end(void) {
+    assert(clck.valid);
+    if (clck.delay.setting != CLOCK_FRAME_DELAY_AUTO) {
+        return;
+    }
+    // track the peak work duration, decaying slowly so that a single slow
+    // frame doesn't disable the delay for long
+    const double work_us = stm_us(stm_since(clck.delay.work_start));
+    clck.delay.work_peak_us *= 0.99;
+    if (work_us > clck.delay.work_peak_us) {
+        clck.delay.work_peak_us = work_us;
+    }
+    // The delay is derived from the refresh period, which is the shortest
+    // recent frame duration. A frame that misses the vsync takes two periods,
+    // and deriving the delay from that would make the next frames miss it too.
+    // The period relaxes slowly, in case the refresh rate drops.
+    const double frame_us = sapp_frame_duration() * 1000000.0;
+    clck.delay.period_us *= 1.001;
+    if (clck.delay.period_us == 0.0 || frame_us < clck.delay.period_us) {
+        clck.delay.period_us = frame_us;
+    }
+    const double delay_us = clck.delay.period_us - clck.delay.work_peak_us - CLOCK_FRAME_DELAY_MARGIN_US;
+    clck.delay.delay_us = (delay_us > 0.0) ? (uint32_t) delay_us : 0;
+    if (clck.delay.delay_us > CLOCK_FRAME_DELAY_MAX_US) {
+        clck.delay.delay_us = CLOCK_FRAME_DELAY_MAX_US;
+    }
+}
+
+uint32_t clock_frame_delay(void) {
+    assert(clck.valid);
+    return clck.delay.delay_us;
+}
+
 uint32_t clock_frame_time(void) {
     assert(clck.valid);
     uint32_t frame_time_us = (uint32_t) (sapp_frame_duration() * 1000000.0);
@@ -0,0 +1,194 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chips/z80.h"
+
+#define DEBUG_MAX_BREAKPOINTS 16
+#define DEBUG_MAX_WATCHPOINTS 16
+
+/* Traps are resolved in two steps: a per-page flag table, which is checked for
+ * every memory access, and the exact breakpoint and watchpoint addresses,
+ * which are only checked for accesses to a trapped page. This means that only
+ * the pages being debugged run slower. */
+#define DEBUG_PAGE_SHIFT 8
+#define DEBUG_NUM_PAGES (0x10000 >> DEBUG_PAGE_SHIFT)
+
+/* trap flags */
+#define DEBUG_EXEC 0x01
+#define DEBUG_READ 0x02
+#define DEBUG_WRITE 0x04
+
+typedef struct {
+  bool enabled;
+  uint16_t start;
+  uint16_t end;
+  uint8_t flags;
+} debug_trap_t;
+
+typedef struct {
+  /* trap flags for each memory page */
+  uint8_t pages[DEBUG_NUM_PAGES];
+
+  debug_trap_t breakpoints[DEBUG_MAX_BREAKPOINTS];
+  debug_trap_t watchpoints[DEBUG_MAX_WATCHPOINTS];
+
+  /* set when a trap is hit, the machine stops until it is cleared */
+  bool stopped;
+  char reason[64];
+} debug_t;
+
+void debug_init(debug_t *debug) {
+  memset(debug, 0, sizeof(debug_t));
+}
+
+/**
+ * Rebuilds the page flag table from the breakpoints and watchpoints.
+ */
+static void debug_update_pages(debug_t *debug) {
+  memset(debug->pages, 0, sizeof(debug->pages));
+
+  for (int i = 0; i < DEBUG_MAX_BREAKPOINTS + DEBUG_MAX_WATCHPOINTS; i++) {
+    debug_trap_t *trap = (i < DEBUG_MAX_BREAKPOINTS) ? &debug->breakpoints[i] : &debug->watchpoints[i - DEBUG_MAX_BREAKPOINTS];
+
+    if (!trap->enabled) continue;
+
+    for (int page = trap->start >> DEBUG_PAGE_SHIFT; page <= trap->end >> DEBUG_PAGE_SHIFT; page++) {
+      debug->pages[page] |= trap->flags;
+    }
+  }
+}
+
+static int debug_add(debug_t *debug, debug_trap_t *traps, int count, uint16_t start, uint16_t end, uint8_t flags) {
+  for (int i = 0; i < count; i++) {
+    if (!traps[i].enabled) {
+      traps[i] = (debug_trap_t) {
+        .enabled = true,
+        .start = start,
+        .end = end,
+        .flags = flags,
+      };
+      debug_update_pages(debug);
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Adds a breakpoint at the given address, and returns its index (or -1 if
+ * there are no free breakpoints).
+ */
+int debug_add_breakpoint(debug_t *debug, uint16_t addr) {
+  return debug_add(debug, debug->breakpoints, DEBUG_MAX_BREAKPOINTS, addr, addr, DEBUG_EXEC);
+}
+
+/**
+ * Adds a watchpoint for reads and/or writes to the given address range, and
+ * returns its index (or -1 if there are no free watchpoints).
+ */
+int debug_add_watchpoint(debug_t *debug, uint16_t start, uint16_t end, uint8_t flags) {
+  return debug_add(debug, debug->watchpoints, DEBUG_MAX_WATCHPOINTS, start, end, flags & (DEBUG_READ | DEBUG_WRITE));
+}
+
+void debug_delete_breakpoint(debug_t *debug, int index) {
+  if (index < 0 || index >= DEBUG_MAX_BREAKPOINTS) return;
+  debug->breakpoints[index].enabled = false;
+  debug_update_pages(debug);
+}
+
+void debug_delete_watchpoint(debug_t *debug, int index) {
+  if (index < 0 || index >= DEBUG_MAX_WATCHPOINTS) return;
+  debug->watchpoints[index].enabled = false;
+  debug_update_pages(debug);
+}
+
+/**
+ * Clears a stopped machine, so that it can continue running.
+ *
+ * The machine stops on the tick which hit the trap, after the opcode fetch for
+ * a breakpoint, so resuming continues the instruction and doesn't hit the
+ * same breakpoint again.
+ */
+void debug_resume(debug_t *debug) {
+  debug->stopped = false;
+}
+
+/**
+ * Checks a memory access to a trapped page against the breakpoints and
+ * watchpoints. This must only be called when the page flags for the accessed
+ * address are non-zero.
+ */
+void debug_trap(debug_t *debug, uint64_t pins) {
+  uint16_t addr = Z80_GET_ADDR(pins);
+  uint8_t data = Z80_GET_DATA(pins);
+
+  if ((pins & (Z80_M1 | Z80_RD)) == (Z80_M1 | Z80_RD)) {
+    for (int i = 0; i < DEBUG_MAX_BREAKPOINTS; i++) {
+      debug_trap_t *trap = &debug->breakpoints[i];
+
+      if (trap->enabled && trap->start == addr) {
+        debug->stopped = true;
+        snprintf(debug->reason, sizeof(debug->reason), "breakpoint %d at %04x", i, addr);
+        return;
+      }
+    }
+  } else {
+    /* refresh cycles put the IR register on the address bus, but don't read */
+    uint8_t flags = (pins & Z80_WR) ? DEBUG_WRITE : (pins & Z80_RD) ? DEBUG_READ : 0;
+
+    if (!flags) return;
+
+    for (int i = 0; i < DEBUG_MAX_WATCHPOINTS; i++) {
+      debug_trap_t *trap = &debug->watchpoints[i];
+
+      if (trap->enabled && (trap->flags & flags) && addr >= trap->start && addr <= trap->end) {
+        debug->stopped = true;
+        snprintf(debug->reason, sizeof(debug->reason), "watchpoint %d %s %04x=%02x", i, (flags == DEBUG_WRITE) ? "write" : "read", addr, data);
+        return;
+      }
+    }
+  }
+}
@@ -32,6 +32,10 @@ void gfx_init(const gfx_desc_t* desc);
 uint32_t* gfx_framebuffer(void);
 size_t gfx_framebuffer_size(void);
 void gfx_draw(int emu_width, int emu_height);
+void gfx_set_flip(bool flip);
+void gfx_wall_init(int cols, int rows, int cell_width, int cell_height);
+void gfx_wall_update(int cell, const uint32_t* pixels, int width, int height, bool flip);
+void gfx_wall_draw(void);
 void gfx_shutdown(void);
 void* gfx_create_texture(int w, int h);
 void gfx_update_texture(void* h, void* data, int data_byte_size);
@@ -75,10 +79,12 @@ typedef struct {
     } emufb;
     struct {
         sg_buffer vbuf;
+        sg_buffer vbuf_flip;
         sg_pipeline pip;
         sg_image img;
         sg_pass pass;
         sg_pass_action pass_action;
+        bool flip;
     } upscale;
     struct {
         sg_buffer vbuf;
@@ -92,6 +98,16 @@ typedef struct {
         int width;
         int height;
     } icon;
+    struct {
+        sg_image img;
+        sg_buffer vbuf;
+        uint32_t* pixels;
+        int cols;
+        int rows;
+        int cell_width;
+        int cell_height;
+        bool dirty;
+    } wall;
     int flash_success_count;
     int flash_error_count;
     
@@ -125,6 +141,14 @@ static const float gfx_verts_flipped_rot[] = {
     0.0f, 1.0f, 0.0f, 1.0f,
     1.0f, 1.0f, 0.0f, 0.0f
 };
+// the emulator's flip screen output, which rotates the image by 180 degrees
+// in the upscale pass
+static const float gfx_verts_flip_screen[] = {
+    0.0f, 0.0f, 1.0f, 1.0f,
+    1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 0.0f, 0.0f
+};
 
 // a bit-packed speaker-off icon
 static const struct {
@@ -283,6 +307,9 @@ void gfx_init(const gfx_desc_t* desc) {
     gfx.upscale.vbuf = sg_make_buffer(&(sg_buffer_desc){
         .data = SG_RANGE(gfx_verts)
     });
+    gfx.upscale.vbuf_flip = sg_make_buffer(&(sg_buffer_desc){
+        .data = SG_RANGE(gfx_verts_flip_screen)
+    });
     gfx.upscale.pip = sg_make_pipeline(&(sg_pipeline_desc){
         .shader = sg_make_shader(upscale_shader_desc(sg_query_backend())),
         .layout = {
@@ -451,7 +478,7 @@ void gfx_draw(int emu_width, int emu_height) {
     sg_begin_pass(gfx.upscale.pass, &gfx.upscale.pass_action);
     sg_apply_pipeline(gfx.upscale.pip);
     sg_apply_bindings(&(sg_bindings){
-        .vertex_buffers[0] = gfx.upscale.vbuf,
+        .vertex_buffers[0] = gfx.upscale.flip ? gfx.upscale.vbuf_flip : gfx.upscale.vbuf,
         .fs_images[SLOT_emufb_tex] = gfx.emufb.img,
     });
     sg_draw(0, 4, 1);
@@ -490,8 +517,113 @@ void gfx_draw(int emu_width, int emu_height) {
     sg_commit();
 }
 
+// flips the emulator display by selecting the vertex data used by the
+// upscale pass, so flipping costs nothing per pixel
+void gfx_set_flip(bool flip) {
+    assert(gfx.valid);
+    gfx.upscale.flip = flip;
+}
+
+// the arcade wall draws many emulator framebuffers at once, instead of
+// gfx_draw: each one is scaled down into its own cell of an atlas in CPU
+// memory, and the atlas is uploaded as a single texture (only in frames where
+// a cell has changed) and drawn in a single pass
+void gfx_wall_init(int cols, int rows, int cell_width, int cell_height) {
+    assert(gfx.valid);
+    gfx.wall.cols = cols;
+    gfx.wall.rows = rows;
+    gfx.wall.cell_width = cell_width;
+    gfx.wall.cell_height = cell_height;
+    gfx.wall.pixels = calloc(cols * cell_width * rows * cell_height, sizeof(uint32_t));
+    assert(gfx.wall.pixels);
+    gfx.wall.dirty = true;
+
+    // the viewport keeps the aspect ratio of the whole wall
+    gfx.emufb.width = cols * cell_width;
+    gfx.emufb.height = rows * cell_height;
+
+    gfx.wall.img = sg_make_image(&(sg_image_desc){
+        .width = gfx.emufb.width,
+        .height = gfx.emufb.height,
+        .pixel_format = SG_PIXELFORMAT_RGBA8,
+        .usage = SG_USAGE_STREAM,
+        .min_filter = SG_FILTER_LINEAR,
+        .mag_filter = SG_FILTER_LINEAR,
+        .wrap_u = SG_WRAP_CLAMP_TO_EDGE,
+        .wrap_v = SG_WRAP_CLAMP_TO_EDGE
+    });
+    // the atlas is drawn straight to the screen, rather than sampled from a
+    // render target, so the texture is never upside down
+    gfx.wall.vbuf = sg_make_buffer(&(sg_buffer_desc){
+        .data = SG_RANGE(gfx_verts_flipped)
+    });
+}
+
+// copies an emulator framebuffer into a cell of the wall, scaling it to the
+// cell size with nearest filtering, and rotating it by 180 degrees if the
+// emulator's screen is flipped
+void gfx_wall_update(int cell, const uint32_t* pixels, int width, int height, bool flip) {
+    assert(gfx.valid && gfx.wall.pixels);
+    const int stride = gfx.wall.cols * gfx.wall.cell_width;
+    uint32_t* dst = gfx.wall.pixels + (cell / gfx.wall.cols) * gfx.wall.cell_height * stride + (cell % gfx.wall.cols) * gfx.wall.cell_width;
+    const int step_x = (width << 16) / gfx.wall.cell_width;
+    const int step_y = (height << 16) / gfx.wall.cell_height;
+    for (int y = 0; y < gfx.wall.cell_height; y++, dst += stride) {
+        int sy = (y * step_y) >> 16;
+        if (flip) {
+            sy = height - 1 - sy;
+        }
+        const uint32_t* src = pixels + sy * width;
+        if (flip) {
+            for (int x = 0, sx = 0; x < gfx.wall.cell_width; x++, sx += step_x) {
+                dst[x] = src[width - 1 - (sx >> 16)];
+            }
+        }
+        else {
+            for (int x = 0, sx = 0; x < gfx.wall.cell_width; x++, sx += step_x) {
+                dst[x] = src[sx >> 16];
+            }
+        }
+    }
+    gfx.wall.dirty = true;
+}
+
+void gfx_wall_draw(void) {
+    assert(gfx.valid && gfx.wall.pixels);
+    const int w = sapp_width();
+    const int h = sapp_height();
+
+    if (gfx.wall.dirty) {
+        sg_update_image(gfx.wall.img, &(sg_image_data){
+            .subimage[0][0] = {
+                .ptr = gfx.wall.pixels,
+                .size = gfx.emufb.width*gfx.emufb.height*sizeof(uint32_t)
+            }
+        });
+        gfx.wall.dirty = false;
+    }
+
+    sg_begin_default_pass(&gfx.display.pass_action, w, h);
+    apply_viewport(w, h);
+    sg_apply_pipeline(gfx.display.pip);
+    sg_apply_bindings(&(sg_bindings){
+        .vertex_buffers[0] = gfx.wall.vbuf,
+        .fs_images[SLOT_tex] = gfx.wall.img,
+    });
+    sg_draw(0, 4, 1);
+    sg_apply_viewport(0, 0, w, h, true);
+    sdtx_draw();
+    sgl_draw();
+    if (gfx.draw_extra_cb) {
+        gfx.draw_extra_cb();
+    }
+    sg_end_pass();
+    sg_commit();
+}
+
 void gfx_shutdown() {
     assert(gfx.valid);
+    free(gfx.wall.pixels);
     sgl_shutdown();
     sdtx_shutdown();
     sg_shutdown();
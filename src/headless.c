@@ -0,0 +1,882 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * Runs the emulator without a window, driven by commands read from a script
+ * file or stdin. This is useful for debugging, benchmarking, and automated
+ * testing.
+ *
+ * Usage: rygar-headless [SCRIPT]
+ *
+ * Addresses and port values are hexadecimal, counts are decimal.
+ *
+ *   run [FRAMES]               run for a number of frames (default 1)
+ *   tick [TICKS]               run for a number of CPU ticks (default 1)
+ *   break ADDR                 add a breakpoint
+ *   watch ADDR [END] [r|w|rw]  add a watchpoint (default rw)
+ *   delete break|watch INDEX   delete a breakpoint or watchpoint
+ *   list                       list breakpoints and watchpoints
+ *   regs                       print the CPU registers
+ *   peek ADDR [LEN]            print the contents of memory
+ *   input JOY BUTTONS SYS      set the input ports
+ *   screenshot FILE            write the current frame to a PNG file
+ *   overclock PERCENT          set the CPU clock (100-400%)
+ *   save FILE                  save a compressed snapshot
+ *   load FILE                  load a compressed snapshot
+ *   bench-lz [COUNT]           benchmark snapshot compression (default 1000)
+ *   bench-checkpoint [FRAMES]  benchmark rolling back every frame (default 600)
+ *   bench-clone [COUNT]        benchmark cloning the machine (default 10000)
+ *   bench-store [FRAMES]       benchmark storing the state of every frame in a
+ *                              deduplicated page store (default 3600)
+ *   observe                    print the sprites and scroll registers of the
+ *                              current frame
+ *   bench-observe [FRAMES]     compare the cost of observing and drawing
+ *                              frames (default 600)
+ *   thumbnail FILE             write a thumbnail of the current frame to a PNG
+ *                              file
+ *   bench-thumbnail [FRAMES]   compare the cost of thumbnails and drawing
+ *                              frames (default 600)
+ *   search DEPTH [FRAMES] [ADDR VALUE]
+ *                              search input sequences breadth-first, holding
+ *                              each input for FRAMES frames (default 8), until
+ *                              the memory at ADDR equals VALUE
+ *   record FILE [INTERVAL]     record a replay, with a keyframe every INTERVAL frames
+ *   record-stop                stop recording, and write the replay index
+ *   replay FILE                play back a replay from its first keyframe
+ *   seek FRAME                 seek to a frame of the replay being played back
+ *   verify FILE [THREADS]      verify a replay in parallel (default all cores)
+ *   runahead FRAMES [AHEAD] [BRANCHES] [SEED]
+ *                              run with AHEAD frames of run-ahead (default 2),
+ *                              speculating on BRANCHES inputs (default 4), with
+ *                              pseudo-random inputs which are held for a while
+ *   lockstep FRAMES [INTERVAL] [SEED]
+ *                              run the optimised and reference implementations
+ *                              side by side, comparing the CPU every INTERVAL
+ *                              ticks (default every frame), with random inputs
+ *                              if SEED is given
+ *   spectator PORT             listen for a spectator, and wait for it to connect
+ *   spectate HOST:PORT FRAMES  draw frames received from a spectator server
+ *   stats                      print the emulation speed
+ *   quit                       exit
+ *
+ * The run and tick commands stop early if a breakpoint or watchpoint is hit.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHIPS_IMPL
+#define SOKOL_TIME_IMPL
+
+#include "lockstep.h"
+#include "pagestore.h"
+#include "runahead.h"
+#include "rygar.h"
+#include "verify.h"
+
+#define MAX_LINE 256
+#define MAX_ARGS 8
+
+static rygar_t rygar;
+static uint32_t framebuffer[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+/* total host time spent running the emulation */
+static uint64_t run_time;
+
+static void print_stop() {
+  if (rygar.debug.stopped) {
+    printf("stopped: %s (cycle %llu)\n", rygar.debug.reason, (unsigned long long)rygar.cycles);
+  }
+}
+
+static void run(uint64_t ticks) {
+  uint64_t start = stm_now();
+
+  debug_resume(&rygar.debug);
+
+  while (ticks > 0 && !rygar.debug.stopped) {
+    uint32_t n = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+    ticks -= rygar_run(&rygar, n);
+  }
+
+  run_time += stm_since(start);
+
+  print_stop();
+}
+
+static void print_stats() {
+  double seconds = stm_sec(run_time);
+  double emulated = rygar.frame_count / 60.0;
+
+  printf("%u frames in %.3fs (%.1f fps, %.2fx realtime)\n",
+    rygar.frame_count,
+    seconds,
+    seconds > 0 ? rygar.frame_count / seconds : 0,
+    seconds > 0 ? emulated / seconds : 0);
+
+  arena_report(&rygar.arena);
+}
+
+/**
+ * Measures the compression throughput on a snapshot of the current state.
+ */
+static void bench_lz(int count) {
+  static rygar_snapshot_t snapshot, restored;
+  static uint8_t packed[LZ_COMPRESS_BOUND(sizeof(rygar_snapshot_t))];
+  int packed_size = 0;
+
+  rygar_save_snapshot(&rygar, &snapshot);
+
+  uint64_t start = stm_now();
+
+  for (int i = 0; i < count; i++) {
+    packed_size = lz_compress((uint8_t *)&snapshot, sizeof(snapshot), packed, sizeof(packed));
+  }
+
+  uint64_t compress_time = stm_since(start);
+
+  start = stm_now();
+
+  for (int i = 0; i < count; i++) {
+    lz_decompress(packed, packed_size, (uint8_t *)&restored, sizeof(restored));
+  }
+
+  uint64_t decompress_time = stm_since(start);
+  double mb = (double)sizeof(snapshot) * count / (1024 * 1024);
+
+  printf("lz: %zu -> %d bytes (%.1f%%), compress %.0f MB/s (%.1fus), decompress %.0f MB/s (%.1fus)%s\n",
+    sizeof(snapshot),
+    packed_size,
+    100.0 * packed_size / sizeof(snapshot),
+    mb / stm_sec(compress_time),
+    stm_us(compress_time) / count,
+    mb / stm_sec(decompress_time),
+    stm_us(decompress_time) / count,
+    memcmp(&snapshot, &restored, sizeof(snapshot)) == 0 ? "" : " MISMATCH");
+}
+
+/**
+ * Runs every frame twice, rolling back after the first run, and compares the
+ * cost of saving and restoring the state with full snapshots against
+ * incremental checkpoints. Input is held while the benchmark runs, so both
+ * runs of a frame are identical.
+ */
+static void bench_checkpoint(int frames) {
+  static rygar_snapshot_t start, snapshot, full_end, incremental_end;
+  static rygar_checkpoint_t checkpoint;
+  uint64_t full_time = 0, incremental_time = 0, t;
+  long pages = 0;
+
+  rygar_save_snapshot(&rygar, &start);
+
+  for (int i = 0; i < frames; i++) {
+    t = stm_now();
+    rygar_save_snapshot(&rygar, &snapshot);
+    full_time += stm_since(t);
+
+    rygar_run_frame(&rygar);
+
+    t = stm_now();
+    rygar_load_snapshot(&rygar, &snapshot);
+    full_time += stm_since(t);
+
+    rygar_run_frame(&rygar);
+  }
+
+  rygar_save_snapshot(&rygar, &full_end);
+  rygar_load_snapshot(&rygar, &start);
+
+  for (int i = 0; i < frames; i++) {
+    t = stm_now();
+    rygar_checkpoint_save(&rygar, &checkpoint);
+    incremental_time += stm_since(t);
+    pages += checkpoint.pages;
+
+    rygar_run_frame(&rygar);
+
+    t = stm_now();
+    rygar_checkpoint_restore(&rygar, &checkpoint);
+    incremental_time += stm_since(t);
+    pages += checkpoint.pages;
+
+    rygar_run_frame(&rygar);
+  }
+
+  rygar_save_snapshot(&rygar, &incremental_end);
+
+  printf("checkpoint: save+restore per frame, full %.2fus, incremental %.2fus (%.1f of %d pages)%s\n",
+    stm_us(full_time) / frames,
+    stm_us(incremental_time) / frames,
+    (double)pages / frames,
+    RAM_NUM_PAGES * 2,
+    memcmp(&full_end, &incremental_end, sizeof(full_end)) == 0 ? "" : " MISMATCH");
+}
+
+/**
+ * Measures how fast the machine can be cloned, with and without copy-on-write,
+ * and checks that both clones run identically.
+ */
+static void bench_clone(int count) {
+  static rygar_snapshot_t full_state, cow_state;
+  rygar_t *full = malloc(sizeof(rygar_t));
+  rygar_t *cow = malloc(sizeof(rygar_t));
+
+  rygar_init_clone(full, &rygar, 0);
+  rygar_init_clone(cow, &rygar, 0);
+
+  uint64_t start = stm_now();
+  for (int i = 0; i < count; i++) rygar_clone(&rygar, full);
+  uint64_t full_time = stm_since(start);
+
+  start = stm_now();
+  for (int i = 0; i < count; i++) rygar_clone_cow(&rygar, cow);
+  uint64_t cow_time = stm_since(start);
+
+  /* count the pages copied by the clone during a frame */
+  rygar_run_frame(cow);
+  int copied = 0;
+  for (int i = 0; i < RAM_SIZE >> MEM_PAGE_SHIFT; i++) copied += !(cow->shared_pages & (1 << i));
+
+  rygar_run_frame(full);
+  for (int i = 0; i < 9; i++) {
+    rygar_run_frame(full);
+    rygar_run_frame(cow);
+  }
+
+  rygar_save_snapshot(full, &full_state);
+  rygar_save_snapshot(cow, &cow_state);
+
+  printf("clone: %zu bytes per clone, full %.2fus (%.0f/s), copy-on-write %.2fus (%.0f/s), %d of %d pages copied after a frame%s\n",
+    sizeof(rygar_t),
+    stm_us(full_time) / count,
+    count / stm_sec(full_time),
+    stm_us(cow_time) / count,
+    count / stm_sec(cow_time),
+    copied,
+    RAM_SIZE >> MEM_PAGE_SHIFT,
+    memcmp(&full_state, &cow_state, sizeof(full_state)) == 0 ? "" : " MISMATCH");
+
+  rygar_shutdown(cow);
+  rygar_shutdown(full);
+  free(cow);
+  free(full);
+}
+
+/**
+ * Runs the emulation, storing the state of every frame in a page store, and
+ * reports how well the states are deduplicated and the store and load speed.
+ */
+static void bench_store(int frames) {
+  static rygar_snapshot_t snapshot, loaded;
+  const int num_pages = PAGE_STORE_PAGES(sizeof(rygar_snapshot_t));
+  uint32_t *ids = malloc(frames * num_pages * sizeof(uint32_t));
+  page_store_t store;
+  uint64_t store_time = 0, load_time = 0, t;
+  bool ok = true;
+
+  page_store_init(&store);
+
+  for (int i = 0; i < frames; i++) {
+    rygar_run_frame(&rygar);
+    rygar_save_snapshot(&rygar, &snapshot);
+
+    t = stm_now();
+    page_store_put_block(&store, &snapshot, sizeof(snapshot), ids + i * num_pages);
+    store_time += stm_since(t);
+  }
+
+  size_t store_size = page_store_size(&store);
+  uint32_t unique = store.pages;
+
+  for (int i = 0; i < frames; i++) {
+    t = stm_now();
+    page_store_get_block(&store, ids + i * num_pages, &loaded, sizeof(loaded));
+    load_time += stm_since(t);
+  }
+
+  /* the last state loaded must match the current state */
+  ok = memcmp(&snapshot, &loaded, sizeof(snapshot)) == 0;
+
+  for (int i = 0; i < frames; i++) {
+    page_store_release_block(&store, ids + i * num_pages, sizeof(snapshot));
+  }
+
+  ok = ok && store.pages == 0 && store.refs == 0;
+
+  double mb = (double)sizeof(snapshot) * frames / (1024 * 1024);
+
+  printf("store: %d states (%.1fMB), %u unique of %d pages (%.1fx dedup), %.1fMB used, store %.0f MB/s, load %.0f MB/s%s\n",
+    frames,
+    mb,
+    unique,
+    frames * num_pages,
+    (double)frames * num_pages / unique,
+    (store_size + frames * num_pages * sizeof(uint32_t)) / (1024.0 * 1024),
+    mb / stm_sec(store_time),
+    mb / stm_sec(load_time),
+    ok ? "" : " MISMATCH");
+
+  page_store_shutdown(&store);
+  free(ids);
+}
+
+static void observe(void) {
+  static scene_t scene;
+
+  rygar_observe(&rygar, &scene);
+
+  printf("frame %u: fg scroll %04x,%02x bg scroll %04x,%02x%s, %d sprites\n",
+    scene.frame,
+    scene.fg_scroll_x, scene.fg_scroll_y,
+    scene.bg_scroll_x, scene.bg_scroll_y,
+    scene.flip_screen ? " flipped" : "",
+    scene.sprite_count);
+
+  for (int i = 0; i < scene.sprite_count; i++) {
+    printf("sprite %3d: code=%03x size=%d pos=%d,%d flip=%d color=%x priority=%d\n",
+      i,
+      scene.sprite_code[i],
+      scene.sprite_size[i],
+      scene.sprite_x[i],
+      scene.sprite_y[i],
+      scene.sprite_flip[i],
+      scene.sprite_color[i],
+      scene.sprite_priority[i]);
+  }
+}
+
+/**
+ * Runs the emulation, observing every frame, and compares the time spent
+ * observing with the time spent drawing.
+ */
+static void bench_observe(int frames) {
+  static scene_t scene;
+  uint64_t observe_time = 0, draw_time = 0;
+
+  memset(rygar.render_time, 0, sizeof(rygar.render_time));
+  rygar.profile = true;
+
+  for (int i = 0; i < frames; i++) {
+    rygar_run_frame(&rygar);
+
+    uint64_t start = stm_now();
+    rygar_observe(&rygar, &scene);
+    observe_time += stm_since(start);
+  }
+
+  rygar.profile = false;
+
+  for (int i = 0; i < RYGAR_NUM_STAGES; i++) draw_time += rygar.render_time[i];
+
+  printf("observe: %.2fus per frame, draw %.2fus per frame (%.0fx)\n",
+    stm_us(observe_time) / frames,
+    draw_time / 1000.0 / frames,
+    draw_time / stm_ns(observe_time));
+}
+
+/* the inputs tried at each step of a search (joystick, buttons) */
+static const uint8_t search_inputs[][2] = {
+  { 0x00, 0x00 }, /* nothing */
+  { 0x01, 0x00 }, /* left */
+  { 0x02, 0x00 }, /* right */
+  { 0x00, 0x01 }, /* attack */
+  { 0x00, 0x02 }, /* jump */
+  { 0x02, 0x02 }, /* jump right */
+};
+
+#define SEARCH_NUM_INPUTS (int)(sizeof(search_inputs) / sizeof(search_inputs[0]))
+#define SEARCH_MAX_NODES 1024
+#define SEARCH_MAX_DEPTH 64
+#define SEARCH_SEEN_SIZE (1 << 18)
+
+typedef struct {
+  rygar_t *machine;
+
+  /* the inputs which lead to this node */
+  uint8_t path[SEARCH_MAX_DEPTH];
+} search_node_t;
+
+/**
+ * Hashes the machine state through the memory map, so that shared pages don't
+ * need to be copied.
+ */
+static uint64_t search_hash(rygar_t *machine) {
+  uint64_t hash = verify_hash(&machine->main.cpu, sizeof(z80_t));
+
+  for (int addr = RAM_START; addr <= RAM_END; addr += MEM_PAGE_SIZE) {
+    hash ^= verify_hash(machine->main.mem.page_table[addr >> MEM_PAGE_SHIFT].read_ptr, MEM_PAGE_SIZE);
+    hash *= 0x100000001b3;
+  }
+
+  return hash ? hash : 1;
+}
+
+/**
+ * Adds a state hash to the set of states already seen, and returns false if it
+ * was already there.
+ */
+static bool search_visit(uint64_t *seen, uint64_t hash) {
+  for (uint32_t i = hash & (SEARCH_SEEN_SIZE - 1);; i = (i + 1) & (SEARCH_SEEN_SIZE - 1)) {
+    if (seen[i] == hash) return false;
+
+    if (!seen[i]) {
+      seen[i] = hash;
+      return true;
+    }
+  }
+}
+
+/**
+ * Explores input sequences breadth-first from the current state, until the
+ * memory at the goal address equals the goal value (or forever if the address
+ * is negative).
+ *
+ * Each node is a machine without video buffers. The children of a node are
+ * copy-on-write clones of it, so children which turn out to be duplicates of
+ * states already seen are discarded without ever copying their RAM. Each level
+ * is capped at SEARCH_MAX_NODES.
+ */
+static void search(int depth, int frames, int goal_addr, int goal_value) {
+  static search_node_t levels[2][SEARCH_MAX_NODES];
+  static uint64_t seen[SEARCH_SEEN_SIZE];
+  search_node_t *parents = levels[0], *children = levels[1];
+  search_node_t *found = 0;
+  int num_parents = 1, num_states = 0, clones = 0;
+  uint64_t clone_time = 0;
+  uint64_t start = stm_now();
+
+  if (depth > SEARCH_MAX_DEPTH) depth = SEARCH_MAX_DEPTH;
+
+  memset(seen, 0, sizeof(seen));
+
+  parents[0].machine = malloc(sizeof(rygar_t));
+  rygar_init_clone(parents[0].machine, &rygar, 0);
+  rygar_clone(&rygar, parents[0].machine);
+  search_visit(seen, search_hash(parents[0].machine));
+
+  for (int level = 0; level < depth && num_parents > 0 && !found; level++) {
+    int num_children = 0;
+
+    for (int i = 0; i < num_parents && num_children < SEARCH_MAX_NODES && !found; i++) {
+      for (int input = 0; input < SEARCH_NUM_INPUTS && num_children < SEARCH_MAX_NODES; input++) {
+        search_node_t *child = &children[num_children];
+
+        if (!child->machine) {
+          child->machine = malloc(sizeof(rygar_t));
+          rygar_init_clone(child->machine, &rygar, 0);
+        }
+
+        uint64_t t = stm_now();
+        rygar_clone_cow(parents[i].machine, child->machine);
+        clone_time += stm_since(t);
+        clones++;
+
+        child->machine->main.joystick = search_inputs[input][0];
+        child->machine->main.buttons = search_inputs[input][1];
+
+        for (int f = 0; f < frames; f++) rygar_run_frame(child->machine);
+
+        if (!search_visit(seen, search_hash(child->machine))) continue;
+
+        memcpy(child->path, parents[i].path, level);
+        child->path[level] = input;
+        num_children++;
+        num_states++;
+
+        if (goal_addr >= 0 && mem_rd(&child->machine->main.mem, goal_addr) == goal_value) {
+          found = child;
+          break;
+        }
+      }
+    }
+
+    /* the parents are reused for the next level, so the children must stop
+     * sharing their pages */
+    for (int i = 0; i < num_children; i++) rygar_unshare(children[i].machine);
+
+    printf("search: depth %d, %d new states\n", level + 1, num_children);
+
+    if (found) {
+      printf("search: found %04x=%02x after %d steps:", goal_addr, goal_value, level + 1);
+      for (int i = 0; i <= level; i++) {
+        printf(" %02x/%02x", search_inputs[found->path[i]][0], search_inputs[found->path[i]][1]);
+      }
+      printf("\n");
+    }
+
+    search_node_t *tmp = parents;
+    parents = children;
+    children = tmp;
+    num_parents = num_children;
+  }
+
+  printf("search: %d clones (%.2fus each), %d states in %.3fs\n",
+    clones,
+    clones ? stm_us(clone_time) / clones : 0,
+    num_states,
+    stm_sec(stm_since(start)));
+
+  for (int l = 0; l < 2; l++) {
+    for (int i = 0; i < SEARCH_MAX_NODES; i++) {
+      if (levels[l][i].machine) {
+        rygar_shutdown(levels[l][i].machine);
+        free(levels[l][i].machine);
+        levels[l][i].machine = 0;
+      }
+    }
+  }
+}
+
+/**
+ * Writes a thumbnail of the current frame, scaled up so that each block is
+ * 8x8 pixels again.
+ */
+static void thumbnail(const char *filename) {
+  static thumbnail_t thumbnail;
+  static uint32_t pixels[THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT];
+  static uint32_t scaled[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+  rygar_init_thumbnail(&rygar, &thumbnail);
+  rygar_thumbnail(&rygar, &thumbnail, pixels);
+
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+      scaled[y * SCREEN_WIDTH + x] = pixels[(y / THUMBNAIL_BLOCK) * THUMBNAIL_WIDTH + x / THUMBNAIL_BLOCK];
+    }
+  }
+
+  stbi_write_png(filename, SCREEN_WIDTH, SCREEN_HEIGHT, 4, scaled, SCREEN_WIDTH*4);
+  thumbnail_shutdown(&thumbnail);
+}
+
+static void bench_thumbnail(int frames) {
+  static thumbnail_t thumbnail;
+  static uint32_t pixels[THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT];
+  uint64_t thumbnail_time = 0, draw_time = 0;
+
+  uint64_t start = stm_now();
+  rygar_init_thumbnail(&rygar, &thumbnail);
+  uint64_t init_time = stm_since(start);
+
+  memset(rygar.render_time, 0, sizeof(rygar.render_time));
+  rygar.profile = true;
+
+  for (int i = 0; i < frames; i++) {
+    rygar_run_frame(&rygar);
+
+    start = stm_now();
+    rygar_thumbnail(&rygar, &thumbnail, pixels);
+    thumbnail_time += stm_since(start);
+  }
+
+  rygar.profile = false;
+
+  for (int i = 0; i < RYGAR_NUM_STAGES; i++) draw_time += rygar.render_time[i];
+
+  printf("thumbnail: %.2fus per frame, draw %.2fus per frame (%.0fx), %.2fms to initialise\n",
+    stm_us(thumbnail_time) / frames,
+    draw_time / 1000.0 / frames,
+    draw_time / stm_ns(thumbnail_time),
+    stm_ms(init_time));
+
+  thumbnail_shutdown(&thumbnail);
+}
+
+/**
+ * Runs the emulation with run-ahead, and reports the hit rate of the
+ * speculative branches and the latency they saved.
+ *
+ * Frames are paced at 60Hz. The inputs are held for a random number of frames,
+ * and usually change to the next input in the search list, so that some
+ * transitions are more likely than others like a real player's. The presented
+ * frames are hashed, and the hash must not depend on the number of branches.
+ */
+static void bench_runahead(int frames, int ahead, int branches, uint32_t seed) {
+  static runahead_t runahead;
+  uint32_t random = seed;
+  uint32_t input = 0;
+  int held = 0;
+  uint64_t hash = 0xcbf29ce484222325;
+
+  runahead_init(&runahead, &rygar, ahead, branches);
+
+  uint64_t start = stm_now();
+
+  for (int i = 0; i < frames; i++) {
+    if (--held <= 0) {
+      random = random * 1103515245 + 12345;
+      input = (random >> 16) % 4 ? (input + 1) % SEARCH_NUM_INPUTS : (random >> 20) % SEARCH_NUM_INPUTS;
+      held = 4 + (random >> 24) % 28;
+    }
+
+    runahead_set_input(&rygar, RUNAHEAD_INPUT(search_inputs[input][0], search_inputs[input][1], rygar.main.sys));
+
+    if (!runahead_frame(&runahead)) break;
+
+    /* wait for the next vsync like a display would, the workers run ahead in
+     * the meantime */
+    uint64_t next = (uint64_t)(i + 1) * 1000000 / 60;
+    uint64_t elapsed = (uint64_t)stm_us(stm_since(start));
+    if (elapsed < next) usleep(next - elapsed);
+
+    hash = (hash ^ verify_hash(framebuffer, sizeof(framebuffer))) * 0x100000001b3;
+  }
+
+  run_time += stm_since(start);
+
+  runahead_report(&runahead);
+  printf("runahead: presented frames hash %016llx\n", (unsigned long long)hash);
+  runahead_shutdown(&runahead);
+
+  print_stop();
+}
+
+static void seek(uint32_t frame) {
+  if (!replay_playing(&rygar.player)) {
+    printf("error: no replay\n");
+    return;
+  }
+
+  uint64_t start = stm_now();
+
+  if (!rygar_seek(&rygar, frame)) {
+    printf("error: failed to seek to frame %u\n", frame);
+    return;
+  }
+
+  printf("seek: frame %u in %.2fms\n", rygar.frame_count, stm_ms(stm_since(start)));
+}
+
+/**
+ * Draws the frames received from a spectator server, until the given number
+ * of frames have been received or the server disconnects.
+ */
+static void spectate(const char *address, uint32_t frames) {
+  static spectator_client_t client;
+
+  if (!spectator_connect(&client, address)) return;
+
+  uint64_t start = stm_now();
+
+  while (client.frames < frames) {
+    int n = spectator_poll(&client, 1000, rygar_spectator_write, &rygar);
+
+    if (n < 0) break;
+    if (n > 0) rygar_draw(&rygar);
+  }
+
+  run_time += stm_since(start);
+  spectator_client_shutdown(&client);
+}
+
+static void print_trap(const char *type, int index, debug_trap_t *trap) {
+  if (!trap->enabled) return;
+
+  printf("%s %d: %04x", type, index, trap->start);
+  if (trap->end != trap->start) printf("-%04x", trap->end);
+  if (trap->flags & DEBUG_READ) printf(" r");
+  if (trap->flags & DEBUG_WRITE) printf(" w");
+  putchar('\n');
+}
+
+static void print_regs() {
+  z80_t *cpu = &rygar.main.cpu;
+
+  printf("af=%04x bc=%04x de=%04x hl=%04x ix=%04x iy=%04x sp=%04x pc=%04x bank=%02x\n",
+    cpu->af, cpu->bc, cpu->de, cpu->hl, cpu->ix, cpu->iy, cpu->sp, cpu->pc, rygar.main.current_bank);
+}
+
+static void print_memory(uint16_t addr, int len) {
+  for (int i = 0; i < len; i++) {
+    uint16_t a = addr + i;
+
+    if (i % 16 == 0) printf("%04x:", a);
+    printf(" %02x", a <= RAM_END ? mem_rd(&rygar.main.mem, a) : 0);
+    if (i % 16 == 15 || i == len - 1) putchar('\n');
+  }
+}
+
+/**
+ * Executes a single command, and returns false if the runner should exit.
+ */
+static bool exec(int argc, char *argv[]) {
+  if (argc == 0) return true;
+
+  const char *cmd = argv[0];
+
+  if (strcmp(cmd, "run") == 0) {
+    run((uint64_t)(argc > 1 ? atoi(argv[1]) : 1) * rygar.vsync_period);
+  } else if (strcmp(cmd, "tick") == 0) {
+    run(argc > 1 ? atoi(argv[1]) : 1);
+  } else if (strcmp(cmd, "break") == 0 && argc > 1) {
+    int index = debug_add_breakpoint(&rygar.debug, strtol(argv[1], 0, 16));
+    if (index < 0) printf("error: too many breakpoints\n");
+    else print_trap("break", index, &rygar.debug.breakpoints[index]);
+  } else if (strcmp(cmd, "watch") == 0 && argc > 1) {
+    uint16_t start = strtol(argv[1], 0, 16);
+    uint16_t end = start;
+    uint8_t flags = DEBUG_READ | DEBUG_WRITE;
+
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "r") == 0) flags = DEBUG_READ;
+      else if (strcmp(argv[i], "w") == 0) flags = DEBUG_WRITE;
+      else if (strcmp(argv[i], "rw") == 0) flags = DEBUG_READ | DEBUG_WRITE;
+      else end = strtol(argv[i], 0, 16);
+    }
+
+    int index = debug_add_watchpoint(&rygar.debug, start, end, flags);
+    if (index < 0) printf("error: too many watchpoints\n");
+    else print_trap("watch", index, &rygar.debug.watchpoints[index]);
+  } else if (strcmp(cmd, "delete") == 0 && argc > 2) {
+    if (strcmp(argv[1], "break") == 0) debug_delete_breakpoint(&rygar.debug, atoi(argv[2]));
+    else if (strcmp(argv[1], "watch") == 0) debug_delete_watchpoint(&rygar.debug, atoi(argv[2]));
+  } else if (strcmp(cmd, "list") == 0) {
+    for (int i = 0; i < DEBUG_MAX_BREAKPOINTS; i++) print_trap("break", i, &rygar.debug.breakpoints[i]);
+    for (int i = 0; i < DEBUG_MAX_WATCHPOINTS; i++) print_trap("watch", i, &rygar.debug.watchpoints[i]);
+  } else if (strcmp(cmd, "regs") == 0) {
+    print_regs();
+  } else if (strcmp(cmd, "peek") == 0 && argc > 1) {
+    print_memory(strtol(argv[1], 0, 16), argc > 2 ? atoi(argv[2]) : 16);
+  } else if (strcmp(cmd, "input") == 0 && argc > 3) {
+    uint64_t now = stm_now();
+    input_set_value(&rygar.input, INPUT_JOYSTICK1, strtol(argv[1], 0, 16), now);
+    input_set_value(&rygar.input, INPUT_BUTTONS1, strtol(argv[2], 0, 16), now);
+    input_set_value(&rygar.input, INPUT_SYS1, strtol(argv[3], 0, 16), now);
+  } else if (strcmp(cmd, "screenshot") == 0 && argc > 1) {
+    stbi_write_png(argv[1], SCREEN_WIDTH, SCREEN_HEIGHT, 4, framebuffer, SCREEN_WIDTH*4);
+  } else if (strcmp(cmd, "overclock") == 0 && argc > 1) {
+    /* replays run at the clock they were recorded with */
+    if (replay_recording(&rygar.recorder) || replay_playing(&rygar.player)) {
+      printf("error: can't change the clock of a replay\n");
+    } else {
+      rygar_set_overclock(&rygar, atoi(argv[1]));
+    }
+  } else if (strcmp(cmd, "save") == 0 && argc > 1) {
+    if (!rygar_save_state(&rygar, argv[1])) printf("error: failed to save %s\n", argv[1]);
+  } else if (strcmp(cmd, "load") == 0 && argc > 1) {
+    if (!rygar_load_state(&rygar, argv[1])) printf("error: failed to load %s\n", argv[1]);
+  } else if (strcmp(cmd, "bench-lz") == 0) {
+    bench_lz(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 1000);
+  } else if (strcmp(cmd, "bench-checkpoint") == 0) {
+    bench_checkpoint(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 600);
+  } else if (strcmp(cmd, "bench-clone") == 0) {
+    bench_clone(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 10000);
+  } else if (strcmp(cmd, "bench-store") == 0) {
+    bench_store(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 3600);
+  } else if (strcmp(cmd, "observe") == 0) {
+    observe();
+  } else if (strcmp(cmd, "bench-observe") == 0) {
+    bench_observe(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 600);
+  } else if (strcmp(cmd, "thumbnail") == 0 && argc > 1) {
+    thumbnail(argv[1]);
+  } else if (strcmp(cmd, "bench-thumbnail") == 0) {
+    bench_thumbnail(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 600);
+  } else if (strcmp(cmd, "search") == 0 && argc > 1) {
+    search(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 8, argc > 4 ? strtol(argv[3], 0, 16) : -1, argc > 4 ? strtol(argv[4], 0, 16) : 0);
+  } else if (strcmp(cmd, "record") == 0 && argc > 1) {
+    rygar_record_start(&rygar, argv[1], argc > 2 ? atoi(argv[2]) : REPLAY_KEYFRAME_INTERVAL);
+  } else if (strcmp(cmd, "record-stop") == 0) {
+    rygar_record_stop(&rygar);
+  } else if (strcmp(cmd, "replay") == 0 && argc > 1) {
+    if (rygar_replay_open(&rygar, argv[1])) printf("replay: %u frames, %u keyframes\n", rygar.player.frames, rygar.player.count);
+  } else if (strcmp(cmd, "seek") == 0 && argc > 1) {
+    seek(atoi(argv[1]));
+  } else if (strcmp(cmd, "verify") == 0 && argc > 1) {
+    verify_replay(argv[1], argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN));
+  } else if (strcmp(cmd, "runahead") == 0 && argc > 1) {
+    bench_runahead(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 2, argc > 3 ? atoi(argv[3]) : 4, argc > 4 ? atoi(argv[4]) : 1);
+  } else if (strcmp(cmd, "lockstep") == 0 && argc > 1) {
+    lockstep_run(&rygar, atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 0, argc > 3 ? atoi(argv[3]) : 0);
+  } else if (strcmp(cmd, "spectator") == 0 && argc > 1) {
+    if (rygar_spectator_listen(&rygar, atoi(argv[1]))) spectator_accept(rygar.spectator, -1);
+  } else if (strcmp(cmd, "spectate") == 0 && argc > 2) {
+    spectate(argv[1], atoi(argv[2]));
+  } else if (strcmp(cmd, "stats") == 0) {
+    print_stats();
+  } else if (strcmp(cmd, "quit") == 0) {
+    return false;
+  } else {
+    printf("error: unknown command '%s'\n", cmd);
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  FILE *script = stdin;
+
+  if (argc > 1) {
+    script = fopen(argv[1], "r");
+
+    if (!script) {
+      fprintf(stderr, "rygar-headless: failed to open %s\n", argv[1]);
+      return 1;
+    }
+  }
+
+  stm_setup();
+  rygar_init(&rygar, framebuffer);
+
+  char line[MAX_LINE];
+
+  while (fgets(line, sizeof(line), script)) {
+    char *args[MAX_ARGS];
+    int count = 0;
+
+    /* strip comments */
+    char *comment = strchr(line, '#');
+    if (comment) *comment = 0;
+
+    for (char *arg = strtok(line, " \t\r\n"); arg && count < MAX_ARGS; arg = strtok(0, " \t\r\n")) {
+      args[count++] = arg;
+    }
+
+    if (!exec(count, args)) break;
+
+    fflush(stdout);
+  }
+
+  rygar_shutdown(&rygar);
+
+  if (script != stdin) fclose(script);
+
+  return 0;
+}
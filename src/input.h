@@ -0,0 +1,159 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* number of input ports */
+#define INPUT_NUM_PORTS 3
+
+/* number of pending events per port (must be a power of two) */
+#define INPUT_QUEUE_SIZE 32
+
+/* a host input event, recorded as the complete state of the port after the
+ * event, so that dropping or coalescing events can never leave a key stuck */
+typedef struct {
+  /* host timestamp (sokol_time ticks) */
+  uint64_t time;
+
+  /* port value after the event */
+  uint8_t value;
+} input_event_t;
+
+typedef struct {
+  input_event_t events[INPUT_QUEUE_SIZE];
+  uint32_t head;
+  uint32_t tail;
+
+  /* the freshest host state of the port */
+  uint8_t host_value;
+
+  /* timestamp of the most recent event latched by a read */
+  uint64_t latched_time;
+} input_queue_t;
+
+typedef struct {
+  input_queue_t queues[INPUT_NUM_PORTS];
+
+  /* latency between a host event and the read which latched it */
+  uint32_t latched_count;
+  uint64_t latency_total;
+  uint64_t latency_max;
+} input_t;
+
+/**
+ * Initialises the input queues.
+ */
+void input_init(input_t *input) {
+  memset(input, 0, sizeof(input_t));
+}
+
+/**
+ * Sets the value of a port in response to a host event, and returns true if
+ * the port value changed.
+ *
+ * The event isn't visible to the emulated machine until the port is latched
+ * by a CPU read.
+ */
+bool input_set_value(input_t *input, int port, uint8_t value, uint64_t time) {
+  input_queue_t *queue = &input->queues[port];
+
+  /* ignore key repeats */
+  if (value == queue->host_value) return false;
+
+  queue->host_value = value;
+
+  if (queue->tail - queue->head == INPUT_QUEUE_SIZE) {
+    /* the queue is full, so coalesce with the newest event */
+    queue->events[(queue->tail - 1) & (INPUT_QUEUE_SIZE - 1)].value = value;
+    return true;
+  }
+
+  queue->events[queue->tail & (INPUT_QUEUE_SIZE - 1)] = (input_event_t) {
+    .time = time,
+    .value = value,
+  };
+  queue->tail++;
+
+  return true;
+}
+
+/**
+ * Sets or clears the given bits of a port in response to a host event, and
+ * returns true if the port value changed.
+ */
+bool input_set(input_t *input, int port, uint8_t mask, bool pressed, uint64_t time) {
+  uint8_t value = input->queues[port].host_value;
+  return input_set_value(input, port, pressed ? (value | mask) : (value & ~mask), time);
+}
+
+/**
+ * Latches the pending events for a port into the given register, and returns
+ * the new register value. This is called when the CPU reads the port.
+ *
+ * Pending events are applied in order, but an event which would change a bit
+ * that has already changed during this read is left in the queue. This
+ * guarantees that the game sees every transition, even a tap which is pressed
+ * and released within a single host frame.
+ */
+uint8_t input_latch(input_t *input, int port, uint8_t *reg, uint64_t now) {
+  input_queue_t *queue = &input->queues[port];
+  uint8_t changed = 0;
+
+  while (queue->head != queue->tail) {
+    input_event_t *event = &queue->events[queue->head & (INPUT_QUEUE_SIZE - 1)];
+    uint8_t diff = event->value ^ *reg;
+
+    if (diff & changed) break;
+
+    uint64_t latency = now - event->time;
+    input->latched_count++;
+    input->latency_total += latency;
+    if (latency > input->latency_max) input->latency_max = latency;
+
+    changed |= diff;
+    *reg = event->value;
+    queue->latched_time = event->time;
+    queue->head++;
+  }
+
+  return *reg;
+}
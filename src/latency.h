@@ -0,0 +1,332 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sokol_time.h"
+
+/* number of input events which can be tracked at once */
+#define LATENCY_MAX_EVENTS 64
+
+/* the number of frames an input event is followed for, events which haven't
+ * changed the video output by then are discarded */
+#define LATENCY_MAX_FRAMES 30
+
+/* histogram bucket width and count (1ms buckets, the last one is overflow) */
+#define LATENCY_BUCKET_MS 1
+#define LATENCY_NUM_BUCKETS 64
+
+/* the stages an input event passes through on its way to the display */
+typedef enum {
+  LATENCY_FREE = 0,
+  LATENCY_PENDING, /* stamped, waiting for the game to read the port */
+  LATENCY_READ,    /* read by the game, waiting for it to change the video output */
+  LATENCY_DRAWN,   /* video output changed, waiting for the frame to be presented */
+} latency_stage_t;
+
+typedef struct {
+  latency_stage_t stage;
+  uint32_t id;
+  int port;
+  uint8_t value;
+
+  /* host time the event was delivered */
+  uint64_t event_time;
+
+  /* emulated cycle and frame when the game first read the changed port */
+  uint64_t read_cycle;
+  uint32_t read_frame;
+
+  /* frame in which the video output first differed from the frame without the
+   * event */
+  uint32_t drawn_frame;
+} latency_event_t;
+
+typedef struct {
+  bool enabled;
+  FILE *log;
+
+  latency_event_t events[LATENCY_MAX_EVENTS];
+  uint32_t next_id;
+
+  /* The events read in a frame are followed by running a copy of the machine
+   * from the start of the frame without them, and comparing its frames with
+   * the machine's. This is set while the copy is running, from the start of
+   * the given frame. */
+  bool following;
+  uint32_t start_frame;
+
+  /* results */
+  uint32_t count;
+  uint32_t dropped;
+  uint32_t discarded;
+  uint64_t total;
+  uint64_t max;
+  uint32_t histogram[LATENCY_NUM_BUCKETS];
+} latency_t;
+
+/**
+ * Initialises latency measurement, writing the per-event log to the given
+ * file. Measurement is disabled if the filename is null.
+ */
+void latency_init(latency_t *latency, const char *filename) {
+  memset(latency, 0, sizeof(latency_t));
+
+  if (!filename) return;
+
+  latency->log = fopen(filename, "w");
+
+  if (!latency->log) {
+    fprintf(stderr, "latency: failed to open %s\n", filename);
+    return;
+  }
+
+  fprintf(latency->log, "# id port value event_ms read_cycle read_frame drawn_frame latency_ms\n");
+  latency->enabled = true;
+}
+
+/**
+ * Stamps a host input event which changed the given port.
+ */
+void latency_input(latency_t *latency, int port, uint8_t value, uint64_t time) {
+  if (!latency->enabled) return;
+
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage == LATENCY_FREE) {
+      *event = (latency_event_t) {
+        .stage = LATENCY_PENDING,
+        .id = latency->next_id++,
+        .port = port,
+        .value = value,
+        .event_time = time,
+      };
+      return;
+    }
+  }
+
+  latency->dropped++;
+}
+
+/**
+ * Records a read of the given port by the game. Every pending event for the
+ * port up to the most recently latched one has now been seen.
+ */
+void latency_read(latency_t *latency, int port, uint64_t latched_time, uint64_t cycle, uint32_t frame) {
+  if (!latency->enabled) return;
+
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage == LATENCY_PENDING && event->port == port && event->event_time <= latched_time) {
+      event->stage = LATENCY_READ;
+      event->read_cycle = cycle;
+      event->read_frame = frame;
+    }
+  }
+}
+
+/**
+ * Discards the events which have been read, but can't be followed.
+ */
+static void latency_discard(latency_t *latency) {
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage == LATENCY_READ) {
+      event->stage = LATENCY_FREE;
+      latency->discarded++;
+    }
+  }
+
+  latency->following = false;
+}
+
+/**
+ * Starts following the events read in the given frame, and returns false if
+ * events are already being followed. The caller must copy the machine at the
+ * start of the frame.
+ */
+bool latency_start(latency_t *latency, uint32_t frame) {
+  if (!latency->enabled || latency->following) return false;
+
+  latency->following = true;
+  latency->start_frame = frame;
+
+  return true;
+}
+
+/**
+ * Stops following events, e.g. because the copy of the machine is out of step
+ * with it. The events being followed are discarded.
+ */
+void latency_stop(latency_t *latency) {
+  if (!latency->enabled) return;
+
+  latency_discard(latency);
+}
+
+/**
+ * Returns true if the copy of the machine must run the given frame, which
+ * has just been completed, to compare it with the machine's frame.
+ *
+ * Only the events read in the start frame are followed, because the copy
+ * doesn't see any input after that, so events read in any other frame are
+ * discarded. Events are also discarded if they haven't changed the video output
+ * within LATENCY_MAX_FRAMES frames.
+ */
+bool latency_follow(latency_t *latency, uint32_t frame) {
+  if (!latency->enabled) return false;
+
+  bool read = false;
+  bool late = false;
+
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage != LATENCY_READ) continue;
+
+    if (latency->following && event->read_frame == latency->start_frame) {
+      read = true;
+    } else {
+      late = true;
+    }
+  }
+
+  if (!read || late || frame - latency->start_frame > LATENCY_MAX_FRAMES) {
+    latency_discard(latency);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Records whether the given frame differs between the machine and the copy
+ * which is running without the events being followed. The first frame which
+ * differs is the frame in which the events changed the video output.
+ */
+void latency_frame(latency_t *latency, uint32_t frame, bool differs) {
+  if (!latency->enabled || !differs) return;
+
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage == LATENCY_READ) {
+      event->stage = LATENCY_DRAWN;
+      event->drawn_frame = frame;
+    }
+  }
+
+  latency->following = false;
+}
+
+/**
+ * Records the host time the given frame was submitted for presentation, and
+ * logs every event which is now visible on the display.
+ */
+void latency_present(latency_t *latency, uint32_t frame, uint64_t time) {
+  if (!latency->enabled) return;
+
+  for (int i = 0; i < LATENCY_MAX_EVENTS; i++) {
+    latency_event_t *event = &latency->events[i];
+
+    if (event->stage != LATENCY_DRAWN || event->drawn_frame > frame) continue;
+
+    uint64_t total = time - event->event_time;
+    int bucket = (int)(stm_ms(total) / LATENCY_BUCKET_MS);
+    if (bucket >= LATENCY_NUM_BUCKETS) bucket = LATENCY_NUM_BUCKETS - 1;
+
+    latency->count++;
+    latency->total += total;
+    if (total > latency->max) latency->max = total;
+    latency->histogram[bucket]++;
+
+    fprintf(latency->log, "%u %d 0x%02x %.3f %llu %u %u %.3f\n",
+      event->id,
+      event->port,
+      event->value,
+      stm_ms(event->event_time),
+      (unsigned long long)event->read_cycle,
+      event->read_frame,
+      event->drawn_frame,
+      stm_ms(total));
+
+    event->stage = LATENCY_FREE;
+  }
+}
+
+/**
+ * Prints the latency histogram, and closes the log.
+ */
+void latency_shutdown(latency_t *latency) {
+  if (!latency->enabled) return;
+
+  fclose(latency->log);
+  latency->log = 0;
+  latency->enabled = false;
+
+  if (latency->count == 0) return;
+
+  uint32_t peak = 0;
+  for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+    if (latency->histogram[i] > peak) peak = latency->histogram[i];
+  }
+
+  printf("latency: %u events (%u dropped, %u discarded), %.2fms average / %.2fms max from input to display\n",
+    latency->count,
+    latency->dropped,
+    latency->discarded,
+    stm_ms(latency->total / latency->count),
+    stm_ms(latency->max));
+
+  for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+    if (latency->histogram[i] == 0) continue;
+
+    int width = (int)(latency->histogram[i] * 50 / peak);
+    printf("%s%3dms %6u ", (i == LATENCY_NUM_BUCKETS - 1) ? ">" : " ", i * LATENCY_BUCKET_MS, latency->histogram[i]);
+    for (int j = 0; j < width; j++) putchar('#');
+    putchar('\n');
+  }
+}
@@ -0,0 +1,202 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rygar.h"
+#include "verify.h"
+
+/* Differential execution of the optimised and reference implementations.
+ *
+ * Two clones of a machine are run side by side on the same inputs, one with
+ * rygar_run and the other with rygar_run_reference. The CPU state is compared
+ * every interval, and the whole machine state and the frame buffer are
+ * compared at the end of every frame. At the first divergence, both states are
+ * dumped so they can be compared. */
+#define LOCKSTEP_MAX_DIFFS 16
+
+typedef struct {
+  rygar_t *machine;
+  uint32_t *framebuffer;
+  rygar_snapshot_t snapshot;
+} lockstep_side_t;
+
+static void lockstep_print_regs(const char *name, rygar_t *rygar) {
+  z80_t *cpu = &rygar->main.cpu;
+
+  printf("lockstep: %s af=%04x bc=%04x de=%04x hl=%04x ix=%04x iy=%04x sp=%04x pc=%04x bank=%02x frame=%u cycle=%llu\n",
+    name, cpu->af, cpu->bc, cpu->de, cpu->hl, cpu->ix, cpu->iy, cpu->sp, cpu->pc,
+    rygar->main.current_bank, rygar->frame_count, (unsigned long long)rygar->cycles);
+}
+
+/**
+ * Prints both states, the bytes of the snapshots which differ, and writes the
+ * states and frames (and the execution traces, if enabled) to files.
+ */
+static void lockstep_dump(lockstep_side_t *ref, lockstep_side_t *opt) {
+  const uint8_t *a = (const uint8_t *)&ref->snapshot;
+  const uint8_t *b = (const uint8_t *)&opt->snapshot;
+  int diffs = 0;
+
+  lockstep_print_regs("reference", ref->machine);
+  lockstep_print_regs("optimised", opt->machine);
+
+  for (size_t i = 0; i < sizeof(rygar_snapshot_t); i++) {
+    if (a[i] == b[i]) continue;
+
+    if (diffs++ < LOCKSTEP_MAX_DIFFS) {
+      printf("lockstep: snapshot offset %04zx reference=%02x optimised=%02x\n", i, a[i], b[i]);
+    }
+  }
+
+  printf("lockstep: %d bytes differ, writing lockstep-{ref,opt}.{state,png}\n", diffs);
+
+  rygar_save_state(ref->machine, "lockstep-ref.state");
+  rygar_save_state(opt->machine, "lockstep-opt.state");
+  stbi_write_png("lockstep-ref.png", SCREEN_WIDTH, SCREEN_HEIGHT, 4, ref->framebuffer, SCREEN_WIDTH * 4);
+  stbi_write_png("lockstep-opt.png", SCREEN_WIDTH, SCREEN_HEIGHT, 4, opt->framebuffer, SCREEN_WIDTH * 4);
+
+#ifdef RYGAR_TRACE
+  printf("lockstep: writing lockstep-{ref,opt}.trace\n");
+  trace_dump(&ref->machine->trace, "lockstep-ref.trace");
+  trace_dump(&opt->machine->trace, "lockstep-opt.trace");
+#endif
+}
+
+static bool lockstep_cpu_equal(rygar_t *a, rygar_t *b) {
+  return memcmp(&a->main.cpu, &b->main.cpu, sizeof(z80_t)) == 0 &&
+    a->main.pins == b->main.pins &&
+    a->cycles == b->cycles;
+}
+
+/**
+ * Runs the optimised and reference implementations in lockstep from the
+ * state of the given machine, for the given number of frames, comparing the
+ * CPU state every interval ticks (or only at the end of each frame if the
+ * interval is zero). If the seed is non-zero, then both machines get the same
+ * pseudo-random inputs, otherwise the inputs are held. Returns false at the
+ * first divergence.
+ */
+bool lockstep_run(rygar_t *src, int frames, uint32_t interval, uint32_t seed) {
+  lockstep_side_t sides[2];
+  lockstep_side_t *ref = &sides[0], *opt = &sides[1];
+  uint32_t random = seed;
+  uint64_t ref_time = 0, opt_time = 0, t;
+  bool ok = true;
+  int frame;
+
+  for (int i = 0; i < 2; i++) {
+    sides[i].machine = malloc(sizeof(rygar_t));
+    sides[i].framebuffer = calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(uint32_t));
+    rygar_init_clone(sides[i].machine, src, sides[i].framebuffer);
+    rygar_clone(src, sides[i].machine);
+  }
+
+  for (frame = 0; frame < frames && ok; frame++) {
+    if (seed) {
+      random = random * 1103515245 + 12345;
+
+      for (int i = 0; i < 2; i++) {
+        sides[i].machine->main.joystick = (random >> 16) & 0x0f;
+        sides[i].machine->main.buttons = (random >> 20) & 0x03;
+      }
+    }
+
+    uint32_t target = opt->machine->frame_count + 1;
+
+    while (ok && opt->machine->frame_count < target) {
+      uint64_t cycles = opt->machine->cycles;
+
+      t = stm_now();
+      if (interval) {
+        rygar_run(opt->machine, interval);
+      } else {
+        rygar_run_frame(opt->machine);
+      }
+      opt_time += stm_since(t);
+
+      t = stm_now();
+      rygar_run_reference(ref->machine, opt->machine->cycles - cycles);
+      ref_time += stm_since(t);
+
+      if (!lockstep_cpu_equal(ref->machine, opt->machine)) {
+        printf("lockstep: CPU state diverged in frame %d\n", frame);
+        ok = false;
+      }
+    }
+
+    if (!ok) break;
+
+    rygar_save_snapshot(ref->machine, &ref->snapshot);
+    rygar_save_snapshot(opt->machine, &opt->snapshot);
+
+    if (memcmp(&ref->snapshot, &opt->snapshot, sizeof(rygar_snapshot_t)) != 0) {
+      printf("lockstep: machine state diverged in frame %d\n", frame);
+      ok = false;
+    } else if (verify_hash(ref->framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)) !=
+               verify_hash(opt->framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t))) {
+      printf("lockstep: frame diverged in frame %d\n", frame);
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    printf("lockstep: %d frames match, optimised %.2fms/frame, reference %.2fms/frame\n",
+      frames,
+      stm_ms(opt_time) / frames,
+      stm_ms(ref_time) / frames);
+  } else {
+    rygar_save_snapshot(ref->machine, &ref->snapshot);
+    rygar_save_snapshot(opt->machine, &opt->snapshot);
+    lockstep_dump(ref, opt);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    rygar_shutdown(sides[i].machine);
+    free(sides[i].machine);
+    free(sides[i].framebuffer);
+  }
+
+  return ok;
+}
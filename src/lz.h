@@ -0,0 +1,399 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A fast LZ77 codec, using the LZ4 block format.
+ *
+ * Each sequence is a token byte (4-bit literal length, 4-bit match length),
+ * followed by the literal length extension bytes, the literals, a 16-bit
+ * little-endian match offset, and the match length extension bytes. Lengths
+ * of 15 or more are extended by adding bytes until one is less than 255. The
+ * last sequence only contains literals. */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 12
+
+/* the last match must start at least 12 bytes before the end of the block,
+ * and the last 5 bytes are always literals */
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+/* the maximum compressed size of a block */
+#define LZ_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+/* streams are split into blocks of this size */
+#define LZ_BLOCK_SIZE 0x4000
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t lz_read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t lz_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_write_length(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+
+  *op++ = (uint8_t)len;
+
+  return op;
+}
+
+/**
+ * Compresses a block, and returns the compressed size. The destination must
+ * be at least LZ_COMPRESS_BOUND(src_size) bytes, otherwise zero is returned.
+ */
+int lz_compress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity) {
+  if (dst_capacity < LZ_COMPRESS_BOUND(src_size)) return 0;
+
+  /* positions of the most recent sequences with each hash */
+  int32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + src_size;
+  uint8_t *op = dst;
+
+  if (src_size > LZ_MF_LIMIT) {
+    const uint8_t *mf_limit = end - LZ_MF_LIMIT;
+    const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+
+    while (ip < mf_limit) {
+      uint32_t sequence = lz_read32(ip);
+      uint32_t hash = lz_hash(sequence);
+      int32_t ref = table[hash];
+      table[hash] = (int32_t)(ip - src);
+
+      if (ref < 0 || (ip - src) - ref > LZ_MAX_OFFSET || lz_read32(src + ref) != sequence) {
+        /* skip faster through data which doesn't compress */
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      const uint8_t *match = src + ref;
+
+      /* extend the match backwards */
+      while (ip > anchor && match > src && ip[-1] == match[-1]) {
+        ip--;
+        match--;
+      }
+
+      /* extend the match forwards, eight bytes at a time */
+      const uint8_t *p = ip + LZ_MIN_MATCH;
+      const uint8_t *m = match + LZ_MIN_MATCH;
+
+      while (p + 8 <= match_limit) {
+        uint64_t diff = lz_read64(p) ^ lz_read64(m);
+
+        if (diff) {
+          p += __builtin_ctzll(diff) >> 3;
+          goto found;
+        }
+
+        p += 8;
+        m += 8;
+      }
+
+      while (p < match_limit && *p == *m) {
+        p++;
+        m++;
+      }
+
+found:;
+      size_t literal_len = ip - anchor;
+      size_t match_len = p - ip - LZ_MIN_MATCH;
+      uint16_t offset = (uint16_t)(ip - match);
+      uint8_t *token = op++;
+
+      *token = (literal_len < 15 ? literal_len : 15) << 4 | (match_len < 15 ? match_len : 15);
+
+      if (literal_len >= 15) op = lz_write_length(op, literal_len - 15);
+      memcpy(op, anchor, literal_len);
+      op += literal_len;
+
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+
+      if (match_len >= 15) op = lz_write_length(op, match_len - 15);
+
+      ip = anchor = p;
+    }
+  }
+
+  /* the last literals */
+  size_t literal_len = end - anchor;
+
+  *op++ = (literal_len < 15 ? literal_len : 15) << 4;
+  if (literal_len >= 15) op = lz_write_length(op, literal_len - 15);
+  memcpy(op, anchor, literal_len);
+  op += literal_len;
+
+  return (int)(op - dst);
+}
+
+/**
+ * Decompresses a block, and returns the decompressed size, or -1 if the block
+ * is malformed or doesn't fit in the destination.
+ */
+int lz_decompress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity) {
+  const uint8_t *ip = src;
+  const uint8_t *ip_end = src + src_size;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + dst_capacity;
+
+  while (ip < ip_end) {
+    uint8_t token = *ip++;
+    size_t len = token >> 4;
+
+    if (len == 15) {
+      uint8_t b;
+      do {
+        if (ip >= ip_end) return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+
+    if ((size_t)(ip_end - ip) < len || (size_t)(op_end - op) < len) return -1;
+
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    /* the last sequence has no match */
+    if (ip == ip_end) break;
+
+    if (ip_end - ip < 2) return -1;
+
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+
+    if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+    len = token & 0x0f;
+
+    if (len == 15) {
+      uint8_t b;
+      do {
+        if (ip >= ip_end) return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+
+    len += LZ_MIN_MATCH;
+
+    if ((size_t)(op_end - op) < len) return -1;
+
+    const uint8_t *match = op - offset;
+
+    if (offset >= len) {
+      memcpy(op, match, len);
+    } else {
+      /* overlapping matches repeat the most recent bytes */
+      for (size_t i = 0; i < len; i++) op[i] = match[i];
+    }
+
+    op += len;
+  }
+
+  return (int)(op - dst);
+}
+
+/* Streams are a sequence of blocks, each with a header containing the raw
+ * and compressed sizes. A block which doesn't compress is stored raw, with
+ * equal sizes. */
+typedef struct {
+  uint32_t raw_size;
+  uint32_t packed_size;
+} lz_block_header_t;
+
+typedef struct {
+  FILE *file;
+  bool error;
+
+  /* pending uncompressed data */
+  int len;
+  uint8_t buffer[LZ_BLOCK_SIZE];
+  uint8_t packed[LZ_COMPRESS_BOUND(LZ_BLOCK_SIZE)];
+
+  /* totals, for reporting the compression ratio */
+  uint64_t raw_total;
+  uint64_t packed_total;
+} lz_writer_t;
+
+typedef struct {
+  FILE *file;
+  bool error;
+
+  /* decompressed data of the current block */
+  int pos;
+  int len;
+  uint8_t buffer[LZ_BLOCK_SIZE];
+  uint8_t packed[LZ_COMPRESS_BOUND(LZ_BLOCK_SIZE)];
+} lz_reader_t;
+
+void lz_writer_init(lz_writer_t *writer, FILE *file) {
+  writer->file = file;
+  writer->error = false;
+  writer->len = 0;
+  writer->raw_total = 0;
+  writer->packed_total = 0;
+}
+
+/**
+ * Compresses and writes the pending data as a block.
+ */
+bool lz_writer_flush(lz_writer_t *writer) {
+  if (writer->len == 0 || writer->error) return !writer->error;
+
+  int packed_size = lz_compress(writer->buffer, writer->len, writer->packed, sizeof(writer->packed));
+  const uint8_t *data = writer->packed;
+
+  if (packed_size <= 0 || packed_size >= writer->len) {
+    packed_size = writer->len;
+    data = writer->buffer;
+  }
+
+  lz_block_header_t header = {
+    .raw_size = writer->len,
+    .packed_size = packed_size,
+  };
+
+  if (fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+      fwrite(data, 1, packed_size, writer->file) != (size_t)packed_size) {
+    writer->error = true;
+  }
+
+  writer->raw_total += writer->len;
+  writer->packed_total += sizeof(header) + packed_size;
+  writer->len = 0;
+
+  return !writer->error;
+}
+
+/**
+ * Writes data to the stream.
+ */
+bool lz_write(lz_writer_t *writer, const void *data, size_t size) {
+  const uint8_t *p = data;
+
+  while (size > 0 && !writer->error) {
+    size_t n = LZ_BLOCK_SIZE - writer->len;
+    if (n > size) n = size;
+
+    memcpy(writer->buffer + writer->len, p, n);
+    writer->len += n;
+    p += n;
+    size -= n;
+
+    if (writer->len == LZ_BLOCK_SIZE) lz_writer_flush(writer);
+  }
+
+  return !writer->error;
+}
+
+void lz_reader_init(lz_reader_t *reader, FILE *file) {
+  reader->file = file;
+  reader->error = false;
+  reader->pos = 0;
+  reader->len = 0;
+}
+
+/**
+ * Reads data from the stream, and returns the number of bytes read. This is
+ * less than the requested size at the end of the stream, or on error.
+ */
+size_t lz_read(lz_reader_t *reader, void *data, size_t size) {
+  uint8_t *p = data;
+  size_t total = 0;
+
+  while (total < size && !reader->error) {
+    if (reader->pos == reader->len) {
+      lz_block_header_t header;
+
+      if (fread(&header, sizeof(header), 1, reader->file) != 1) break;
+
+      if (header.raw_size > LZ_BLOCK_SIZE ||
+          header.packed_size > header.raw_size ||
+          fread(reader->packed, 1, header.packed_size, reader->file) != header.packed_size) {
+        reader->error = true;
+        break;
+      }
+
+      if (header.packed_size == header.raw_size) {
+        memcpy(reader->buffer, reader->packed, header.raw_size);
+      } else if (lz_decompress(reader->packed, header.packed_size, reader->buffer, header.raw_size) != (int)header.raw_size) {
+        reader->error = true;
+        break;
+      }
+
+      reader->pos = 0;
+      reader->len = header.raw_size;
+    }
+
+    size_t n = reader->len - reader->pos;
+    if (n > size - total) n = size - total;
+
+    memcpy(p + total, reader->buffer + reader->pos, n);
+    reader->pos += n;
+    total += n;
+  }
+
+  return total;
+}
@@ -0,0 +1,426 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define METRICS_MAX 32
+#define METRICS_MAX_BUCKETS 16
+#define METRICS_BUFFER_SIZE 16384
+
+/* histogram quantiles are measured over fixed windows of this length */
+#define METRICS_WINDOW_MS 10000
+
+typedef enum {
+  METRICS_COUNTER,
+  METRICS_HISTOGRAM,
+} metrics_type_t;
+
+/* A registered metric. The values are only ever updated with relaxed atomic
+ * increments, so updating a metric never blocks the emulation thread. */
+typedef struct {
+  metrics_type_t type;
+  const char *name;
+  const char *labels;
+  const char *help;
+
+  /* multiplier from the recorded integer values to the exported unit */
+  double scale;
+
+  /* counter value, or histogram sum */
+  _Atomic uint64_t value;
+
+  /* histogram buckets (upper bounds are inclusive, the last bucket is +Inf) */
+  int num_bounds;
+  uint64_t bounds[METRICS_MAX_BUCKETS];
+  _Atomic uint64_t buckets[METRICS_MAX_BUCKETS + 1];
+
+  /* bucket counts at the start and end of the last complete window, used for
+   * the window quantiles */
+  uint64_t window_start[METRICS_MAX_BUCKETS + 1];
+  uint64_t window_end[METRICS_MAX_BUCKETS + 1];
+} metrics_metric_t;
+
+typedef struct {
+  metrics_metric_t metrics[METRICS_MAX];
+  int count;
+} metrics_registry_t;
+
+static metrics_registry_t metrics;
+
+/**
+ * Registers a counter and returns its id. Metrics must be registered before
+ * the exporter is started.
+ */
+int metrics_counter(const char *name, const char *labels, const char *help, double scale) {
+  if (metrics.count == METRICS_MAX) return -1;
+
+  metrics.metrics[metrics.count] = (metrics_metric_t) {
+    .type = METRICS_COUNTER,
+    .name = name,
+    .labels = labels,
+    .help = help,
+    .scale = scale,
+  };
+
+  return metrics.count++;
+}
+
+/**
+ * Registers a histogram with the given bucket upper bounds and returns its id.
+ */
+int metrics_histogram(const char *name, const char *help, const uint64_t *bounds, int num_bounds, double scale) {
+  if (metrics.count == METRICS_MAX || num_bounds > METRICS_MAX_BUCKETS) return -1;
+
+  metrics_metric_t *metric = &metrics.metrics[metrics.count];
+
+  *metric = (metrics_metric_t) {
+    .type = METRICS_HISTOGRAM,
+    .name = name,
+    .help = help,
+    .scale = scale,
+    .num_bounds = num_bounds,
+  };
+
+  memcpy(metric->bounds, bounds, num_bounds * sizeof(uint64_t));
+
+  return metrics.count++;
+}
+
+/**
+ * Adds a value to a counter.
+ */
+static inline void metrics_add(int id, uint64_t value) {
+  if (id < 0) return;
+  atomic_fetch_add_explicit(&metrics.metrics[id].value, value, memory_order_relaxed);
+}
+
+/**
+ * Records an observation in a histogram.
+ */
+static inline void metrics_observe(int id, uint64_t value) {
+  if (id < 0) return;
+
+  metrics_metric_t *metric = &metrics.metrics[id];
+  int bucket = 0;
+
+  while (bucket < metric->num_bounds && value > metric->bounds[bucket]) bucket++;
+
+  atomic_fetch_add_explicit(&metric->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+/**
+ * Returns the current value of a counter.
+ */
+uint64_t metrics_get(int id) {
+  if (id < 0) return 0;
+  return atomic_load_explicit(&metrics.metrics[id].value, memory_order_relaxed);
+}
+
+/**
+ * Ends the current quantile window. This is called by the exporter every
+ * METRICS_WINDOW_MS, so the quantiles don't depend on how often the metrics
+ * are rendered.
+ */
+void metrics_end_window(void) {
+  for (int i = 0; i < metrics.count; i++) {
+    metrics_metric_t *metric = &metrics.metrics[i];
+
+    if (metric->type != METRICS_HISTOGRAM) continue;
+
+    memcpy(metric->window_start, metric->window_end, sizeof(metric->window_start));
+
+    for (int j = 0; j <= metric->num_bounds; j++) {
+      metric->window_end[j] = atomic_load_explicit(&metric->buckets[j], memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Renders all metrics in the Prometheus text format, and returns the length
+ * of the text. Histograms also export the 50th, 90th, and 99th percentiles
+ * of the observations in the last complete quantile window.
+ */
+int metrics_render(char *buffer, int size) {
+  int len = 0;
+  const char *last_name = 0;
+
+#define METRICS_PRINTF(...) \
+  if (len < size) len += snprintf(buffer + len, size - len, __VA_ARGS__)
+
+  for (int i = 0; i < metrics.count; i++) {
+    metrics_metric_t *metric = &metrics.metrics[i];
+    uint64_t value = atomic_load_explicit(&metric->value, memory_order_relaxed);
+
+    /* metrics with labels share a name, which is only described once */
+    if (!last_name || strcmp(last_name, metric->name) != 0) {
+      METRICS_PRINTF("# HELP %s %s\n", metric->name, metric->help);
+      METRICS_PRINTF("# TYPE %s %s\n", metric->name, metric->type == METRICS_COUNTER ? "counter" : "histogram");
+      last_name = metric->name;
+    }
+
+    if (metric->type == METRICS_COUNTER) {
+      if (metric->labels) {
+        METRICS_PRINTF("%s{%s} %.9g\n", metric->name, metric->labels, value * metric->scale);
+      } else {
+        METRICS_PRINTF("%s %.9g\n", metric->name, value * metric->scale);
+      }
+      continue;
+    }
+
+    uint64_t count = 0;
+    uint64_t window_count = 0;
+
+    for (int j = 0; j <= metric->num_bounds; j++) {
+      count += atomic_load_explicit(&metric->buckets[j], memory_order_relaxed);
+      window_count += metric->window_end[j] - metric->window_start[j];
+
+      if (j < metric->num_bounds) {
+        METRICS_PRINTF("%s_bucket{le=\"%.9g\"} %llu\n", metric->name, metric->bounds[j] * metric->scale, (unsigned long long)count);
+      } else {
+        METRICS_PRINTF("%s_bucket{le=\"+Inf\"} %llu\n", metric->name, (unsigned long long)count);
+      }
+    }
+
+    METRICS_PRINTF("%s_sum %.9g\n", metric->name, value * metric->scale);
+    METRICS_PRINTF("%s_count %llu\n", metric->name, (unsigned long long)count);
+
+    /* window quantiles, as the upper bound of the bucket containing them */
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+    METRICS_PRINTF("# TYPE %s_quantile gauge\n", metric->name);
+
+    for (int q = 0; q < 3; q++) {
+      uint64_t target = (uint64_t)(quantiles[q] * window_count);
+      uint64_t cumulative = 0;
+      int j = 0;
+
+      while (j < metric->num_bounds) {
+        cumulative += metric->window_end[j] - metric->window_start[j];
+        if (cumulative > target) break;
+        j++;
+      }
+
+      if (window_count == 0) {
+        METRICS_PRINTF("%s_quantile{quantile=\"%g\"} NaN\n", metric->name, quantiles[q]);
+      } else if (j == metric->num_bounds) {
+        METRICS_PRINTF("%s_quantile{quantile=\"%g\"} +Inf\n", metric->name, quantiles[q]);
+      } else {
+        METRICS_PRINTF("%s_quantile{quantile=\"%g\"} %.9g\n", metric->name, quantiles[q], metric->bounds[j] * metric->scale);
+      }
+    }
+  }
+
+#undef METRICS_PRINTF
+
+  return len < size ? len : size - 1;
+}
+
+/*== EXPORTER ================================================================*/
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The exporter runs on its own thread, and either serves the metrics to
+ * every client which connects to a Unix domain socket, or periodically
+ * rewrites a Prometheus textfile (for the node exporter textfile collector). */
+typedef struct {
+  pthread_t thread;
+  atomic_bool running;
+  char path[256];
+  int interval_ms;
+  int socket;
+  char buffer[METRICS_BUFFER_SIZE];
+} metrics_exporter_t;
+
+static metrics_exporter_t metrics_exporter;
+
+/* the exporter thread wakes up at this interval, to check whether it has been
+ * stopped, and whether a quantile window has ended */
+#define METRICS_POLL_MS 250
+
+static uint64_t metrics_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void metrics_write_file(void) {
+  char tmp_path[sizeof(metrics_exporter.path) + 4];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_exporter.path);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (!file) return;
+
+  int len = metrics_render(metrics_exporter.buffer, METRICS_BUFFER_SIZE);
+  fwrite(metrics_exporter.buffer, 1, len, file);
+  fclose(file);
+
+  /* replace the file atomically, so the collector never sees a partial file */
+  rename(tmp_path, metrics_exporter.path);
+}
+
+static void *metrics_thread(void *arg) {
+  (void)arg;
+
+  uint64_t next_window = metrics_now_ms() + METRICS_WINDOW_MS;
+  uint64_t next_write = 0;
+
+  while (atomic_load(&metrics_exporter.running)) {
+    uint64_t now = metrics_now_ms();
+
+    if (now >= next_window) {
+      metrics_end_window();
+      next_window = now + METRICS_WINDOW_MS;
+    }
+
+    if (metrics_exporter.socket < 0) {
+      if (now >= next_write) {
+        metrics_write_file();
+        next_write = now + metrics_exporter.interval_ms;
+      }
+
+      struct timespec ts = { .tv_nsec = METRICS_POLL_MS * 1000000L };
+      nanosleep(&ts, 0);
+      continue;
+    }
+
+    /* wake up regularly, to check if the exporter has been stopped */
+    struct pollfd pfd = { .fd = metrics_exporter.socket, .events = POLLIN };
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) continue;
+
+    int client = accept(metrics_exporter.socket, 0, 0);
+    if (client < 0) continue;
+
+    int len = metrics_render(metrics_exporter.buffer, METRICS_BUFFER_SIZE);
+    for (int sent = 0; sent < len;) {
+      ssize_t n = write(client, metrics_exporter.buffer + sent, len - sent);
+      if (n <= 0) break;
+      sent += n;
+    }
+    close(client);
+  }
+
+  return 0;
+}
+
+static bool metrics_start(const char *path, bool use_socket, int interval_ms) {
+  memset(&metrics_exporter, 0, sizeof(metrics_exporter));
+  snprintf(metrics_exporter.path, sizeof(metrics_exporter.path), "%s", path);
+  metrics_exporter.interval_ms = interval_ms;
+  metrics_exporter.socket = -1;
+
+  if (use_socket) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+      fprintf(stderr, "metrics: failed to listen on %s\n", path);
+      if (fd >= 0) close(fd);
+      return false;
+    }
+
+    metrics_exporter.socket = fd;
+  }
+
+  atomic_store(&metrics_exporter.running, true);
+
+  if (pthread_create(&metrics_exporter.thread, 0, metrics_thread, 0) != 0) {
+    atomic_store(&metrics_exporter.running, false);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Starts a thread which rewrites the given Prometheus textfile at the given
+ * interval, which must be positive.
+ */
+bool metrics_start_file(const char *path, int interval_ms) {
+  if (interval_ms <= 0) {
+    fprintf(stderr, "metrics: invalid interval %dms\n", interval_ms);
+    return false;
+  }
+
+  return metrics_start(path, false, interval_ms);
+}
+
+/**
+ * Starts a thread which serves the metrics on the given Unix domain socket.
+ */
+bool metrics_start_socket(const char *path) {
+  return metrics_start(path, true, 0);
+}
+
+/**
+ * Stops the exporter thread.
+ */
+void metrics_stop(void) {
+  if (!atomic_load(&metrics_exporter.running)) return;
+
+  atomic_store(&metrics_exporter.running, false);
+  pthread_join(metrics_exporter.thread, 0);
+
+  if (metrics_exporter.socket >= 0) {
+    close(metrics_exporter.socket);
+    unlink(metrics_exporter.path);
+  }
+}
+
+#else
+
+bool metrics_start_file(const char *path, int interval_ms) { return false; }
+bool metrics_start_socket(const char *path) { return false; }
+void metrics_stop(void) {}
+
+#endif
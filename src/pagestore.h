@@ -0,0 +1,268 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A content-addressed page store.
+ *
+ * States are split into fixed-size pages, and each distinct page is stored
+ * once, with a reference count. Most of the RAM doesn't change from one state
+ * to the next, so when many states are stored the memory used scales with the
+ * number of distinct pages, rather than the number of states.
+ *
+ * Pages are identified by 32-bit ids, which stay valid until the page is
+ * released. Id 0 is never used, so it can mean "no page". */
+#define PAGE_STORE_PAGE_SIZE 256
+
+/* the number of pages needed to store a block of the given size */
+#define PAGE_STORE_PAGES(size) (((size) + PAGE_STORE_PAGE_SIZE - 1) / PAGE_STORE_PAGE_SIZE)
+
+#define PAGE_STORE_INITIAL_CAPACITY 1024
+
+typedef struct {
+  uint64_t hash;
+  uint32_t refs;
+
+  /* the next page in the same hash bucket, or the next free page */
+  uint32_t next;
+} page_store_entry_t;
+
+typedef struct {
+  /* page data and entries, indexed by page id */
+  uint8_t *data;
+  page_store_entry_t *entries;
+  uint32_t count;
+  uint32_t capacity;
+
+  /* hash buckets, each is the id of the first page in a chain */
+  uint32_t *buckets;
+  uint32_t bucket_mask;
+
+  /* pages which have been released */
+  uint32_t free_list;
+
+  /* the number of live pages, and the references to them */
+  uint32_t pages;
+  uint64_t refs;
+} page_store_t;
+
+/**
+ * Hashes a page, eight bytes at a time.
+ */
+static inline uint64_t page_store_hash(const uint8_t *page) {
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (int i = 0; i < PAGE_STORE_PAGE_SIZE; i += 8) {
+    uint64_t word;
+    memcpy(&word, page + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3;
+    hash ^= hash >> 29;
+  }
+
+  return hash;
+}
+
+static inline uint8_t *page_store_data(page_store_t *store, uint32_t id) {
+  return store->data + (size_t)id * PAGE_STORE_PAGE_SIZE;
+}
+
+/**
+ * Grows the store, and rebuilds the hash buckets so that the chains stay
+ * short.
+ */
+static void page_store_grow(page_store_t *store) {
+  store->capacity = store->capacity ? store->capacity * 2 : PAGE_STORE_INITIAL_CAPACITY;
+  store->data = realloc(store->data, (size_t)store->capacity * PAGE_STORE_PAGE_SIZE);
+  store->entries = realloc(store->entries, store->capacity * sizeof(page_store_entry_t));
+  assert(store->data && store->entries);
+
+  free(store->buckets);
+  store->bucket_mask = store->capacity - 1;
+  store->buckets = calloc(store->capacity, sizeof(uint32_t));
+  assert(store->buckets);
+
+  for (uint32_t id = 1; id < store->count; id++) {
+    page_store_entry_t *entry = &store->entries[id];
+
+    if (entry->refs == 0) continue;
+
+    uint32_t *bucket = &store->buckets[entry->hash & store->bucket_mask];
+    entry->next = *bucket;
+    *bucket = id;
+  }
+}
+
+void page_store_init(page_store_t *store) {
+  memset(store, 0, sizeof(page_store_t));
+
+  /* id 0 is reserved */
+  store->count = 1;
+  page_store_grow(store);
+}
+
+void page_store_shutdown(page_store_t *store) {
+  free(store->data);
+  free(store->entries);
+  free(store->buckets);
+  memset(store, 0, sizeof(page_store_t));
+}
+
+/**
+ * Adds a reference to the page with the given contents, storing it if it
+ * isn't already in the store, and returns its id.
+ */
+uint32_t page_store_put(page_store_t *store, const uint8_t *page) {
+  uint64_t hash = page_store_hash(page);
+
+  for (uint32_t id = store->buckets[hash & store->bucket_mask]; id; id = store->entries[id].next) {
+    if (store->entries[id].hash == hash && memcmp(page_store_data(store, id), page, PAGE_STORE_PAGE_SIZE) == 0) {
+      store->entries[id].refs++;
+      store->refs++;
+      return id;
+    }
+  }
+
+  uint32_t id = store->free_list;
+
+  if (id) {
+    store->free_list = store->entries[id].next;
+  } else {
+    if (store->count == store->capacity) page_store_grow(store);
+    id = store->count++;
+  }
+
+  page_store_entry_t *entry = &store->entries[id];
+  uint32_t *bucket = &store->buckets[hash & store->bucket_mask];
+
+  memcpy(page_store_data(store, id), page, PAGE_STORE_PAGE_SIZE);
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->next = *bucket;
+  *bucket = id;
+
+  store->pages++;
+  store->refs++;
+
+  return id;
+}
+
+/**
+ * Returns the contents of the given page.
+ */
+const uint8_t *page_store_get(page_store_t *store, uint32_t id) {
+  return page_store_data(store, id);
+}
+
+/**
+ * Removes a reference to the given page, and frees it when there are none
+ * left.
+ */
+void page_store_release(page_store_t *store, uint32_t id) {
+  page_store_entry_t *entry = &store->entries[id];
+
+  store->refs--;
+
+  if (--entry->refs > 0) return;
+
+  /* unlink the page from its bucket */
+  uint32_t *link = &store->buckets[entry->hash & store->bucket_mask];
+  while (*link != id) link = &store->entries[*link].next;
+  *link = entry->next;
+
+  entry->next = store->free_list;
+  store->free_list = id;
+  store->pages--;
+}
+
+/**
+ * Stores a block of data as a list of pages, writing the page ids to the
+ * given array, which must have room for PAGE_STORE_PAGES(size) ids. The last
+ * page is padded with zeroes.
+ */
+void page_store_put_block(page_store_t *store, const void *data, size_t size, uint32_t *ids) {
+  const uint8_t *p = data;
+  uint8_t last[PAGE_STORE_PAGE_SIZE];
+
+  for (size_t i = 0; i < PAGE_STORE_PAGES(size); i++, p += PAGE_STORE_PAGE_SIZE) {
+    size_t len = size - i * PAGE_STORE_PAGE_SIZE;
+
+    if (len < PAGE_STORE_PAGE_SIZE) {
+      memset(last, 0, sizeof(last));
+      memcpy(last, p, len);
+      ids[i] = page_store_put(store, last);
+    } else {
+      ids[i] = page_store_put(store, p);
+    }
+  }
+}
+
+/**
+ * Copies a block of data stored with page_store_put_block.
+ */
+void page_store_get_block(page_store_t *store, const uint32_t *ids, void *data, size_t size) {
+  uint8_t *p = data;
+
+  for (size_t i = 0; i < PAGE_STORE_PAGES(size); i++, p += PAGE_STORE_PAGE_SIZE) {
+    size_t len = size - i * PAGE_STORE_PAGE_SIZE;
+    memcpy(p, page_store_get(store, ids[i]), len < PAGE_STORE_PAGE_SIZE ? len : PAGE_STORE_PAGE_SIZE);
+  }
+}
+
+/**
+ * Releases the pages of a block of data.
+ */
+void page_store_release_block(page_store_t *store, const uint32_t *ids, size_t size) {
+  for (size_t i = 0; i < PAGE_STORE_PAGES(size); i++) {
+    page_store_release(store, ids[i]);
+  }
+}
+
+/**
+ * Returns the number of bytes used by the store, including the page data that
+ * has been allocated but not used yet.
+ */
+size_t page_store_size(const page_store_t *store) {
+  return (size_t)store->capacity * (PAGE_STORE_PAGE_SIZE + sizeof(page_store_entry_t) + sizeof(uint32_t));
+}
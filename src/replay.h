@@ -0,0 +1,496 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* A replay is a recording of the input values read by the game, along with
+ * periodic keyframes containing compressed machine snapshots, so that it can
+ * be played back from any frame.
+ *
+ * The file starts with a header, followed by a segment for each keyframe.
+ * Each segment contains the keyframe, and the input events up until the next
+ * keyframe. An event is recorded whenever the game reads a different value
+ * from an input port, and is stamped with the CPU cycle of the read.
+ *
+ * An index of the segments and a trailer are written at the end of the file,
+ * so a player can find the nearest keyframe to any frame without scanning the
+ * file. The trailer also contains the hash of the machine state when the
+ * recording stopped, so that the last segment can be verified like the others,
+ * which end at the next keyframe. */
+#define REPLAY_MAGIC 0x52475952 /* "RYGR" */
+#define REPLAY_INDEX_MAGIC 0x49475952 /* "RYGI" */
+#define REPLAY_VERSION 2
+
+/* the default number of frames between keyframes */
+#define REPLAY_KEYFRAME_INTERVAL 60
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t snapshot_size;
+  uint32_t keyframe_interval;
+  uint32_t cpu_freq;
+  uint32_t reserved;
+} replay_header_t;
+
+typedef struct {
+  uint64_t cycle;
+  uint32_t frame;
+  uint32_t packed_size;
+} replay_keyframe_t;
+
+typedef struct {
+  uint64_t cycle;
+  uint8_t port;
+  uint8_t value;
+  uint8_t reserved[6];
+} replay_event_t;
+
+typedef struct {
+  uint64_t cycle;
+  uint64_t offset;
+  uint32_t frame;
+  uint32_t event_count;
+} replay_index_t;
+
+typedef struct {
+  uint64_t index_offset;
+  uint32_t count;
+  uint32_t frames;
+  uint32_t magic;
+  uint32_t reserved;
+
+  /* the cycle and the snapshot hash when the recording stopped */
+  uint64_t end_cycle;
+  uint64_t end_hash;
+} replay_trailer_t;
+
+typedef struct {
+  FILE *file;
+  int keyframe_interval;
+  int snapshot_size;
+
+  /* segment index */
+  replay_index_t *index;
+  uint32_t count;
+  uint32_t capacity;
+
+  /* compressed snapshot */
+  uint8_t *packed;
+
+  /* stats */
+  uint64_t keyframe_bytes;
+  uint32_t events;
+} replay_recorder_t;
+
+/**
+ * Returns the FNV-1a hash of the given data.
+ */
+uint64_t replay_hash(const void *data, size_t size) {
+  const uint8_t *p = data;
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3;
+  }
+
+  return hash;
+}
+
+/**
+ * Starts recording a replay to the given file. The caller must record a
+ * keyframe before any events.
+ */
+bool replay_record_start(replay_recorder_t *recorder, const char *filename, int snapshot_size, int keyframe_interval, uint32_t cpu_freq) {
+  memset(recorder, 0, sizeof(replay_recorder_t));
+
+  recorder->file = fopen(filename, "wb");
+
+  if (!recorder->file) {
+    fprintf(stderr, "replay: failed to open %s\n", filename);
+    return false;
+  }
+
+  recorder->snapshot_size = snapshot_size;
+  recorder->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : REPLAY_KEYFRAME_INTERVAL;
+  recorder->packed = malloc(LZ_COMPRESS_BOUND(snapshot_size));
+
+  replay_header_t header = {
+    .magic = REPLAY_MAGIC,
+    .version = REPLAY_VERSION,
+    .snapshot_size = snapshot_size,
+    .keyframe_interval = recorder->keyframe_interval,
+    .cpu_freq = cpu_freq,
+  };
+
+  fwrite(&header, sizeof(header), 1, recorder->file);
+
+  return true;
+}
+
+static inline bool replay_recording(replay_recorder_t *recorder) {
+  return recorder->file != 0;
+}
+
+/**
+ * Returns true if a keyframe should be recorded for the given frame.
+ */
+static inline bool replay_keyframe_due(replay_recorder_t *recorder, uint32_t frame) {
+  if (!recorder->file) return false;
+  if (recorder->count == 0) return true;
+
+  return frame - recorder->index[recorder->count - 1].frame >= (uint32_t)recorder->keyframe_interval;
+}
+
+/**
+ * Records a keyframe, starting a new segment.
+ */
+void replay_record_keyframe(replay_recorder_t *recorder, uint32_t frame, uint64_t cycle, const void *snapshot) {
+  if (recorder->count == recorder->capacity) {
+    recorder->capacity = recorder->capacity ? recorder->capacity * 2 : 1024;
+    recorder->index = realloc(recorder->index, recorder->capacity * sizeof(replay_index_t));
+  }
+
+  int packed_size = lz_compress(snapshot, recorder->snapshot_size, recorder->packed, LZ_COMPRESS_BOUND(recorder->snapshot_size));
+
+  replay_keyframe_t keyframe = {
+    .cycle = cycle,
+    .frame = frame,
+    .packed_size = packed_size,
+  };
+
+  recorder->index[recorder->count++] = (replay_index_t) {
+    .cycle = cycle,
+    .offset = ftell(recorder->file),
+    .frame = frame,
+  };
+
+  fwrite(&keyframe, sizeof(keyframe), 1, recorder->file);
+  fwrite(recorder->packed, 1, packed_size, recorder->file);
+
+  recorder->keyframe_bytes += sizeof(keyframe) + packed_size;
+}
+
+/**
+ * Records an input port value read by the game.
+ */
+void replay_record_event(replay_recorder_t *recorder, uint64_t cycle, uint8_t port, uint8_t value) {
+  replay_event_t event = {
+    .cycle = cycle,
+    .port = port,
+    .value = value,
+  };
+
+  fwrite(&event, sizeof(event), 1, recorder->file);
+
+  recorder->index[recorder->count - 1].event_count++;
+  recorder->events++;
+}
+
+/**
+ * Stops recording, and writes the index and the hash of the given snapshot of
+ * the final machine state.
+ */
+bool replay_record_stop(replay_recorder_t *recorder, uint32_t frames, uint64_t cycle, const void *snapshot) {
+  if (!recorder->file) return false;
+
+  replay_trailer_t trailer = {
+    .index_offset = ftell(recorder->file),
+    .count = recorder->count,
+    .frames = frames,
+    .magic = REPLAY_INDEX_MAGIC,
+    .end_cycle = cycle,
+    .end_hash = replay_hash(snapshot, recorder->snapshot_size),
+  };
+
+  fwrite(recorder->index, sizeof(replay_index_t), recorder->count, recorder->file);
+  fwrite(&trailer, sizeof(trailer), 1, recorder->file);
+
+  bool ok = !ferror(recorder->file);
+
+  if (fclose(recorder->file) != 0) ok = false;
+
+  if (recorder->count > 0) {
+    printf("replay: %u frames, %u keyframes (%.0f bytes average), %u events\n",
+      frames,
+      recorder->count,
+      (double)recorder->keyframe_bytes / recorder->count,
+      recorder->events);
+  }
+
+  free(recorder->index);
+  free(recorder->packed);
+  memset(recorder, 0, sizeof(replay_recorder_t));
+
+  return ok;
+}
+
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  /* the memory-mapped file */
+  uint8_t *data;
+  size_t size;
+
+  const replay_header_t *header;
+  const replay_index_t *index;
+  uint32_t count;
+  uint32_t frames;
+
+  /* the cycle and the snapshot hash at the end of the last segment */
+  uint64_t end_cycle;
+  uint64_t end_hash;
+
+  /* the next event to be played back */
+  uint32_t segment;
+  uint32_t event;
+
+  /* decompressed snapshot */
+  uint8_t *snapshot;
+} replay_player_t;
+
+static inline bool replay_playing(replay_player_t *player) {
+  return player->data != 0;
+}
+
+void replay_close(replay_player_t *player) {
+  if (player->data) munmap(player->data, player->size);
+  free(player->snapshot);
+  memset(player, 0, sizeof(replay_player_t));
+}
+
+/**
+ * Checks every segment in the index lies between the header and the index,
+ * and the keyframes are in frame order, so playback can read them without
+ * checking.
+ */
+static bool replay_check_index(replay_player_t *player, uint64_t index_offset) {
+  for (uint32_t i = 0; i < player->count; i++) {
+    const replay_index_t *entry = &player->index[i];
+    replay_keyframe_t keyframe;
+
+    if (entry->offset < sizeof(replay_header_t) ||
+        entry->offset > index_offset ||
+        index_offset - entry->offset < sizeof(keyframe)) {
+      return false;
+    }
+
+    memcpy(&keyframe, player->data + entry->offset, sizeof(keyframe));
+
+    uint64_t available = index_offset - entry->offset - sizeof(keyframe);
+
+    if (keyframe.packed_size > available ||
+        entry->event_count > (available - keyframe.packed_size) / sizeof(replay_event_t) ||
+        keyframe.frame != entry->frame ||
+        (i > 0 && entry->frame <= player->index[i - 1].frame)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Opens a replay for playback. The file is memory-mapped, so only the
+ * keyframes and events which are played back are read from disk.
+ */
+bool replay_open(replay_player_t *player, const char *filename) {
+  memset(player, 0, sizeof(replay_player_t));
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)(sizeof(replay_header_t) + sizeof(replay_trailer_t))) {
+    fprintf(stderr, "replay: failed to open %s\n", filename);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+
+  player->size = st.st_size;
+  player->data = mmap(0, player->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (player->data == MAP_FAILED) {
+    player->data = 0;
+    fprintf(stderr, "replay: failed to map %s\n", filename);
+    return false;
+  }
+
+  replay_trailer_t trailer;
+  memcpy(&trailer, player->data + player->size - sizeof(trailer), sizeof(trailer));
+
+  player->header = (const replay_header_t *)player->data;
+
+  /* the index lies between the header and the trailer */
+  size_t end = player->size - sizeof(trailer);
+
+  if (player->header->magic != REPLAY_MAGIC ||
+      player->header->version != REPLAY_VERSION ||
+      trailer.magic != REPLAY_INDEX_MAGIC ||
+      trailer.count == 0 ||
+      trailer.index_offset < sizeof(replay_header_t) ||
+      trailer.index_offset > end ||
+      trailer.count > (end - trailer.index_offset) / sizeof(replay_index_t) ||
+      trailer.index_offset + trailer.count * sizeof(replay_index_t) != end) {
+    fprintf(stderr, "replay: invalid replay %s\n", filename);
+    replay_close(player);
+    return false;
+  }
+
+  player->index = (const replay_index_t *)(player->data + trailer.index_offset);
+  player->count = trailer.count;
+
+  if (!replay_check_index(player, trailer.index_offset) || trailer.end_cycle < player->index[player->count - 1].cycle) {
+    fprintf(stderr, "replay: invalid replay %s\n", filename);
+    replay_close(player);
+    return false;
+  }
+
+  player->frames = trailer.frames;
+  player->end_cycle = trailer.end_cycle;
+  player->end_hash = trailer.end_hash;
+  player->snapshot = malloc(player->header->snapshot_size);
+
+  return true;
+}
+
+/**
+ * Returns the segment to play back from to reach the given frame: the last
+ * keyframe at or before it, or the first keyframe.
+ */
+uint32_t replay_find(replay_player_t *player, uint32_t frame) {
+  uint32_t lo = 0;
+  uint32_t hi = player->count;
+
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+
+    if (player->index[mid].frame <= frame) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/**
+ * Decompresses the keyframe of the given segment, and moves playback to the
+ * start of the segment. Returns the snapshot, or null if it is corrupt.
+ */
+const void *replay_keyframe(replay_player_t *player, uint32_t segment) {
+  const replay_index_t *entry = &player->index[segment];
+  replay_keyframe_t keyframe;
+
+  if (entry->offset + sizeof(keyframe) > player->size) return 0;
+
+  memcpy(&keyframe, player->data + entry->offset, sizeof(keyframe));
+
+  const uint8_t *packed = player->data + entry->offset + sizeof(keyframe);
+  int size = player->header->snapshot_size;
+
+  if (entry->offset + sizeof(keyframe) + keyframe.packed_size > player->size ||
+      lz_decompress(packed, keyframe.packed_size, player->snapshot, size) != size) {
+    return 0;
+  }
+
+  player->segment = segment;
+  player->event = 0;
+
+  return player->snapshot;
+}
+
+/**
+ * Returns the next event, if it happens at or before the given cycle.
+ */
+bool replay_next_event(replay_player_t *player, uint64_t cycle, uint8_t *port, uint8_t *value) {
+  /* skip to the next segment with events */
+  while (player->segment < player->count && player->event >= player->index[player->segment].event_count) {
+    player->segment++;
+    player->event = 0;
+  }
+
+  if (player->segment >= player->count) return false;
+
+  const replay_index_t *entry = &player->index[player->segment];
+  replay_keyframe_t keyframe;
+  replay_event_t event;
+
+  memcpy(&keyframe, player->data + entry->offset, sizeof(keyframe));
+
+  size_t offset = entry->offset + sizeof(keyframe) + keyframe.packed_size + player->event * sizeof(event);
+
+  if (offset + sizeof(event) > player->size) return false;
+
+  memcpy(&event, player->data + offset, sizeof(event));
+
+  if (event.cycle > cycle) return false;
+
+  *port = event.port;
+  *value = event.value;
+  player->event++;
+
+  return true;
+}
+
+#else
+
+typedef struct { uint8_t *data; const replay_header_t *header; uint32_t count; uint32_t frames; } replay_player_t;
+
+static inline bool replay_playing(replay_player_t *player) { return false; }
+void replay_close(replay_player_t *player) {}
+bool replay_open(replay_player_t *player, const char *filename) { return false; }
+uint32_t replay_find(replay_player_t *player, uint32_t frame) { return 0; }
+const void *replay_keyframe(replay_player_t *player, uint32_t segment) { return 0; }
+bool replay_next_event(replay_player_t *player, uint64_t cycle, uint8_t *port, uint8_t *value) { return false; }
+
+#endif
@@ -0,0 +1,468 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rygar.h"
+
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+#define RUNAHEAD_THREADS
+#include <pthread.h>
+#endif
+
+/* Run-ahead hides the input lag built into the game, by presenting the frame
+ * the game would draw a few frames in the future if the current input were
+ * held. After each frame, the machine is checkpointed, run ahead without
+ * rendering until the last look-ahead frame, and rolled back. The look-ahead
+ * frames are speculative, so they aren't recorded or sent to spectators, and
+ * the presented frame is published in place of the real one.
+ *
+ * The look-ahead frames have to be run again on every frame, because the input
+ * may have changed. In the speculative mode, worker threads run ahead from the
+ * end of each frame with the inputs most likely to come next: the current
+ * input held, and the inputs which have most often followed it. If the actual
+ * input matches a branch then its frame is presented as soon as the frame
+ * itself has run, otherwise the look-ahead frames are run serially. */
+#define RUNAHEAD_MAX_FRAMES 8
+#define RUNAHEAD_MAX_BRANCHES 8
+
+/* inputs are packed as the joystick, buttons, and system ports */
+#define RUNAHEAD_INPUT(joystick, buttons, sys) ((uint32_t)(joystick) | (uint32_t)(buttons) << 8 | (uint32_t)(sys) << 16)
+
+/* transitions are tracked between the joystick directions and buttons */
+#define RUNAHEAD_NUM_KEYS 64
+#define RUNAHEAD_KEY(input) (((input) & 0x0f) | ((input) >> 4 & 0x30))
+#define RUNAHEAD_KEY_INPUT(key) (((key) & 0x0f) | ((key) & 0x30) << 4)
+#define RUNAHEAD_KEY_MASK RUNAHEAD_KEY_INPUT(RUNAHEAD_NUM_KEYS - 1)
+
+/* transition counts are halved when one reaches this, so that recent
+ * transitions count for more */
+#define RUNAHEAD_MAX_COUNT 256
+
+typedef struct runahead_t runahead_t;
+
+typedef struct {
+  runahead_t *runahead;
+
+  /* the machine which runs ahead, and its frame buffer */
+  rygar_t *machine;
+  uint32_t *framebuffer;
+
+  /* the input held by the branch, and whether it was started from the current
+   * frame */
+  uint32_t input;
+  bool active;
+
+  /* set while the worker is running the branch */
+  bool busy;
+  uint32_t generation;
+
+#ifdef RUNAHEAD_THREADS
+  pthread_t thread;
+#endif
+} runahead_branch_t;
+
+struct runahead_t {
+  rygar_t *rygar;
+
+  /* the number of look-ahead frames, and speculative branches */
+  int frames;
+  int branches;
+
+  /* the state the machine is rolled back to after running ahead */
+  rygar_checkpoint_t checkpoint;
+
+  /* the input of the previous frame, and how often each input has followed
+   * each other input */
+  uint32_t input;
+  uint16_t transitions[RUNAHEAD_NUM_KEYS][RUNAHEAD_NUM_KEYS];
+
+  /* the branches, and the cycle they were started from */
+  runahead_branch_t branch[RUNAHEAD_MAX_BRANCHES];
+  uint64_t branch_cycles;
+
+#ifdef RUNAHEAD_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  bool quit;
+#endif
+
+  /* statistics, the times are from the start of a frame until its look-ahead
+   * frame is ready to present */
+  uint32_t hits;
+  uint32_t misses;
+  uint64_t hit_time;
+  uint64_t miss_time;
+};
+
+/**
+ * Sets the input ports of a machine.
+ */
+static void runahead_set_input(rygar_t *rygar, uint32_t input) {
+  rygar->main.joystick = input & 0xff;
+  rygar->main.buttons = input >> 8 & 0xff;
+  rygar->main.sys = input >> 16 & 0xff;
+}
+
+/**
+ * Latches all pending host input events into the input ports, and returns the
+ * input for the next frame. With run-ahead, the input can only change between
+ * frames, as the look-ahead frames need to know it.
+ */
+uint32_t runahead_latch_input(rygar_t *rygar) {
+  uint64_t now = stm_now();
+
+  for (int port = 0; port < INPUT_NUM_PORTS; port++) {
+    input_latch(&rygar->input, port, rygar_input_reg(rygar, port), now);
+  }
+
+  return RUNAHEAD_INPUT(rygar->main.joystick, rygar->main.buttons, rygar->main.sys);
+}
+
+/**
+ * Runs the given number of look-ahead frames, only rendering the last one.
+ */
+static void runahead_run(rygar_t *rygar, int frames) {
+  bool skip_render = rygar->skip_render;
+
+  rygar->skip_render = true;
+  rygar->speculative = true;
+
+  for (int i = 0; i < frames; i++) {
+    if (i == frames - 1) rygar->skip_render = skip_render;
+    if (!rygar_run_frame(rygar)) break;
+  }
+
+  rygar->skip_render = skip_render;
+  rygar->speculative = false;
+}
+
+/**
+ * Counts a transition between two inputs.
+ */
+static void runahead_count(runahead_t *runahead, uint32_t from, uint32_t to) {
+  uint16_t *counts = runahead->transitions[RUNAHEAD_KEY(from)];
+
+  if (++counts[RUNAHEAD_KEY(to)] < RUNAHEAD_MAX_COUNT) return;
+
+  for (int i = 0; i < RUNAHEAD_NUM_KEYS; i++) counts[i] >>= 1;
+}
+
+/**
+ * Predicts the inputs for the next frame, and returns the number of
+ * candidates. The current input is always the first candidate, followed by
+ * the inputs which have most often followed it.
+ */
+static int runahead_predict(runahead_t *runahead, uint32_t input, uint32_t *candidates) {
+  const uint16_t *counts = runahead->transitions[RUNAHEAD_KEY(input)];
+  bool chosen[RUNAHEAD_NUM_KEYS] = { false };
+  int count = 0;
+
+  candidates[count++] = input;
+  chosen[RUNAHEAD_KEY(input)] = true;
+
+  while (count < runahead->branches) {
+    int best = -1;
+
+    for (int key = 0; key < RUNAHEAD_NUM_KEYS; key++) {
+      if (chosen[key] || counts[key] == 0) continue;
+      if (best < 0 || counts[key] > counts[best]) best = key;
+    }
+
+    if (best < 0) break;
+
+    chosen[best] = true;
+    candidates[count++] = (input & ~RUNAHEAD_KEY_MASK) | RUNAHEAD_KEY_INPUT(best);
+  }
+
+  return count;
+}
+
+/**
+ * Runs a branch: the frame the branch is predicting, followed by the
+ * look-ahead frames.
+ */
+static void runahead_run_branch(runahead_t *runahead, runahead_branch_t *branch) {
+  runahead_run(branch->machine, runahead->frames + 1);
+}
+
+#ifdef RUNAHEAD_THREADS
+static void *runahead_worker(void *arg) {
+  runahead_branch_t *branch = arg;
+  runahead_t *runahead = branch->runahead;
+  uint32_t generation = 0;
+
+  pthread_mutex_lock(&runahead->lock);
+
+  for (;;) {
+    while (!runahead->quit && branch->generation == generation) {
+      pthread_cond_wait(&runahead->start, &runahead->lock);
+    }
+
+    if (runahead->quit) break;
+
+    generation = branch->generation;
+    pthread_mutex_unlock(&runahead->lock);
+
+    runahead_run_branch(runahead, branch);
+
+    pthread_mutex_lock(&runahead->lock);
+    branch->busy = false;
+    pthread_cond_broadcast(&runahead->done);
+  }
+
+  pthread_mutex_unlock(&runahead->lock);
+
+  return 0;
+}
+
+/**
+ * Waits for the workers to finish running the given branches.
+ */
+static void runahead_wait(runahead_t *runahead, runahead_branch_t *branch, int count) {
+  pthread_mutex_lock(&runahead->lock);
+
+  for (int i = 0; i < count; i++) {
+    while (branch[i].busy) pthread_cond_wait(&runahead->done, &runahead->lock);
+  }
+
+  pthread_mutex_unlock(&runahead->lock);
+}
+
+/**
+ * Starts the branches for the next frame, from the current state of the
+ * machine.
+ */
+static void runahead_speculate(runahead_t *runahead, uint32_t input) {
+  uint32_t candidates[RUNAHEAD_MAX_BRANCHES];
+  int count = runahead_predict(runahead, input, candidates);
+
+  /* the branches are normally done long before the next frame */
+  runahead_wait(runahead, runahead->branch, runahead->branches);
+
+  pthread_mutex_lock(&runahead->lock);
+
+  for (int i = 0; i < runahead->branches; i++) {
+    runahead_branch_t *branch = &runahead->branch[i];
+
+    branch->active = i < count;
+
+    if (!branch->active) continue;
+
+    rygar_clone(runahead->rygar, branch->machine);
+    runahead_set_input(branch->machine, candidates[i]);
+    branch->input = candidates[i];
+    branch->busy = true;
+    branch->generation++;
+  }
+
+  runahead->branch_cycles = runahead->rygar->cycles;
+
+  pthread_cond_broadcast(&runahead->start);
+  pthread_mutex_unlock(&runahead->lock);
+}
+#endif
+
+/**
+ * Initialises run-ahead of the given number of frames for a machine, with the
+ * given number of speculative branches (or none, to always run ahead
+ * serially). Speculation needs threads, so it is disabled where there are
+ * none.
+ */
+void runahead_init(runahead_t *runahead, rygar_t *rygar, int frames, int branches) {
+  if (frames < 1) frames = 1;
+  if (frames > RUNAHEAD_MAX_FRAMES) frames = RUNAHEAD_MAX_FRAMES;
+  if (branches < 0) branches = 0;
+  if (branches > RUNAHEAD_MAX_BRANCHES) branches = RUNAHEAD_MAX_BRANCHES;
+
+  memset(runahead, 0, sizeof(runahead_t));
+  runahead->rygar = rygar;
+  runahead->frames = frames;
+  runahead->input = RUNAHEAD_INPUT(rygar->main.joystick, rygar->main.buttons, rygar->main.sys);
+
+#ifdef RUNAHEAD_THREADS
+  pthread_mutex_init(&runahead->lock, 0);
+  pthread_cond_init(&runahead->start, 0);
+  pthread_cond_init(&runahead->done, 0);
+
+  for (int i = 0; i < branches; i++) {
+    runahead_branch_t *branch = &runahead->branch[runahead->branches];
+
+    branch->runahead = runahead;
+    branch->machine = malloc(sizeof(rygar_t));
+    branch->framebuffer = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+    rygar_init_clone(branch->machine, rygar, branch->framebuffer);
+
+    if (pthread_create(&branch->thread, 0, runahead_worker, branch) != 0) {
+      rygar_shutdown(branch->machine);
+      free(branch->machine);
+      free(branch->framebuffer);
+      break;
+    }
+
+    runahead->branches++;
+  }
+#endif
+}
+
+/**
+ * Stops the workers.
+ */
+void runahead_shutdown(runahead_t *runahead) {
+#ifdef RUNAHEAD_THREADS
+  pthread_mutex_lock(&runahead->lock);
+  runahead->quit = true;
+  pthread_cond_broadcast(&runahead->start);
+  pthread_mutex_unlock(&runahead->lock);
+
+  for (int i = 0; i < runahead->branches; i++) {
+    runahead_branch_t *branch = &runahead->branch[i];
+
+    pthread_join(branch->thread, 0);
+    rygar_shutdown(branch->machine);
+    free(branch->machine);
+    free(branch->framebuffer);
+  }
+
+  pthread_cond_destroy(&runahead->done);
+  pthread_cond_destroy(&runahead->start);
+  pthread_mutex_destroy(&runahead->lock);
+#endif
+
+  runahead->branches = 0;
+}
+
+/**
+ * Runs a frame with the current input, and presents the frame the game would
+ * draw after the look-ahead frames. Returns false if the emulation was stopped
+ * by a breakpoint or watchpoint.
+ */
+bool runahead_frame(runahead_t *runahead) {
+  rygar_t *rygar = runahead->rygar;
+  uint32_t input = RUNAHEAD_INPUT(rygar->main.joystick, rygar->main.buttons, rygar->main.sys);
+  uint64_t start = stm_now();
+  runahead_branch_t *hit = 0;
+
+  /* a branch only predicts the frame it was started from */
+  if (rygar->cycles == runahead->branch_cycles) {
+    for (int i = 0; i < runahead->branches && !hit; i++) {
+      if (runahead->branch[i].active && runahead->branch[i].input == input) hit = &runahead->branch[i];
+    }
+  }
+
+  if (input != runahead->input) runahead_count(runahead, runahead->input, input);
+  runahead->input = input;
+
+  /* the frame itself is never presented */
+  bool skip_render = rygar->skip_render;
+  rygar->skip_render = true;
+  bool ok = rygar_run_frame(rygar);
+  rygar->skip_render = skip_render;
+
+  if (!ok) return false;
+
+#ifdef RUNAHEAD_THREADS
+  if (hit) {
+    runahead_wait(runahead, hit, 1);
+
+    if (rygar->framebuffer && !rygar->skip_render) {
+      memcpy(rygar->framebuffer, hit->framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+      rygar->flip = hit->machine->flip;
+    }
+
+    runahead->hits++;
+    runahead->hit_time += stm_since(start);
+  }
+#endif
+
+  if (!hit) {
+    rygar_checkpoint_save(rygar, &runahead->checkpoint);
+    runahead_run(rygar, runahead->frames);
+    rygar_checkpoint_restore(rygar, &runahead->checkpoint);
+
+    runahead->misses++;
+    runahead->miss_time += stm_since(start);
+  }
+
+  /* the presented frame stands in for the real one, which wasn't rendered */
+  if (rygar->framebuffer && !rygar->skip_render) {
+    rygar_publish_frame(rygar);
+    if (rygar->latency_shadow) rygar_latency_frame(rygar, runahead->frames);
+  }
+
+#ifdef RUNAHEAD_THREADS
+  if (runahead->branches > 0) runahead_speculate(runahead, input);
+#endif
+
+  return true;
+}
+
+/**
+ * Prints the hit rate of the speculative branches, and the latency they saved.
+ */
+void runahead_report(runahead_t *runahead) {
+  uint32_t frames = runahead->hits + runahead->misses;
+
+  if (frames == 0) return;
+
+  double hit_ms = runahead->hits ? stm_ms(runahead->hit_time) / runahead->hits : 0;
+  double miss_ms = runahead->misses ? stm_ms(runahead->miss_time) / runahead->misses : 0;
+
+  printf("runahead: %d frames ahead, %d branches, %u frames, %u hits (%.1f%%)\n",
+    runahead->frames,
+    runahead->branches,
+    frames,
+    runahead->hits,
+    runahead->hits * 100.0 / frames);
+
+  printf("runahead: %.3fms per hit, %.3fms per miss", hit_ms, miss_ms);
+
+  /* the saving can only be measured when there were both hits and misses */
+  if (runahead->hits && runahead->misses) {
+    printf(", %.3fms latency saved per frame", (miss_ms - hit_ms) * runahead->hits / frames);
+  }
+
+  printf("\n");
+}
@@ -37,510 +37,293 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define CHIPS_IMPL
 #define COMMON_IMPL
 
-#include "bitmap.h"
-#include "chips/clk.h"
-#include "chips/mem.h"
-#include "chips/z80.h"
 #include "clock.h"
 #include "gfx.h"
-#include "rygar-roms.h"
+#include "metrics.h"
+#include "runahead.h"
+#include "rygar.h"
 #include "sokol_app.h"
-#include "sprite.h"
-#include "tile.h"
-#include "tilemap.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
-#define BETWEEN(n, a, b) ((n >= a) && (n <= b))
-
-#define CHAR_ROM_SIZE 0x10000
-#define FG_ROM_SIZE 0x40000
-#define BG_ROM_SIZE 0x40000
-#define SPRITE_ROM_SIZE 0x40000
-
-#define WORK_RAM_SIZE 0x1000
-#define WORK_RAM_START 0xc000
-#define WORK_RAM_END (WORK_RAM_START + WORK_RAM_SIZE - 1)
-
-#define CHAR_RAM_SIZE 0x800
-#define CHAR_RAM_START 0xd000
-#define CHAR_RAM_END (CHAR_RAM_START + CHAR_RAM_SIZE - 1)
-
-#define FG_RAM_SIZE 0x400
-#define FG_RAM_START 0xd800
-#define FG_RAM_END (FG_RAM_START + FG_RAM_SIZE - 1)
-
-#define BG_RAM_SIZE 0x400
-#define BG_RAM_START 0xdc00
-#define BG_RAM_END (BG_RAM_START + BG_RAM_SIZE - 1)
-
-#define SPRITE_RAM_SIZE 0x800
-#define SPRITE_RAM_START 0xe000
-#define SPRITE_RAM_END (SPRITE_RAM_START + SPRITE_RAM_SIZE - 1)
-
-#define PALETTE_RAM_SIZE 0x800
-#define PALETTE_RAM_START 0xe800
-#define PALETTE_RAM_END (PALETTE_RAM_START + PALETTE_RAM_SIZE - 1)
-
-#define RAM_SIZE 0x3000
-#define RAM_START 0xc000
-#define RAM_END (RAM_START + RAM_SIZE - 1)
-
-#define BANK_SIZE 0x8000
-#define BANK_WINDOW_SIZE 0x800
-#define BANK_WINDOW_START 0xf000
-#define BANK_WINDOW_END (BANK_WINDOW_START + BANK_WINDOW_SIZE - 1)
-
-/* inputs */
-#define JOYSTICK1 0xf800
-#define BUTTONS1 0xf801
-#define JOYSTICK2 0xf802
-#define BUTTONS2 0xf803
-#define SYS1 0xf804
-#define SYS2 0xf805
-#define DIP_SW1_L 0xf806
-#define DIP_SW1_H 0xf807
-#define DIP_SW2_L 0xf808
-#define DIP_SW2_H 0xf809
-#define SYS3 0xf80f
-
-/* outputs */
-#define FG_SCROLL_START 0xf800
-#define FG_SCROLL_END 0xf802
-#define BG_SCROLL_START 0xf803
-#define BG_SCROLL_END 0xf805
-#define SOUND_LATCH 0xf806
-#define FLIP_SCREEN 0xf807
-#define BANK_SWITCH 0xf808
-
-#define BUFFER_WIDTH 256
-#define BUFFER_HEIGHT 256
-
-#define SCREEN_WIDTH 256
-#define SCREEN_HEIGHT 224
-
-/* The tilemap horizontal scroll values are all offset by a fixed value, to
- * compensate for the back porch region of the CRT horizontal timing. We don't
- * need to include this offset in our scroll values, so we must correct it. */
-#define SCROLL_OFFSET 48
-
-#define CPU_FREQ 6000000
-#define VSYNC_PERIOD_4MHZ (CPU_FREQ / 60)
-#define VBLANK_DURATION_4MHZ (((CPU_FREQ / 60) / 525) * (525 - 483))
-
-typedef struct {
-  z80_t cpu;
-  mem_t mem;
-
-  uint64_t pins;
-
-  /* ram */
-  uint8_t work_ram[WORK_RAM_SIZE];
-  uint8_t char_ram[CHAR_RAM_SIZE];
-  uint8_t fg_ram[FG_RAM_SIZE];
-  uint8_t bg_ram[BG_RAM_SIZE];
-  uint8_t sprite_ram[SPRITE_RAM_SIZE];
-  uint8_t palette_ram[PALETTE_RAM_SIZE];
-
-  /* bank switched rom */
-  uint8_t banked_rom[BANK_SIZE];
-  uint8_t current_bank;
-
-  /* tile roms */
-  uint8_t char_rom[CHAR_ROM_SIZE];
-  uint8_t fg_rom[FG_ROM_SIZE];
-  uint8_t bg_rom[BG_ROM_SIZE];
-  uint8_t sprite_rom[SPRITE_ROM_SIZE];
-
-  /* input registers */
-  uint8_t joystick;
-  uint8_t buttons;
-  uint8_t sys;
-
-  /* tilemap scroll offset registers */
-  uint8_t fg_scroll[3];
-  uint8_t bg_scroll[3];
-} mainboard_t;
-
-typedef struct {
-  mainboard_t main;
-
-  bitmap_t bitmap;
-
-  /* tilemaps */
-  tilemap_t char_tilemap;
-  tilemap_t fg_tilemap;
-  tilemap_t bg_tilemap;
-
-  /* 32-bit RGBA color palette cache */
-  uint32_t palette[1024];
-
-  /* counters */
-  int vsync_count;
-  int vblank_count;
-
-  bool capture;
-} rygar_t;
+#include "sokol_args.h"
+#include "sokol_debugtext.h"
+#include "sokol_time.h"
+#include "xshm.h"
 
 static rygar_t rygar;
 
+/* frame time histogram buckets (in microseconds) */
+static const uint64_t frame_time_buckets[] = { 4000, 8000, 12000, 16000, 16700, 17000, 20000, 25000, 33400, 50000 };
+
+/* quit after this many emulated frames, if set */
+static uint32_t max_frames;
+
+/* run-ahead, if enabled */
+static bool running_ahead;
+static runahead_t runahead;
+
+/* the arcade wall, the first instance is the main machine, and the others
+ * start one at a time so that they show different parts of the attract mode */
+#define WALL_MAX_INSTANCES 64
+#define WALL_STAGGER_FRAMES 30
+
+static struct {
+  int count;
+  uint32_t host_frames;
+  rygar_t *machine[WALL_MAX_INSTANCES];
+} wall;
+
+/* connection to the server, when spectating */
+static bool spectating;
+static spectator_client_t spectator_client;
+
+/* metric ids */
+static struct {
+  bool enabled;
+  int frames;
+  int frames_skipped;
+  int frames_dropped;
+  int frame_time;
+  int exec_time;
+  int render_time[RYGAR_NUM_STAGES];
+  int input_latency;
+  int input_events;
+  int present_time;
+
+  /* values already reported */
+  uint32_t frame_count;
+  uint64_t latency_total;
+  uint32_t latched_count;
+} app_metrics;
+
 /**
- * Updates the color palette cache with 32-bit colors, this is called for CPU
- * writes to the palette RAM area.
- *
- * The hardware palette contains 1024 entries of 16-bit big-endian color values
- * (xxxxBBBBRRRRGGGG). This function keeps a palette cache with 32-bit colors
- * up to date, so that the 32-bit colors don't need to be computed for each
- * pixel in the video decoding code.
+ * Registers the metrics, and starts the exporter if a metrics socket or file
+ * was requested.
  */
-static inline void rygar_update_palette(uint16_t addr, uint8_t data) {
-  uint16_t pal_index = addr >> 1;
-  uint32_t c = rygar.palette[pal_index];
-
-  if (addr & 1) {
-    /* odd addresses are the RRRRGGGG part */
-    uint8_t r = (data & 0xf0) | ((data >> 4) & 0x0f);
-    uint8_t g = (data & 0x0f) | ((data << 4) & 0xf0);
-    c = 0xff000000 | (c & 0x00ff0000) | g << 8 | r;
+static void app_metrics_init() {
+  bool use_socket = sargs_exists("metrics_socket");
+
+  if (!use_socket && !sargs_exists("metrics_file")) return;
+
+  app_metrics.frames = metrics_counter("rygar_frames_total", 0, "Emulated frames.", 1);
+  app_metrics.frames_skipped = metrics_counter("rygar_frames_skipped_total", 0, "Host frames which repeated the previous emulated frame.", 1);
+  app_metrics.frames_dropped = metrics_counter("rygar_frames_dropped_total", 0, "Emulated frames which were never presented.", 1);
+  app_metrics.frame_time = metrics_histogram("rygar_frame_time_seconds", "Host frame time.", frame_time_buckets, 10, 1e-6);
+  app_metrics.exec_time = metrics_counter("rygar_exec_seconds_total", 0, "Time spent running the emulation, including rendering.", 1e-9);
+  app_metrics.render_time[RYGAR_STAGE_BG] = metrics_counter("rygar_render_seconds_total", "stage=\"background\"", "Time spent in each render stage.", 1e-9);
+  app_metrics.render_time[RYGAR_STAGE_FG] = metrics_counter("rygar_render_seconds_total", "stage=\"foreground\"", "Time spent in each render stage.", 1e-9);
+  app_metrics.render_time[RYGAR_STAGE_CHAR] = metrics_counter("rygar_render_seconds_total", "stage=\"char\"", "Time spent in each render stage.", 1e-9);
+  app_metrics.render_time[RYGAR_STAGE_SPRITE] = metrics_counter("rygar_render_seconds_total", "stage=\"sprite\"", "Time spent in each render stage.", 1e-9);
+  app_metrics.render_time[RYGAR_STAGE_PALETTE] = metrics_counter("rygar_render_seconds_total", "stage=\"palette\"", "Time spent in each render stage.", 1e-9);
+  app_metrics.input_latency = metrics_counter("rygar_input_latency_seconds_total", 0, "Time from host input events to the game reading them.", 1e-9);
+  app_metrics.input_events = metrics_counter("rygar_input_events_total", 0, "Host input events read by the game.", 1);
+  app_metrics.present_time = metrics_histogram("rygar_present_time_seconds", "Time taken to present a frame (software backend only).", frame_time_buckets, 10, 1e-6);
+
+  if (use_socket) {
+    app_metrics.enabled = metrics_start_socket(sargs_value("metrics_socket"));
   } else {
-    /* even addresses are the xxxxBBBB part */
-    uint8_t b = (data & 0x0f) | ((data << 4) & 0xf0);
-    c = 0xff000000 | (c & 0x0000ffff) | b << 16;
+    app_metrics.enabled = metrics_start_file(sargs_value("metrics_file"), atoi(sargs_value_def("metrics_interval", "5")) * 1000);
   }
 
-  rygar.palette[pal_index] = c;
+  rygar.profile = app_metrics.enabled;
 }
 
 /**
- * This callback function is called for every CPU tick.
+ * Reports the metrics for a host frame. This only ever adds to the metrics,
+ * so it never blocks on the exporter thread.
  */
-static uint64_t rygar_tick_main(uint64_t pins) {
-  rygar.vsync_count--;
+static void app_metrics_update(uint32_t frame_time, uint64_t exec_time) {
+  if (!app_metrics.enabled) return;
 
-  if (rygar.vsync_count <= 0) {
-    rygar.vsync_count += VSYNC_PERIOD_4MHZ;
-    rygar.vblank_count = VBLANK_DURATION_4MHZ;
-  }
+  uint32_t frames = rygar.frame_count - app_metrics.frame_count;
+  app_metrics.frame_count = rygar.frame_count;
 
-  if (rygar.vblank_count > 0) {
-    rygar.vblank_count--;
-    pins |= Z80_INT; /* activate INT pin during VBLANK */
+  metrics_add(app_metrics.frames, frames);
+
+  if (frames == 0) {
+    metrics_add(app_metrics.frames_skipped, 1);
   } else {
-    rygar.vblank_count = 0;
+    metrics_add(app_metrics.frames_dropped, frames - 1);
   }
 
-  // tick the CPU
-  pins = z80_tick(&rygar.main.cpu, pins);
-
-  uint16_t addr = Z80_GET_ADDR(pins);
-
-  if (pins & Z80_MREQ) {
-    if (pins & Z80_WR) {
-      uint8_t data = Z80_GET_DATA(pins);
-
-      if (BETWEEN(addr, RAM_START, RAM_END)) {
-        mem_wr(&rygar.main.mem, addr, data);
-
-        if (BETWEEN(addr, CHAR_RAM_START, CHAR_RAM_END)) {
-          tilemap_mark_tile_dirty(&rygar.char_tilemap, (addr - CHAR_RAM_START) & 0x3ff);
-        } else if (BETWEEN(addr, FG_RAM_START, FG_RAM_END)) {
-          tilemap_mark_tile_dirty(&rygar.fg_tilemap, (addr - FG_RAM_START) & 0x1ff);
-        } else if (BETWEEN(addr, BG_RAM_START, BG_RAM_END)) {
-          tilemap_mark_tile_dirty(&rygar.bg_tilemap, (addr - BG_RAM_START) & 0x1ff);
-        } else if (BETWEEN(addr, PALETTE_RAM_START, PALETTE_RAM_END)) {
-          rygar_update_palette(addr - PALETTE_RAM_START, data);
-        }
-      } else if (BETWEEN(addr, FG_SCROLL_START, FG_SCROLL_END)) {
-        uint8_t offset = addr - FG_SCROLL_START;
-        rygar.main.fg_scroll[offset] = data;
-        tilemap_set_scroll_x(&rygar.fg_tilemap, (rygar.main.fg_scroll[1] << 8 | rygar.main.fg_scroll[0]) + SCROLL_OFFSET);
-        tilemap_set_scroll_y(&rygar.fg_tilemap, (rygar.main.fg_scroll[2]));
-      } else if (BETWEEN(addr, BG_SCROLL_START, BG_SCROLL_END)) {
-        uint8_t offset = addr - BG_SCROLL_START;
-        rygar.main.bg_scroll[offset] = data;
-        tilemap_set_scroll_x(&rygar.bg_tilemap, (rygar.main.bg_scroll[1] << 8 | rygar.main.bg_scroll[0]) + SCROLL_OFFSET);
-        tilemap_set_scroll_y(&rygar.bg_tilemap, (rygar.main.bg_scroll[2]));
-      } else if (addr == BANK_SWITCH) {
-        rygar.main.current_bank = data >> 3; /* bank addressed by DO3-DO6 in schematic */
-      }
-    } else if (pins & Z80_RD) {
-      if (addr <= RAM_END) {
-        Z80_SET_DATA(pins, mem_rd(&rygar.main.mem, addr));
-      } else if (BETWEEN(addr, BANK_WINDOW_START, BANK_WINDOW_END)) {
-        uint16_t banked_addr = addr - BANK_WINDOW_START + (rygar.main.current_bank * BANK_WINDOW_SIZE);
-        Z80_SET_DATA(pins, rygar.main.banked_rom[banked_addr]);
-      } else if (addr == JOYSTICK1) {
-        Z80_SET_DATA(pins, rygar.main.joystick);
-      } else if (addr == BUTTONS1) {
-        Z80_SET_DATA(pins, rygar.main.buttons);
-      } else if (addr == SYS1) {
-        Z80_SET_DATA(pins, rygar.main.sys);
-      } else if (addr == DIP_SW2_H) {
-        Z80_SET_DATA(pins, 0x8);
-      } else {
-        Z80_SET_DATA(pins, 0);
-      }
-    }
-  }
+  metrics_observe(app_metrics.frame_time, frame_time);
+  metrics_add(app_metrics.exec_time, (uint64_t)stm_ns(exec_time));
 
-  if ((pins & Z80_IORQ) && (pins & Z80_M1)) {
-    /* clear interrupt */
-    pins &= ~Z80_INT;
+  for (int i = 0; i < RYGAR_NUM_STAGES; i++) {
+    metrics_add(app_metrics.render_time[i], rygar.render_time[i]);
+    rygar.render_time[i] = 0;
   }
 
-  return pins;
+  metrics_add(app_metrics.input_latency, (uint64_t)stm_ns(rygar.input.latency_total - app_metrics.latency_total));
+  metrics_add(app_metrics.input_events, rygar.input.latched_count - app_metrics.latched_count);
+  app_metrics.latency_total = rygar.input.latency_total;
+  app_metrics.latched_count = rygar.input.latched_count;
 }
 
-static void char_tile_info(uint8_t *ram, tile_t *tile, int index) {
-  uint8_t lo = ram[index];
-  uint8_t hi = ram[index + 0x400];
+/* performance HUD */
+static struct {
+  bool visible;
+  double exec_ms;
+  double frame_ms;
+  double present_ms;
+} hud;
 
-  /* the tile code is a 10-bit value, represented by the low byte and the
-   * two LSBs of the high byte */
-  tile->code = (hi & 0x03) << 8 | lo;
-
-  /* the four MSBs of the high byte represent the color value */
-  tile->color = hi >> 4;
-}
-
-static void fg_tile_info(uint8_t *ram, tile_t *tile, int index) {
-  uint8_t lo = ram[index];
-  uint8_t hi = ram[index + 0x200];
-
-  /* the tile code is a 10-bit value, represented by the low byte and the three
-   * LSBs of the high byte */
-  tile->code = (hi & 0x03) << 8 | lo;
-
-  /* the four MSBs of the high byte represent the color value */
-  tile->color = hi >> 4;
+/**
+ * Updates the exponential moving averages shown in the HUD.
+ */
+static void app_hud_average(uint32_t frame_time, uint64_t exec_time) {
+  hud.exec_ms += (stm_ms(exec_time) - hud.exec_ms) * 0.05;
+  hud.frame_ms += (frame_time / 1000.0 - hud.frame_ms) * 0.05;
 }
 
-static void bg_tile_info(uint8_t *ram, tile_t *tile, int index) {
-  uint8_t lo = ram[index];
-  uint8_t hi = ram[index + 0x200];
-
-  /* the tile code is a 10-bit value, represented by the low byte and the three
-   * LSBs of the high byte */
-  tile->code = (hi & 0x03) << 8 | lo;
-
-  /* the four MSBs of the high byte represent the color value */
-  tile->color = hi >> 4;
+/**
+ * Draws the performance HUD, showing the CPU clock and the average cost of
+ * running the emulation.
+ */
+static void app_hud(uint32_t frame_time, uint64_t exec_time) {
+  app_hud_average(frame_time, exec_time);
+
+  if (!hud.visible) return;
+
+  sdtx_canvas(sapp_width() * 0.5f, sapp_height() * 0.5f);
+  sdtx_origin(1.0f, 1.0f);
+  sdtx_font(1);
+  sdtx_color3b(0xff, 0xff, 0xff);
+  sdtx_printf("cpu  %.1fMHz (%d%%)\n", rygar.cpu_freq / 1000000.0, (int)((uint64_t)rygar.cpu_freq * 100 / CPU_FREQ));
+  sdtx_printf("exec %.2fms\n", hud.exec_ms);
+  sdtx_printf("host %.2fms\n", hud.frame_ms);
+  sdtx_printf("wait %.2fms\n", clock_frame_delay() / 1000.0);
 }
 
 /**
- * Decodes the tile ROMs.
+ * Applies the command line options, this is shared by both backends.
  */
-static void rygar_decode_tiles() {
-  uint8_t tmp[0x20000];
-
-  /* decode descriptor for a 8x8 tile */
-  tile_decode_desc_t tile_decode_8x8 = {
-    .tile_width = 8,
-    .tile_height = 8,
-    .planes = 4,
-    .plane_offsets = { STEP4(0, 1) },
-    .x_offsets = { STEP8(0, 4) },
-    .y_offsets = { STEP8(0, 4 * 8) },
-    .tile_size = 4 * 8, /* 32 bytes */
-  };
-
-  /* decode descriptor for a 16x16 tile, made up of four 8x8 tiles */
-  tile_decode_desc_t tile_decode_16x16 = {
-    .tile_width = 16,
-    .tile_height = 16,
-    .planes = 4,
-    .plane_offsets = { STEP4(0, 1) },
-    .x_offsets = { STEP8(0, 4), STEP8(4 * 8 * 8, 4) },
-    .y_offsets = { STEP8(0, 4 * 8), STEP8(4 * 8 * 8 * 2, 4 * 8) },
-    .tile_size = 4 * 4 * 8, /* 128 bytes */
-  };
+static void app_options() {
+  arena_report(&rygar.arena);
+  rygar_latency_init(&rygar, sargs_exists("latency") ? sargs_value("latency") : 0);
+
+  if (sargs_equals("frame_delay", "auto")) {
+    clock_set_frame_delay(CLOCK_FRAME_DELAY_AUTO);
+  } else if (sargs_exists("frame_delay")) {
+    clock_set_frame_delay(atoi(sargs_value("frame_delay")) * 1000);
+  }
 
-  /* char rom */
-  memcpy(&tmp[0x00000], dump_cpu_8k, 0x8000);
+  if (sargs_exists("overclock")) {
+    rygar_set_overclock(&rygar, atoi(sargs_value("overclock")));
+  }
 
-  /* decode char rom */
-  tile_decode(&tile_decode_8x8, (uint8_t *)&tmp, (uint8_t *)&rygar.main.char_rom, 1024);
+  hud.visible = sargs_boolean("hud");
+  max_frames = atoi(sargs_value_def("frames", "0"));
 
-  tilemap_init(&rygar.char_tilemap, &(tilemap_desc_t) {
-    .tile_cb = char_tile_info,
-    .ram = rygar.main.char_ram,
-    .rom = rygar.main.char_rom,
-    .tile_width = 8,
-    .tile_height = 8,
-    .cols = 32,
-    .rows = 32,
-  });
+  if (sargs_exists("replay")) {
+    rygar_replay_open(&rygar, sargs_value("replay"));
+  } else if (sargs_exists("record")) {
+    rygar_record_start(&rygar, sargs_value("record"), atoi(sargs_value_def("keyframe_interval", "60")));
+  }
 
-  /* fg rom */
-  memcpy(&tmp[0x00000], dump_vid_6p, 0x8000);
-  memcpy(&tmp[0x08000], dump_vid_6o, 0x8000);
-  memcpy(&tmp[0x10000], dump_vid_6n, 0x8000);
-  memcpy(&tmp[0x18000], dump_vid_6l, 0x8000);
-
-  /* decode fg rom */
-  tile_decode(&tile_decode_16x16, (uint8_t *)&tmp, (uint8_t *)&rygar.main.fg_rom, 1024);
-
-  tilemap_init(&rygar.fg_tilemap, &(tilemap_desc_t) {
-    .tile_cb = fg_tile_info,
-    .ram = rygar.main.fg_ram,
-    .rom = rygar.main.fg_rom,
-    .tile_width = 16,
-    .tile_height = 16,
-    .cols = 32,
-    .rows = 16,
-  });
+  /* replays are recorded and played back without run-ahead */
+  if (sargs_exists("runahead") && (sargs_exists("replay") || sargs_exists("record"))) {
+    printf("runahead: disabled while recording or playing back a replay\n");
+  } else if (sargs_exists("runahead")) {
+    runahead_init(&runahead, &rygar, atoi(sargs_value("runahead")), atoi(sargs_value_def("runahead_branches", "0")));
+    running_ahead = true;
+  }
 
-  /* bg rom */
-  memcpy(&tmp[0x00000], dump_vid_6f, 0x8000);
-  memcpy(&tmp[0x08000], dump_vid_6e, 0x8000);
-  memcpy(&tmp[0x10000], dump_vid_6c, 0x8000);
-  memcpy(&tmp[0x18000], dump_vid_6b, 0x8000);
-
-  /* decode bg rom */
-  tile_decode(&tile_decode_16x16, (uint8_t *)&tmp, (uint8_t *)&rygar.main.bg_rom, 1024);
-
-  tilemap_init(&rygar.bg_tilemap, &(tilemap_desc_t) {
-    .tile_cb = bg_tile_info,
-    .ram = rygar.main.bg_ram,
-    .rom = rygar.main.bg_rom,
-    .tile_width = 16,
-    .tile_height = 16,
-    .cols = 32,
-    .rows = 16,
-  });
+  if (sargs_exists("spectator")) {
+    rygar_spectator_listen(&rygar, atoi(sargs_value("spectator")));
+  }
 
-  /* sprite rom */
-  memcpy(&tmp[0x00000], dump_vid_6k, 0x8000);
-  memcpy(&tmp[0x08000], dump_vid_6j, 0x8000);
-  memcpy(&tmp[0x10000], dump_vid_6h, 0x8000);
-  memcpy(&tmp[0x18000], dump_vid_6g, 0x8000);
+  if (sargs_exists("spectate")) {
+    spectating = spectator_connect(&spectator_client, sargs_value("spectate"));
+  }
 
-  /* decode sprite rom */
-  tile_decode(&tile_decode_8x8, (uint8_t *)&tmp, (uint8_t *)&rygar.main.sprite_rom, 4096);
+  app_metrics_init();
 }
 
 /**
- * Initialises the Rygar arcade hardware.
+ * Starts the instances shown on the arcade wall, each one gets a cell of a
+ * grid which is as close to square as possible.
  */
-static void rygar_init() {
-  memset(&rygar, 0, sizeof(rygar_t));
-
-  rygar.vsync_count = VSYNC_PERIOD_4MHZ;
-  rygar.vblank_count = 0;
-
-  z80_init(&rygar.main.cpu);
-  mem_init(&rygar.main.mem);
-  bitmap_init(&rygar.bitmap, BUFFER_WIDTH, BUFFER_HEIGHT);
-
-  /* main memory */
-  mem_map_rom(&rygar.main.mem, 0, 0x0000, 0x8000, dump_5);
-  mem_map_rom(&rygar.main.mem, 0, 0x8000, 0x4000, dump_cpu_5m);
-  mem_map_ram(&rygar.main.mem, 0, WORK_RAM_START, WORK_RAM_SIZE, rygar.main.work_ram);
-  mem_map_ram(&rygar.main.mem, 0, CHAR_RAM_START, CHAR_RAM_SIZE, rygar.main.char_ram);
-  mem_map_ram(&rygar.main.mem, 0, FG_RAM_START, FG_RAM_SIZE, rygar.main.fg_ram);
-  mem_map_ram(&rygar.main.mem, 0, BG_RAM_START, BG_RAM_SIZE, rygar.main.bg_ram);
-  mem_map_ram(&rygar.main.mem, 0, SPRITE_RAM_START, SPRITE_RAM_SIZE, rygar.main.sprite_ram);
-  mem_map_ram(&rygar.main.mem, 0, PALETTE_RAM_START, PALETTE_RAM_SIZE, rygar.main.palette_ram);
-
-  /* banked rom */
-  memcpy(&rygar.main.banked_rom[0x00000], dump_cpu_5j, 0x8000);
-
-  rygar_decode_tiles();
-}
+static void app_wall_init() {
+  int count = atoi(sargs_value_def("wall", "0"));
 
-static void rygar_shutdown() {
-  bitmap_shutdown(&rygar.bitmap);
-  tilemap_shutdown(&rygar.char_tilemap);
-  tilemap_shutdown(&rygar.fg_tilemap);
-  tilemap_shutdown(&rygar.bg_tilemap);
-}
+  if (count < 2) return;
+  if (count > WALL_MAX_INSTANCES) count = WALL_MAX_INSTANCES;
 
-/**
- * Applies the palette to the source bitmap data.
- */
-static void apply_palette(uint16_t *src, uint32_t *dest, int width, int height) {
-  for (int i = 0; i < width*height; i++) {
-    dest[i] = rygar.palette[src[i]];
-  }
-}
+  int cols = 1;
+  while (cols * cols < count) cols++;
+  int rows = (count + cols - 1) / cols;
 
-static void capture_bitmap(bitmap_t *bitmap, char const *filename) {
-  uint32_t buffer[SCREEN_WIDTH*SCREEN_HEIGHT];
+  /* the cells are scaled down, as a screen full of instances doesn't have the
+   * resolution to show them at their full size anyway */
+  int scale = count > 4 ? 2 : 1;
 
-  /* skip the first 16 lines */
-  uint16_t *data = bitmap_data(bitmap, 0, 16);
+  gfx_wall_init(cols, rows, SCREEN_WIDTH / scale, SCREEN_HEIGHT / scale);
 
-  /* copy the bitmap data to the output buffer */
-  apply_palette(data, buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+  wall.count = count;
+  wall.machine[0] = &rygar;
 
-  /* write the snapshot */
-  stbi_write_png(filename, SCREEN_WIDTH, SCREEN_HEIGHT, 4, buffer, SCREEN_WIDTH*4);
+  for (int i = 1; i < count; i++) {
+    wall.machine[i] = malloc(sizeof(rygar_t));
+    rygar_init_clone(wall.machine[i], &rygar, malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)));
+  }
 }
 
 /**
- * Draws the graphics layers to the frame buffer.
+ * Runs every instance on the wall which has started, and copies the frames
+ * which have changed to the wall.
  */
-static void rygar_draw() {
-  uint32_t *buffer = gfx_framebuffer();
-  bitmap_t *bitmap = &rygar.bitmap;
-
-  /* fill bitmap with the background color */
-  bitmap_fill(bitmap, 0x100);
-
-  /* draw layers */
-  tilemap_draw(&rygar.bg_tilemap, bitmap, 0x300, TILE_LAYER3);
-  tilemap_draw(&rygar.fg_tilemap, bitmap, 0x200, TILE_LAYER2);
-  tilemap_draw(&rygar.char_tilemap, bitmap, 0x100, TILE_LAYER1);
-  sprite_draw(bitmap, (uint8_t *)&rygar.main.sprite_ram, (uint8_t *)&rygar.main.sprite_rom, 0, TILE_LAYER0);
-
-  /* skip the first 16 lines */
-  uint16_t *data = bitmap_data(bitmap, 0, 16);
-
-  /* copy bitmap to 32-bit frame buffer */
-  apply_palette(data, buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+static void app_wall_exec(uint32_t frame_time) {
+  int started = wall.host_frames++ / WALL_STAGGER_FRAMES + 1;
 
-  if (rygar.capture) {
-    printf("capturing...\n");
+  for (int i = 0; i < wall.count && i < started; i++) {
+    rygar_t *machine = wall.machine[i];
+    uint32_t frame_count = machine->frame_count;
 
-    bitmap_fill(bitmap, 0);
-    sprite_draw(bitmap, (uint8_t *)&rygar.main.sprite_ram, (uint8_t *)&rygar.main.sprite_rom, 0, TILE_LAYER0);
-    capture_bitmap(bitmap, "sprite.png");
+    rygar_exec(machine, frame_time);
 
-    bitmap_fill(bitmap, 0);
-    tilemap_draw(&rygar.char_tilemap, bitmap, 0x100, TILE_LAYER1);
-    capture_bitmap(bitmap, "char.png");
-
-    bitmap_fill(bitmap, 0);
-    tilemap_draw(&rygar.fg_tilemap, bitmap, 0x200, TILE_LAYER2);
-    capture_bitmap(bitmap, "foreground.png");
+    if (machine->frame_count != frame_count) {
+      gfx_wall_update(i, machine->framebuffer, SCREEN_WIDTH, SCREEN_HEIGHT, machine->flip);
+    }
+  }
+}
 
-    bitmap_fill(bitmap, 0);
-    tilemap_draw(&rygar.bg_tilemap, bitmap, 0x300, TILE_LAYER3);
-    capture_bitmap(bitmap, "background.png");
+static void app_wall_shutdown() {
+  for (int i = 1; i < wall.count; i++) {
+    uint32_t *framebuffer = wall.machine[i]->framebuffer;
 
-    rygar.capture = false;
+    rygar_shutdown(wall.machine[i]);
+    free(framebuffer);
+    free(wall.machine[i]);
   }
+
+  wall.count = 0;
 }
 
 /**
- * Runs the emulation for one frame.
+ * Runs the emulation for the given host frame time, or draws the most recent
+ * frame received from the server when spectating.
  */
-static void rygar_exec(uint32_t delta) {
-  uint32_t ticks_to_run = clk_us_to_ticks(CPU_FREQ, delta);
-  uint64_t pins = rygar.main.pins;
-
-  for (uint32_t tick = 0; tick < ticks_to_run; tick++) {
-    pins = rygar_tick_main(pins);
+static void app_exec(uint32_t frame_time) {
+  if (spectating) {
+    if (spectator_poll(&spectator_client, 0, rygar_spectator_write, &rygar) > 0) rygar_draw(&rygar);
+  } else if (wall.count) {
+    app_wall_exec(frame_time);
+  } else if (running_ahead) {
+    /* run-ahead runs exactly one frame per host frame */
+    runahead_latch_input(&rygar);
+    runahead_frame(&runahead);
+  } else {
+    rygar_exec(&rygar, frame_time);
   }
+}
 
-  rygar.main.pins = pins;
-
-  rygar_draw();
+static bool app_done() {
+  return max_frames > 0 && rygar.frame_count >= max_frames;
 }
 
 static void app_init() {
@@ -549,57 +332,192 @@ static void app_init() {
     .emu_aspect_y = 3,
   });
   clock_init();
-  rygar_init();
+  stm_setup();
+  rygar_init(&rygar, gfx_framebuffer());
+  app_options();
+  app_wall_init();
 }
 
 static void app_frame() {
-  rygar_exec(clock_frame_time());
-  gfx_draw(SCREEN_WIDTH, SCREEN_HEIGHT);
+  uint32_t frame_time = clock_frame_time();
+
+  /* wait until just before the vsync, so that the game samples input as late
+   * as possible */
+  clock_frame_begin();
+  uint64_t exec_start = stm_now();
+  app_exec(frame_time);
+  uint64_t exec_time = stm_since(exec_start);
+  app_hud(frame_time, exec_time);
+  if (wall.count) {
+    gfx_wall_draw();
+  } else {
+    gfx_set_flip(rygar.flip);
+    gfx_draw(SCREEN_WIDTH, SCREEN_HEIGHT);
+  }
+  clock_frame_end();
+
+  latency_present(&rygar.latency, rygar.frame_count, stm_now());
+  app_metrics_update(frame_time, exec_time);
+
+  if (app_done()) sapp_request_quit();
+}
+
+static void app_key(sapp_keycode key, bool pressed) {
+  /* host events are queued, and latched when the game reads the port */
+  input_t *input = &rygar.input;
+  uint64_t now = stm_now();
+
+  int port;
+  uint8_t mask;
+
+  switch (key) {
+    case SAPP_KEYCODE_LEFT:  port = INPUT_JOYSTICK1; mask = 1 << 0; break;
+    case SAPP_KEYCODE_RIGHT: port = INPUT_JOYSTICK1; mask = 1 << 1; break;
+    case SAPP_KEYCODE_DOWN:  port = INPUT_JOYSTICK1; mask = 1 << 2; break;
+    case SAPP_KEYCODE_UP:    port = INPUT_JOYSTICK1; mask = 1 << 3; break;
+    case SAPP_KEYCODE_Z:     port = INPUT_BUTTONS1; mask = 1 << 0; break; /* attack */
+    case SAPP_KEYCODE_X:     port = INPUT_BUTTONS1; mask = 1 << 1; break; /* jump */
+    case SAPP_KEYCODE_5:     port = INPUT_SYS1; mask = 1 << 2; break; /* player 1 coin */
+    case SAPP_KEYCODE_1:     port = INPUT_SYS1; mask = 1 << 1; break; /* player 1 start */
+    case SAPP_KEYCODE_P:     if (pressed) rygar.capture = true; return; /* capture */
+    case SAPP_KEYCODE_F1:    if (pressed) hud.visible = !hud.visible; return; /* toggle HUD */
+    case SAPP_KEYCODE_F5:    if (pressed && !rygar_save_state(&rygar, "rygar.state")) printf("failed to save state\n"); return; /* save state */
+    case SAPP_KEYCODE_F9:    if (pressed && !rygar_load_state(&rygar, "rygar.state")) printf("failed to load state\n"); return; /* load state */
+#ifdef RYGAR_TRACE
+    case SAPP_KEYCODE_T:     if (pressed) trace_dump(&rygar.trace, "trace.bin"); return; /* dump trace */
+#endif
+    default: return;
+  }
+
+  if (input_set(input, port, mask, pressed, now)) {
+    latency_input(&rygar.latency, port, input->queues[port].host_value, now);
+  }
 }
 
 static void app_input(const sapp_event *event) {
   switch (event->type) {
-    case SAPP_EVENTTYPE_KEY_DOWN:
-      switch (event->key_code) {
-        case SAPP_KEYCODE_LEFT:  rygar.main.joystick |= (1 << 0); break;
-        case SAPP_KEYCODE_RIGHT: rygar.main.joystick |= (1 << 1); break;
-        case SAPP_KEYCODE_DOWN:  rygar.main.joystick |= (1 << 2); break;
-        case SAPP_KEYCODE_UP:    rygar.main.joystick |= (1 << 3); break;
-        case SAPP_KEYCODE_Z:     rygar.main.buttons |= (1 << 0); break; /* attack */
-        case SAPP_KEYCODE_X:     rygar.main.buttons |= (1 << 1); break; /* jump */
-        case SAPP_KEYCODE_5:     rygar.main.sys |= (1 << 2); break; /* player 1 coin */
-        case SAPP_KEYCODE_1:     rygar.main.sys |= (1 << 1); break; /* player 1 start */
-        case SAPP_KEYCODE_P:     rygar.capture = true; break; /* capture */
-        default: break;
-      }
-      break;
-
-    case SAPP_EVENTTYPE_KEY_UP:
-      switch (event->key_code) {
-        case SAPP_KEYCODE_LEFT:  rygar.main.joystick &= ~(1 << 0); break;
-        case SAPP_KEYCODE_RIGHT: rygar.main.joystick &= ~(1 << 1); break;
-        case SAPP_KEYCODE_DOWN:  rygar.main.joystick &= ~(1 << 2); break;
-        case SAPP_KEYCODE_UP:    rygar.main.joystick &= ~(1 << 3); break;
-        case SAPP_KEYCODE_Z:     rygar.main.buttons &= ~(1 << 0); break; /* attack */
-        case SAPP_KEYCODE_X:     rygar.main.buttons &= ~(1 << 1); break; /* jump */
-        case SAPP_KEYCODE_5:     rygar.main.sys &= ~(1 << 2); break; /* player 1 coin */
-        case SAPP_KEYCODE_1:     rygar.main.sys &= ~(1 << 1); break; /* player 1 start */
-        default: break;
-      }
-      break;
-
-    default:
-      break;
+    case SAPP_EVENTTYPE_KEY_DOWN: app_key(event->key_code, true); break;
+    case SAPP_EVENTTYPE_KEY_UP: app_key(event->key_code, false); break;
+    default: break;
   }
 }
 
 static void app_cleanup() {
-  rygar_shutdown();
+  metrics_stop();
+  app_wall_shutdown();
+  if (spectating) spectator_client_shutdown(&spectator_client);
+  if (running_ahead) {
+    runahead_report(&runahead);
+    runahead_shutdown(&runahead);
+  }
+  latency_shutdown(&rygar.latency);
+  rygar_shutdown(&rygar);
   gfx_shutdown();
+  sargs_shutdown();
+}
+
+#ifdef XSHM_AVAILABLE
+static xshm_t xshm;
+
+static void app_xshm_key(KeySym key, bool pressed) {
+  sapp_keycode code;
+
+  switch (key) {
+    case XK_Left:  code = SAPP_KEYCODE_LEFT; break;
+    case XK_Right: code = SAPP_KEYCODE_RIGHT; break;
+    case XK_Down:  code = SAPP_KEYCODE_DOWN; break;
+    case XK_Up:    code = SAPP_KEYCODE_UP; break;
+    case XK_z:     code = SAPP_KEYCODE_Z; break;
+    case XK_x:     code = SAPP_KEYCODE_X; break;
+    case XK_5:     code = SAPP_KEYCODE_5; break;
+    case XK_1:     code = SAPP_KEYCODE_1; break;
+    case XK_p:     code = SAPP_KEYCODE_P; break;
+    case XK_t:     code = SAPP_KEYCODE_T; break;
+    case XK_F1:    code = SAPP_KEYCODE_F1; break;
+    case XK_F5:    code = SAPP_KEYCODE_F5; break;
+    case XK_F9:    code = SAPP_KEYCODE_F9; break;
+    default: return;
+  }
+
+  app_key(code, pressed);
 }
 
+/**
+ * Shows the performance HUD in the window title, as there's no text renderer
+ * without sokol_gfx.
+ */
+static void app_xshm_hud(uint32_t frame_time, uint64_t exec_time, uint64_t present_time) {
+  char title[128];
+
+  app_hud_average(frame_time, exec_time);
+  hud.present_ms += (stm_ms(present_time) - hud.present_ms) * 0.05;
+
+  if (rygar.frame_count % 30 != 0) return;
+
+  if (hud.visible) {
+    snprintf(title, sizeof(title), "Rygar - cpu %.1fMHz exec %.2fms present %.2fms",
+      rygar.cpu_freq / 1000000.0, hud.exec_ms, hud.present_ms);
+  } else {
+    snprintf(title, sizeof(title), "Rygar");
+  }
+
+  xshm_set_title(&xshm, title);
+}
+
+/**
+ * Runs the emulator with the XShm software backend, in place of sokol_app and
+ * sokol_gfx.
+ */
+static int app_run_xshm() {
+  static uint32_t framebuffer[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+  if (!xshm_init(&xshm, "Rygar", SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_WIDTH * 4, SCREEN_HEIGHT * 3)) return 1;
+
+  clock_init();
+  stm_setup();
+  rygar_init(&rygar, framebuffer);
+  app_options();
+
+  while (xshm_poll(&xshm, app_xshm_key) && !app_done()) {
+    uint32_t frame_time = xshm_wait_frame(&xshm);
+
+    /* prevent a death spiral, the same as the sokol backend */
+    if (frame_time > 24000) frame_time = 24000;
+
+    uint64_t exec_start = stm_now();
+    app_exec(frame_time);
+    uint64_t exec_time = stm_since(exec_start);
+    xshm_present(&xshm, framebuffer, rygar.flip);
+
+    latency_present(&rygar.latency, rygar.frame_count, stm_now());
+    app_metrics_update(frame_time, exec_time);
+    if (app_metrics.enabled) metrics_observe(app_metrics.present_time, xshm.present_time / 1000);
+    app_xshm_hud(frame_time, exec_time, xshm.present_time);
+  }
+
+  metrics_stop();
+  if (spectating) spectator_client_shutdown(&spectator_client);
+  if (running_ahead) {
+    runahead_report(&runahead);
+    runahead_shutdown(&runahead);
+  }
+  latency_shutdown(&rygar.latency);
+  rygar_shutdown(&rygar);
+  xshm_shutdown(&xshm);
+  sargs_shutdown();
+
+  return 0;
+}
+#endif
+
 sapp_desc sokol_main(int argc, char *argv[]) {
-  (void)argc; (void)argv;
+  sargs_setup(&(sargs_desc) { .argc = argc, .argv = argv });
+
+#ifdef XSHM_AVAILABLE
+  /* the software backend runs its own main loop */
+  if (sargs_equals("backend", "xshm")) exit(app_run_xshm());
+#endif
+
   return (sapp_desc) {
     .init_cb = app_init,
     .frame_cb = app_frame,
@@ -0,0 +1,1914 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "bitmap.h"
+#include "chips/clk.h"
+#include "chips/mem.h"
+#include "chips/z80.h"
+#include "debug.h"
+#include "input.h"
+#include "latency.h"
+#include "lz.h"
+#include "replay.h"
+#include "rygar-roms.h"
+#include "scene.h"
+#include "sokol_time.h"
+#include "spectator.h"
+#include "sprite.h"
+#include "thumbnail.h"
+#include "tile.h"
+#include "tilemap.h"
+#include "trace.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#define BETWEEN(n, a, b) ((n >= a) && (n <= b))
+
+#define CHAR_ROM_SIZE 0x10000
+#define FG_ROM_SIZE 0x40000
+#define BG_ROM_SIZE 0x40000
+#define SPRITE_ROM_SIZE 0x40000
+
+#define WORK_RAM_SIZE 0x1000
+#define WORK_RAM_START 0xc000
+#define WORK_RAM_END (WORK_RAM_START + WORK_RAM_SIZE - 1)
+
+#define CHAR_RAM_SIZE 0x800
+#define CHAR_RAM_START 0xd000
+#define CHAR_RAM_END (CHAR_RAM_START + CHAR_RAM_SIZE - 1)
+
+#define FG_RAM_SIZE 0x400
+#define FG_RAM_START 0xd800
+#define FG_RAM_END (FG_RAM_START + FG_RAM_SIZE - 1)
+
+#define BG_RAM_SIZE 0x400
+#define BG_RAM_START 0xdc00
+#define BG_RAM_END (BG_RAM_START + BG_RAM_SIZE - 1)
+
+#define SPRITE_RAM_SIZE 0x800
+#define SPRITE_RAM_START 0xe000
+#define SPRITE_RAM_END (SPRITE_RAM_START + SPRITE_RAM_SIZE - 1)
+
+#define PALETTE_RAM_SIZE 0x800
+#define PALETTE_RAM_START 0xe800
+#define PALETTE_RAM_END (PALETTE_RAM_START + PALETTE_RAM_SIZE - 1)
+
+#define RAM_SIZE 0x3000
+#define RAM_START 0xc000
+#define RAM_END (RAM_START + RAM_SIZE - 1)
+
+/* RAM writes are tracked in pages, so checkpoints only copy the pages that
+ * have changed */
+#define RAM_PAGE_SHIFT 8
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_SHIFT)
+#define RAM_NUM_PAGES (RAM_SIZE >> RAM_PAGE_SHIFT)
+#define RAM_ALL_PAGES ((1ull << RAM_NUM_PAGES) - 1)
+
+/* all of the RAM pages in the memory map, which are shared by clones */
+#define RAM_ALL_MEM_PAGES ((1 << (RAM_SIZE >> MEM_PAGE_SHIFT)) - 1)
+
+/* the RAM regions of a mainboard or snapshot, in address order */
+#define RAM_NUM_REGIONS 6
+#define RAM_REGIONS(x) { (x)->work_ram, (x)->char_ram, (x)->fg_ram, (x)->bg_ram, (x)->sprite_ram, (x)->palette_ram }
+
+#define BANK_SIZE 0x8000
+#define BANK_WINDOW_SIZE 0x800
+#define BANK_WINDOW_START 0xf000
+#define BANK_WINDOW_END (BANK_WINDOW_START + BANK_WINDOW_SIZE - 1)
+
+/* inputs */
+#define JOYSTICK1 0xf800
+#define BUTTONS1 0xf801
+#define JOYSTICK2 0xf802
+#define BUTTONS2 0xf803
+#define SYS1 0xf804
+#define SYS2 0xf805
+#define DIP_SW1_L 0xf806
+#define DIP_SW1_H 0xf807
+#define DIP_SW2_L 0xf808
+#define DIP_SW2_H 0xf809
+#define SYS3 0xf80f
+
+/* input ports */
+#define INPUT_JOYSTICK1 0
+#define INPUT_BUTTONS1 1
+#define INPUT_SYS1 2
+
+/* outputs */
+#define FG_SCROLL_START 0xf800
+#define FG_SCROLL_END 0xf802
+#define BG_SCROLL_START 0xf803
+#define BG_SCROLL_END 0xf805
+#define SOUND_LATCH 0xf806
+#define FLIP_SCREEN 0xf807
+#define BANK_SWITCH 0xf808
+
+#define BUFFER_WIDTH 256
+#define BUFFER_HEIGHT 256
+
+#define SCREEN_WIDTH 256
+#define SCREEN_HEIGHT 224
+
+/* tilemap dimensions (in pixels) */
+#define CHAR_TILEMAP_WIDTH (8 * 32)
+#define CHAR_TILEMAP_HEIGHT (8 * 32)
+#define FG_TILEMAP_WIDTH (16 * 32)
+#define FG_TILEMAP_HEIGHT (16 * 16)
+#define BG_TILEMAP_WIDTH (16 * 32)
+#define BG_TILEMAP_HEIGHT (16 * 16)
+
+/* all of the video buffers are allocated from a single arena */
+#define VIDEO_ARENA_SIZE ( \
+  BITMAP_SIZE(BUFFER_WIDTH, BUFFER_HEIGHT) + \
+  BITMAP_SIZE(CHAR_TILEMAP_WIDTH, CHAR_TILEMAP_HEIGHT) + \
+  BITMAP_SIZE(FG_TILEMAP_WIDTH, FG_TILEMAP_HEIGHT) + \
+  BITMAP_SIZE(BG_TILEMAP_WIDTH, BG_TILEMAP_HEIGHT))
+
+/* The tilemap horizontal scroll values are all offset by a fixed value, to
+ * compensate for the back porch region of the CRT horizontal timing. We don't
+ * need to include this offset in our scroll values, so we must correct it. */
+#define SCROLL_OFFSET 48
+
+/* render stages, for profiling */
+#define RYGAR_STAGE_BG 0
+#define RYGAR_STAGE_FG 1
+#define RYGAR_STAGE_CHAR 2
+#define RYGAR_STAGE_SPRITE 3
+#define RYGAR_STAGE_PALETTE 4
+#define RYGAR_NUM_STAGES 5
+
+#define CPU_FREQ 6000000
+#define VSYNC_PERIOD_4MHZ (CPU_FREQ / 60)
+#define VBLANK_DURATION_4MHZ (((CPU_FREQ / 60) / 525) * (525 - 483))
+
+/* CPU overclock limits (in percent) */
+#define MIN_OVERCLOCK 100
+#define MAX_OVERCLOCK 400
+
+/* The decoded graphics ROMs are read-only, so they are shared by a machine
+ * and its clones. */
+typedef struct {
+  atomic_int refs;
+
+  uint8_t char_rom[CHAR_ROM_SIZE];
+  uint8_t fg_rom[FG_ROM_SIZE];
+  uint8_t bg_rom[BG_ROM_SIZE];
+  uint8_t sprite_rom[SPRITE_ROM_SIZE];
+} rygar_roms_t;
+
+typedef struct {
+  z80_t cpu;
+  mem_t mem;
+
+  uint64_t pins;
+
+  /* ram */
+  uint8_t work_ram[WORK_RAM_SIZE];
+  uint8_t char_ram[CHAR_RAM_SIZE];
+  uint8_t fg_ram[FG_RAM_SIZE];
+  uint8_t bg_ram[BG_RAM_SIZE];
+  uint8_t sprite_ram[SPRITE_RAM_SIZE];
+  uint8_t palette_ram[PALETTE_RAM_SIZE];
+
+  /* bank switched rom */
+  const uint8_t *banked_rom;
+  uint8_t current_bank;
+
+  /* tile roms */
+  rygar_roms_t *roms;
+
+  /* input registers */
+  uint8_t joystick;
+  uint8_t buttons;
+  uint8_t sys;
+
+  /* tilemap scroll offset registers */
+  uint8_t fg_scroll[3];
+  uint8_t bg_scroll[3];
+
+  /* flip screen register */
+  bool flip_screen;
+} mainboard_t;
+
+typedef struct rygar_t {
+  mainboard_t main;
+
+  /* video buffers */
+  arena_t arena;
+
+  bitmap_t bitmap;
+
+  /* tilemaps */
+  tilemap_t char_tilemap;
+  tilemap_t fg_tilemap;
+  tilemap_t bg_tilemap;
+
+  /* pending host input events */
+  input_t input;
+
+  /* input-to-display latency measurement, and the copy of the machine which
+   * runs without the input events being followed */
+  latency_t latency;
+  struct rygar_t *latency_shadow;
+
+  /* breakpoints and watchpoints */
+  debug_t debug;
+
+  /* display state streaming to spectators, this is only allocated while
+   * listening, as the server buffers are much larger than the machine */
+  spectator_server_t *spectator;
+
+  /* replay recording and playback */
+  replay_recorder_t recorder;
+  replay_player_t player;
+
+#ifdef RYGAR_TRACE
+  /* Z80 execution trace */
+  trace_t trace;
+#endif
+
+  /* 32-bit RGBA color palette cache */
+  uint32_t palette[1024];
+
+  /* 32-bit RGBA frame buffer, the visible area of the most recent frame is
+   * rendered here */
+  uint32_t *framebuffer;
+
+  /* flip screen state latched for the current frame */
+  bool flip;
+
+  /* skip rendering frames, e.g. while fast-forwarding */
+  bool skip_render;
+
+  /* running look-ahead frames which will be rolled back, so they are not
+   * published, recorded, or captured, and don't consume host input */
+  bool speculative;
+
+  /* RAM pages written since the last checkpoint, and the checkpoint that is
+   * in sync with the machine */
+  uint64_t dirty_pages;
+  uint32_t checkpoint_epoch;
+
+  /* memory pages of the RAM which are still shared with the machine this one
+   * was cloned from, they are copied when they are first written */
+  uint16_t shared_pages;
+
+  /* CPU clock (and the overclock percentage it was set from), and the video
+   * timing measured in CPU ticks at that clock */
+  int overclock;
+  uint32_t cpu_freq;
+  int vsync_period;
+  int vblank_duration;
+
+  /* counters */
+  int vsync_count;
+  int vblank_count;
+  uint64_t cycles;
+  uint32_t frame_count;
+
+  /* accumulated render time for each stage (in nanoseconds), this is only
+   * recorded when profiling is enabled */
+  bool profile;
+  uint64_t render_time[RYGAR_NUM_STAGES];
+
+  bool capture;
+} rygar_t;
+
+/* snapshot format */
+#define SNAPSHOT_MAGIC 0x53475952 /* "RYGS" */
+#define SNAPSHOT_VERSION 2
+
+/* A snapshot contains the mutable machine state. The ROMs, decoded graphics,
+ * and caches are not included, they are rebuilt when a snapshot is loaded. */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+
+  z80_t cpu;
+  uint64_t pins;
+
+  /* ram */
+  uint8_t work_ram[WORK_RAM_SIZE];
+  uint8_t char_ram[CHAR_RAM_SIZE];
+  uint8_t fg_ram[FG_RAM_SIZE];
+  uint8_t bg_ram[BG_RAM_SIZE];
+  uint8_t sprite_ram[SPRITE_RAM_SIZE];
+  uint8_t palette_ram[PALETTE_RAM_SIZE];
+
+  /* registers */
+  uint8_t current_bank;
+  uint8_t joystick;
+  uint8_t buttons;
+  uint8_t sys;
+  uint8_t fg_scroll[3];
+  uint8_t bg_scroll[3];
+  bool flip_screen;
+
+  /* CPU clock (in percent), the counters are measured in ticks at this clock */
+  int overclock;
+
+  /* counters */
+  int vsync_count;
+  int vblank_count;
+  uint64_t cycles;
+  uint32_t frame_count;
+} rygar_snapshot_t;
+
+/* A checkpoint is a snapshot kept in memory, e.g. for rolling back the
+ * emulation. It is saved and restored incrementally: if the checkpoint was the
+ * last one saved or restored, then only the RAM pages written since then are
+ * copied, otherwise the whole RAM is copied. */
+typedef struct {
+  rygar_snapshot_t snapshot;
+
+  /* the machine and epoch of the last save or restore */
+  const rygar_t *owner;
+  uint32_t epoch;
+
+  /* the number of RAM pages copied by the last save or restore */
+  int pages;
+} rygar_checkpoint_t;
+
+static const uint16_t ram_region_start[RAM_NUM_REGIONS] = {
+  WORK_RAM_START, CHAR_RAM_START, FG_RAM_START, BG_RAM_START, SPRITE_RAM_START, PALETTE_RAM_START
+};
+
+static const uint16_t ram_region_size[RAM_NUM_REGIONS] = {
+  WORK_RAM_SIZE, CHAR_RAM_SIZE, FG_RAM_SIZE, BG_RAM_SIZE, SPRITE_RAM_SIZE, PALETTE_RAM_SIZE
+};
+
+static void rygar_draw(rygar_t *rygar);
+static void rygar_set_overclock(rygar_t *rygar, int percent);
+static bool rygar_run_frame(rygar_t *rygar);
+static bool rygar_record_stop(rygar_t *rygar);
+
+/**
+ * Updates the color palette cache with 32-bit colors, this is called for CPU
+ * writes to the palette RAM area.
+ *
+ * The hardware palette contains 1024 entries of 16-bit big-endian color values
+ * (xxxxBBBBRRRRGGGG). This function keeps a palette cache with 32-bit colors
+ * up to date, so that the 32-bit colors don't need to be computed for each
+ * pixel in the video decoding code.
+ */
+static inline void rygar_update_palette(rygar_t *rygar, uint16_t addr, uint8_t data) {
+  uint16_t pal_index = addr >> 1;
+  uint32_t c = rygar->palette[pal_index];
+
+  if (addr & 1) {
+    /* odd addresses are the RRRRGGGG part */
+    uint8_t r = (data & 0xf0) | ((data >> 4) & 0x0f);
+    uint8_t g = (data & 0x0f) | ((data << 4) & 0xf0);
+    c = 0xff000000 | (c & 0x00ff0000) | g << 8 | r;
+  } else {
+    /* even addresses are the xxxxBBBB part */
+    uint8_t b = (data & 0x0f) | ((data << 4) & 0xf0);
+    c = 0xff000000 | (c & 0x0000ffff) | b << 16;
+  }
+
+  rygar->palette[pal_index] = c;
+}
+
+/**
+ * Updates the tilemap scroll offsets from the scroll registers.
+ */
+static inline void rygar_update_scroll(rygar_t *rygar) {
+  tilemap_set_scroll_x(&rygar->fg_tilemap, (rygar->main.fg_scroll[1] << 8 | rygar->main.fg_scroll[0]) + SCROLL_OFFSET);
+  tilemap_set_scroll_y(&rygar->fg_tilemap, (rygar->main.fg_scroll[2]));
+  tilemap_set_scroll_x(&rygar->bg_tilemap, (rygar->main.bg_scroll[1] << 8 | rygar->main.bg_scroll[0]) + SCROLL_OFFSET);
+  tilemap_set_scroll_y(&rygar->bg_tilemap, (rygar->main.bg_scroll[2]));
+}
+
+/**
+ * Returns the input register for the given input port.
+ */
+static inline uint8_t *rygar_input_reg(rygar_t *rygar, int port) {
+  switch (port) {
+    case INPUT_JOYSTICK1: return &rygar->main.joystick;
+    case INPUT_BUTTONS1: return &rygar->main.buttons;
+    default: return &rygar->main.sys;
+  }
+}
+
+/**
+ * Reads an input port when playing back a replay. The recorded values are
+ * written to the input registers at the cycle they were originally read, and
+ * host input is ignored.
+ */
+static inline uint8_t rygar_replay_input(rygar_t *rygar, uint8_t *reg) {
+  uint8_t port, value;
+
+  while (replay_next_event(&rygar->player, rygar->cycles, &port, &value)) {
+    *rygar_input_reg(rygar, port) = value;
+  }
+
+  return *reg;
+}
+
+/**
+ * Reads an input port, latching any pending host input events into the input
+ * register. Input is latched at the moment the game reads the port, rather
+ * than when the host delivers the event, so the game always sees the freshest
+ * input state.
+ */
+static inline uint8_t rygar_read_input(rygar_t *rygar, int port, uint8_t *reg) {
+  /* the input for the look-ahead frames was latched before running them */
+  if (rygar->speculative) return *reg;
+
+  if (replay_playing(&rygar->player)) {
+    return rygar_replay_input(rygar, reg);
+  }
+
+  uint8_t prev = *reg;
+  uint8_t value = input_latch(&rygar->input, port, reg, stm_now());
+  latency_read(&rygar->latency, port, rygar->input.queues[port].latched_time, rygar->cycles, rygar->frame_count);
+
+  if (value != prev && replay_recording(&rygar->recorder)) {
+    replay_record_event(&rygar->recorder, rygar->cycles, port, value);
+  }
+
+  return value;
+}
+
+/**
+ * Copies a shared RAM page, so that the machine owns it. The RAM is mapped so
+ * that the write pointer of each page always points to the machine's own RAM,
+ * and the read pointer points to wherever the data lives.
+ */
+static void rygar_unshare_page(rygar_t *rygar, uint16_t addr) {
+  int page = (addr - RAM_START) >> MEM_PAGE_SHIFT;
+
+  if (!(rygar->shared_pages & (1 << page))) return;
+
+  addr &= ~(MEM_PAGE_SIZE - 1);
+  mem_page_t *mem_page = &rygar->main.mem.page_table[addr >> MEM_PAGE_SHIFT];
+  uint8_t *ptr = mem_page->write_ptr;
+
+  memcpy(ptr, mem_page->read_ptr, MEM_PAGE_SIZE);
+  mem_map_ram(&rygar->main.mem, 0, addr, MEM_PAGE_SIZE, ptr);
+  rygar->shared_pages &= ~(1 << page);
+}
+
+/**
+ * Copies all of the shared RAM pages. This must be done before the RAM
+ * arrays are read directly, rather than through the memory map.
+ */
+static inline void rygar_unshare(rygar_t *rygar) {
+  for (int addr = RAM_START; rygar->shared_pages && addr <= RAM_END; addr += MEM_PAGE_SIZE) {
+    rygar_unshare_page(rygar, addr);
+  }
+}
+
+/**
+ * Returns a pointer for reading the given RAM region through the memory map,
+ * so that pages shared with another machine are read where they live rather
+ * than copied. The region is only copied if part of it is shared and part of
+ * it isn't, as the pages aren't contiguous then. The RAM must not be written
+ * through the pointer.
+ */
+static uint8_t *rygar_read_region(rygar_t *rygar, uint16_t start, uint16_t size) {
+  mem_page_t *pages = &rygar->main.mem.page_table[start >> MEM_PAGE_SHIFT];
+
+  for (int i = 1; i < size >> MEM_PAGE_SHIFT; i++) {
+    if (pages[i].read_ptr != pages[0].read_ptr + i * MEM_PAGE_SIZE) {
+      for (int addr = start; addr < start + size; addr += MEM_PAGE_SIZE) rygar_unshare_page(rygar, addr);
+      break;
+    }
+  }
+
+  return (uint8_t *)pages[0].read_ptr;
+}
+
+/**
+ * This callback function is called for every CPU tick.
+ */
+static uint64_t rygar_tick_main(rygar_t *rygar, uint64_t pins) {
+  rygar->cycles++;
+  rygar->vsync_count--;
+
+  if (rygar->vsync_count <= 0) {
+    rygar->vsync_count += rygar->vsync_period;
+    rygar->vblank_count = rygar->vblank_duration;
+
+    /* The game updates the sprite, tile, and scroll registers during VBLANK,
+     * so the frame is rendered at the start of VBLANK, before the CPU is
+     * interrupted. This ensures we never render a half-updated frame. */
+    rygar_draw(rygar);
+  }
+
+  if (rygar->vblank_count > 0) {
+    rygar->vblank_count--;
+    pins |= Z80_INT; /* activate INT pin during VBLANK */
+  } else {
+    rygar->vblank_count = 0;
+  }
+
+  // tick the CPU
+  pins = z80_tick(&rygar->main.cpu, pins);
+
+  uint16_t addr = Z80_GET_ADDR(pins);
+
+  if (pins & Z80_MREQ) {
+    if (pins & Z80_WR) {
+      uint8_t data = Z80_GET_DATA(pins);
+
+      if (BETWEEN(addr, RAM_START, RAM_END)) {
+        if (rygar->shared_pages) rygar_unshare_page(rygar, addr);
+
+        mem_wr(&rygar->main.mem, addr, data);
+        rygar->dirty_pages |= 1ull << ((addr - RAM_START) >> RAM_PAGE_SHIFT);
+
+        if (BETWEEN(addr, CHAR_RAM_START, CHAR_RAM_END)) {
+          tilemap_mark_tile_dirty(&rygar->char_tilemap, (addr - CHAR_RAM_START) & 0x3ff);
+        } else if (BETWEEN(addr, FG_RAM_START, FG_RAM_END)) {
+          tilemap_mark_tile_dirty(&rygar->fg_tilemap, (addr - FG_RAM_START) & 0x1ff);
+        } else if (BETWEEN(addr, BG_RAM_START, BG_RAM_END)) {
+          tilemap_mark_tile_dirty(&rygar->bg_tilemap, (addr - BG_RAM_START) & 0x1ff);
+        } else if (BETWEEN(addr, PALETTE_RAM_START, PALETTE_RAM_END)) {
+          rygar_update_palette(rygar, addr - PALETTE_RAM_START, data);
+        }
+      } else if (BETWEEN(addr, FG_SCROLL_START, FG_SCROLL_END)) {
+        uint8_t offset = addr - FG_SCROLL_START;
+        rygar->main.fg_scroll[offset] = data;
+        rygar_update_scroll(rygar);
+      } else if (BETWEEN(addr, BG_SCROLL_START, BG_SCROLL_END)) {
+        uint8_t offset = addr - BG_SCROLL_START;
+        rygar->main.bg_scroll[offset] = data;
+        rygar_update_scroll(rygar);
+      } else if (addr == FLIP_SCREEN) {
+        rygar->main.flip_screen = data & 1;
+      } else if (addr == BANK_SWITCH) {
+        rygar->main.current_bank = (data >> 3) & 0x0f; /* bank addressed by DO3-DO6 in schematic */
+      }
+    } else if (pins & Z80_RD) {
+      if (addr <= RAM_END) {
+        Z80_SET_DATA(pins, mem_rd(&rygar->main.mem, addr));
+      } else if (BETWEEN(addr, BANK_WINDOW_START, BANK_WINDOW_END)) {
+        uint16_t banked_addr = addr - BANK_WINDOW_START + (rygar->main.current_bank * BANK_WINDOW_SIZE);
+        Z80_SET_DATA(pins, rygar->main.banked_rom[banked_addr]);
+      } else if (addr == JOYSTICK1) {
+        Z80_SET_DATA(pins, rygar_read_input(rygar, INPUT_JOYSTICK1, &rygar->main.joystick));
+      } else if (addr == BUTTONS1) {
+        Z80_SET_DATA(pins, rygar_read_input(rygar, INPUT_BUTTONS1, &rygar->main.buttons));
+      } else if (addr == SYS1) {
+        Z80_SET_DATA(pins, rygar_read_input(rygar, INPUT_SYS1, &rygar->main.sys));
+      } else if (addr == DIP_SW2_H) {
+        Z80_SET_DATA(pins, 0x8);
+      } else {
+        Z80_SET_DATA(pins, 0);
+      }
+    }
+  }
+
+  if ((pins & Z80_MREQ) && rygar->debug.pages[addr >> DEBUG_PAGE_SHIFT]) {
+    /* slow path for pages with breakpoints or watchpoints */
+    debug_trap(&rygar->debug, pins);
+  }
+
+  TRACE_TICK(&rygar->trace, &rygar->main.cpu, pins, rygar->main.current_bank, rygar->cycles);
+
+  if ((pins & Z80_IORQ) && (pins & Z80_M1)) {
+    /* clear interrupt */
+    pins &= ~Z80_INT;
+  }
+
+  return pins;
+}
+
+/**
+ * Returns a pointer to the RAM at the given address, or null if the address
+ * isn't in RAM.
+ */
+static inline uint8_t *rygar_ram_ptr(rygar_t *rygar, uint16_t addr) {
+  if (BETWEEN(addr, WORK_RAM_START, WORK_RAM_END)) return &rygar->main.work_ram[addr - WORK_RAM_START];
+  if (BETWEEN(addr, CHAR_RAM_START, CHAR_RAM_END)) return &rygar->main.char_ram[addr - CHAR_RAM_START];
+  if (BETWEEN(addr, FG_RAM_START, FG_RAM_END)) return &rygar->main.fg_ram[addr - FG_RAM_START];
+  if (BETWEEN(addr, BG_RAM_START, BG_RAM_END)) return &rygar->main.bg_ram[addr - BG_RAM_START];
+  if (BETWEEN(addr, SPRITE_RAM_START, SPRITE_RAM_END)) return &rygar->main.sprite_ram[addr - SPRITE_RAM_START];
+  if (BETWEEN(addr, PALETTE_RAM_START, PALETTE_RAM_END)) return &rygar->main.palette_ram[addr - PALETTE_RAM_START];
+  return 0;
+}
+
+/**
+ * Draws a frame from scratch, rebuilding the palette cache and the tilemap
+ * scroll offsets, and redrawing every tile.
+ */
+static void rygar_draw_reference(rygar_t *rygar) {
+  for (int i = 0; i < PALETTE_RAM_SIZE; i++) {
+    rygar_update_palette(rygar, i, rygar->main.palette_ram[i]);
+  }
+
+  tilemap_mark_all_dirty(&rygar->char_tilemap);
+  tilemap_mark_all_dirty(&rygar->fg_tilemap);
+  tilemap_mark_all_dirty(&rygar->bg_tilemap);
+  rygar_update_scroll(rygar);
+
+  rygar_draw(rygar);
+}
+
+/**
+ * A plain implementation of the CPU tick, used as a reference to check the
+ * optimised one in lockstep. It decodes every memory access explicitly,
+ * rather than through the memory map, and draws every frame from scratch, so
+ * it doesn't depend on the memory map, the palette cache, dirty tiles, dirty
+ * pages, or shared pages. Breakpoints aren't supported.
+ */
+static uint64_t rygar_tick_reference(rygar_t *rygar, uint64_t pins) {
+  rygar->cycles++;
+  rygar->vsync_count--;
+
+  if (rygar->vsync_count <= 0) {
+    rygar->vsync_count += rygar->vsync_period;
+    rygar->vblank_count = rygar->vblank_duration;
+    rygar_draw_reference(rygar);
+  }
+
+  if (rygar->vblank_count > 0) {
+    rygar->vblank_count--;
+    pins |= Z80_INT;
+  } else {
+    rygar->vblank_count = 0;
+  }
+
+  pins = z80_tick(&rygar->main.cpu, pins);
+
+  uint16_t addr = Z80_GET_ADDR(pins);
+  uint8_t *ram = rygar_ram_ptr(rygar, addr);
+
+  if ((pins & Z80_MREQ) && (pins & Z80_WR)) {
+    uint8_t data = Z80_GET_DATA(pins);
+
+    if (ram) {
+      *ram = data;
+    } else if (BETWEEN(addr, FG_SCROLL_START, FG_SCROLL_END)) {
+      rygar->main.fg_scroll[addr - FG_SCROLL_START] = data;
+    } else if (BETWEEN(addr, BG_SCROLL_START, BG_SCROLL_END)) {
+      rygar->main.bg_scroll[addr - BG_SCROLL_START] = data;
+    } else if (addr == FLIP_SCREEN) {
+      rygar->main.flip_screen = data & 1;
+    } else if (addr == BANK_SWITCH) {
+      rygar->main.current_bank = (data >> 3) & 0x0f;
+    }
+  } else if ((pins & Z80_MREQ) && (pins & Z80_RD)) {
+    uint8_t data = 0;
+
+    if (ram) {
+      data = *ram;
+    } else if (addr < 0x8000) {
+      data = dump_5[addr];
+    } else if (addr < RAM_START) {
+      data = dump_cpu_5m[addr - 0x8000];
+    } else if (BETWEEN(addr, BANK_WINDOW_START, BANK_WINDOW_END)) {
+      data = dump_cpu_5j[rygar->main.current_bank * BANK_WINDOW_SIZE + addr - BANK_WINDOW_START];
+    } else if (addr == JOYSTICK1) {
+      data = rygar_read_input(rygar, INPUT_JOYSTICK1, &rygar->main.joystick);
+    } else if (addr == BUTTONS1) {
+      data = rygar_read_input(rygar, INPUT_BUTTONS1, &rygar->main.buttons);
+    } else if (addr == SYS1) {
+      data = rygar_read_input(rygar, INPUT_SYS1, &rygar->main.sys);
+    } else if (addr == DIP_SW2_H) {
+      data = 0x8;
+    }
+
+    Z80_SET_DATA(pins, data);
+  }
+
+  TRACE_TICK(&rygar->trace, &rygar->main.cpu, pins, rygar->main.current_bank, rygar->cycles);
+
+  if ((pins & Z80_IORQ) && (pins & Z80_M1)) {
+    pins &= ~Z80_INT;
+  }
+
+  return pins;
+}
+
+/**
+ * Runs the reference implementation for the given number of CPU ticks.
+ */
+static void rygar_run_reference(rygar_t *rygar, uint32_t ticks) {
+  uint64_t pins = rygar->main.pins;
+
+  /* the RAM arrays are accessed directly */
+  rygar_unshare(rygar);
+
+  for (uint32_t tick = 0; tick < ticks; tick++) {
+    pins = rygar_tick_reference(rygar, pins);
+  }
+
+  rygar->main.pins = pins;
+
+  /* any checkpoint is stale now */
+  rygar->dirty_pages = RAM_ALL_PAGES;
+}
+
+static void char_tile_info(uint8_t *ram, tile_t *tile, int index) {
+  uint8_t lo = ram[index];
+  uint8_t hi = ram[index + 0x400];
+
+  /* the tile code is a 10-bit value, represented by the low byte and the
+   * two LSBs of the high byte */
+  tile->code = (hi & 0x03) << 8 | lo;
+
+  /* the four MSBs of the high byte represent the color value */
+  tile->color = hi >> 4;
+}
+
+static void fg_tile_info(uint8_t *ram, tile_t *tile, int index) {
+  uint8_t lo = ram[index];
+  uint8_t hi = ram[index + 0x200];
+
+  /* the tile code is a 10-bit value, represented by the low byte and the three
+   * LSBs of the high byte */
+  tile->code = (hi & 0x03) << 8 | lo;
+
+  /* the four MSBs of the high byte represent the color value */
+  tile->color = hi >> 4;
+}
+
+static void bg_tile_info(uint8_t *ram, tile_t *tile, int index) {
+  uint8_t lo = ram[index];
+  uint8_t hi = ram[index + 0x200];
+
+  /* the tile code is a 10-bit value, represented by the low byte and the three
+   * LSBs of the high byte */
+  tile->code = (hi & 0x03) << 8 | lo;
+
+  /* the four MSBs of the high byte represent the color value */
+  tile->color = hi >> 4;
+}
+
+/**
+ * Decodes the tile ROMs.
+ */
+static void rygar_decode_tiles(rygar_roms_t *roms) {
+  uint8_t tmp[0x20000];
+
+  /* decode descriptor for a 8x8 tile */
+  tile_decode_desc_t tile_decode_8x8 = {
+    .tile_width = 8,
+    .tile_height = 8,
+    .planes = 4,
+    .plane_offsets = { STEP4(0, 1) },
+    .x_offsets = { STEP8(0, 4) },
+    .y_offsets = { STEP8(0, 4 * 8) },
+    .tile_size = 4 * 8, /* 32 bytes */
+  };
+
+  /* decode descriptor for a 16x16 tile, made up of four 8x8 tiles */
+  tile_decode_desc_t tile_decode_16x16 = {
+    .tile_width = 16,
+    .tile_height = 16,
+    .planes = 4,
+    .plane_offsets = { STEP4(0, 1) },
+    .x_offsets = { STEP8(0, 4), STEP8(4 * 8 * 8, 4) },
+    .y_offsets = { STEP8(0, 4 * 8), STEP8(4 * 8 * 8 * 2, 4 * 8) },
+    .tile_size = 4 * 4 * 8, /* 128 bytes */
+  };
+
+  /* char rom */
+  memcpy(&tmp[0x00000], dump_cpu_8k, 0x8000);
+
+  /* decode char rom */
+  tile_decode(&tile_decode_8x8, (uint8_t *)&tmp, roms->char_rom, 1024);
+
+  /* fg rom */
+  memcpy(&tmp[0x00000], dump_vid_6p, 0x8000);
+  memcpy(&tmp[0x08000], dump_vid_6o, 0x8000);
+  memcpy(&tmp[0x10000], dump_vid_6n, 0x8000);
+  memcpy(&tmp[0x18000], dump_vid_6l, 0x8000);
+
+  /* decode fg rom */
+  tile_decode(&tile_decode_16x16, (uint8_t *)&tmp, roms->fg_rom, 1024);
+
+  /* bg rom */
+  memcpy(&tmp[0x00000], dump_vid_6f, 0x8000);
+  memcpy(&tmp[0x08000], dump_vid_6e, 0x8000);
+  memcpy(&tmp[0x10000], dump_vid_6c, 0x8000);
+  memcpy(&tmp[0x18000], dump_vid_6b, 0x8000);
+
+  /* decode bg rom */
+  tile_decode(&tile_decode_16x16, (uint8_t *)&tmp, roms->bg_rom, 1024);
+
+  /* sprite rom */
+  memcpy(&tmp[0x00000], dump_vid_6k, 0x8000);
+  memcpy(&tmp[0x08000], dump_vid_6j, 0x8000);
+  memcpy(&tmp[0x10000], dump_vid_6h, 0x8000);
+  memcpy(&tmp[0x18000], dump_vid_6g, 0x8000);
+
+  /* decode sprite rom */
+  tile_decode(&tile_decode_8x8, (uint8_t *)&tmp, roms->sprite_rom, 4096);
+}
+
+/**
+ * Initialises the tilemaps. The pixel data is only allocated for machines that
+ * render frames.
+ */
+static void rygar_init_tilemaps(rygar_t *rygar) {
+  arena_t *arena = rygar->framebuffer ? &rygar->arena : 0;
+
+  tilemap_init(&rygar->char_tilemap, &(tilemap_desc_t) {
+    .tile_cb = char_tile_info,
+    .arena = arena,
+    .ram = rygar->main.char_ram,
+    .rom = rygar->main.roms->char_rom,
+    .tile_width = 8,
+    .tile_height = 8,
+    .cols = 32,
+    .rows = 32,
+  });
+
+  tilemap_init(&rygar->fg_tilemap, &(tilemap_desc_t) {
+    .tile_cb = fg_tile_info,
+    .arena = arena,
+    .ram = rygar->main.fg_ram,
+    .rom = rygar->main.roms->fg_rom,
+    .tile_width = 16,
+    .tile_height = 16,
+    .cols = 32,
+    .rows = 16,
+  });
+
+  tilemap_init(&rygar->bg_tilemap, &(tilemap_desc_t) {
+    .tile_cb = bg_tile_info,
+    .arena = arena,
+    .ram = rygar->main.bg_ram,
+    .rom = rygar->main.roms->bg_rom,
+    .tile_width = 16,
+    .tile_height = 16,
+    .cols = 32,
+    .rows = 16,
+  });
+}
+
+/**
+ * Initialises a machine which uses the given decoded ROMs.
+ */
+static void rygar_init_machine(rygar_t *rygar, uint32_t *framebuffer, rygar_roms_t *roms) {
+  memset(rygar, 0, sizeof(rygar_t));
+
+  rygar->framebuffer = framebuffer;
+  rygar->main.roms = roms;
+  atomic_fetch_add(&roms->refs, 1);
+
+  rygar->overclock = 100;
+  rygar->cpu_freq = CPU_FREQ;
+  rygar->vsync_period = VSYNC_PERIOD_4MHZ;
+  rygar->vblank_duration = VBLANK_DURATION_4MHZ;
+  rygar->vsync_count = VSYNC_PERIOD_4MHZ;
+  rygar->vblank_count = 0;
+
+  z80_init(&rygar->main.cpu);
+  mem_init(&rygar->main.mem);
+  input_init(&rygar->input);
+  debug_init(&rygar->debug);
+#ifdef RYGAR_TRACE
+  trace_init(&rygar->trace);
+#endif
+
+  if (framebuffer) {
+    arena_init(&rygar->arena, "video", VIDEO_ARENA_SIZE);
+    bitmap_init(&rygar->bitmap, BUFFER_WIDTH, BUFFER_HEIGHT, &rygar->arena);
+  }
+
+  /* main memory */
+  mem_map_rom(&rygar->main.mem, 0, 0x0000, 0x8000, dump_5);
+  mem_map_rom(&rygar->main.mem, 0, 0x8000, 0x4000, dump_cpu_5m);
+  mem_map_ram(&rygar->main.mem, 0, WORK_RAM_START, WORK_RAM_SIZE, rygar->main.work_ram);
+  mem_map_ram(&rygar->main.mem, 0, CHAR_RAM_START, CHAR_RAM_SIZE, rygar->main.char_ram);
+  mem_map_ram(&rygar->main.mem, 0, FG_RAM_START, FG_RAM_SIZE, rygar->main.fg_ram);
+  mem_map_ram(&rygar->main.mem, 0, BG_RAM_START, BG_RAM_SIZE, rygar->main.bg_ram);
+  mem_map_ram(&rygar->main.mem, 0, SPRITE_RAM_START, SPRITE_RAM_SIZE, rygar->main.sprite_ram);
+  mem_map_ram(&rygar->main.mem, 0, PALETTE_RAM_START, PALETTE_RAM_SIZE, rygar->main.palette_ram);
+
+  /* banked rom */
+  rygar->main.banked_rom = dump_cpu_5j;
+
+  rygar_init_tilemaps(rygar);
+}
+
+/**
+ * Initialises the Rygar arcade hardware. Frames are rendered to the given
+ * frame buffer, which must be SCREEN_WIDTH*SCREEN_HEIGHT pixels.
+ */
+static void rygar_init(rygar_t *rygar, uint32_t *framebuffer) {
+  rygar_roms_t *roms = malloc(sizeof(rygar_roms_t));
+
+  atomic_init(&roms->refs, 0);
+  rygar_decode_tiles(roms);
+  rygar_init_machine(rygar, framebuffer, roms);
+}
+
+/**
+ * Initialises a machine which shares the decoded ROMs of the given machine,
+ * so that it can be used as a target for rygar_clone. If the frame buffer is
+ * null, then no video buffers are allocated and frames are never rendered,
+ * which makes the machine much smaller.
+ */
+static void rygar_init_clone(rygar_t *rygar, rygar_t *src, uint32_t *framebuffer) {
+  rygar_init_machine(rygar, framebuffer, src->main.roms);
+}
+
+/**
+ * Starts measuring the input-to-display latency, logging every input event to
+ * the given file. The frame in which an event changed the video output is
+ * found by running a copy of the machine without the event, so this doubles
+ * the emulation time while events are followed.
+ */
+static void rygar_latency_init(rygar_t *rygar, const char *filename) {
+  latency_init(&rygar->latency, filename);
+
+  if (!rygar->latency.enabled) return;
+
+  rygar->latency_shadow = malloc(sizeof(rygar_t));
+  rygar_init_clone(rygar->latency_shadow, rygar, malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)));
+
+  /* the copy holds the input registers, rather than latching host input */
+  rygar->latency_shadow->speculative = true;
+}
+
+static void rygar_shutdown(rygar_t *rygar) {
+  if (rygar->latency_shadow) {
+    rygar_shutdown(rygar->latency_shadow);
+    free(rygar->latency_shadow->framebuffer);
+    free(rygar->latency_shadow);
+    rygar->latency_shadow = 0;
+  }
+
+  if (rygar->input.latched_count > 0) {
+    printf("input: %u events, %.2fms average / %.2fms max from host event to game read\n",
+      rygar->input.latched_count,
+      stm_ms(rygar->input.latency_total / rygar->input.latched_count),
+      stm_ms(rygar->input.latency_max));
+  }
+
+  if (rygar->spectator) {
+    spectator_server_shutdown(rygar->spectator);
+    free(rygar->spectator);
+    rygar->spectator = 0;
+  }
+  rygar_record_stop(rygar);
+  replay_close(&rygar->player);
+  bitmap_shutdown(&rygar->bitmap);
+  tilemap_shutdown(&rygar->char_tilemap);
+  tilemap_shutdown(&rygar->fg_tilemap);
+  tilemap_shutdown(&rygar->bg_tilemap);
+  arena_shutdown(&rygar->arena);
+
+  if (atomic_fetch_sub(&rygar->main.roms->refs, 1) == 1) free(rygar->main.roms);
+}
+
+/**
+ * Applies the palette to the source bitmap data.
+ */
+static void apply_palette(const uint32_t *palette, uint16_t *src, int stride, uint32_t *dest, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      *dest++ = palette[src[x]];
+    }
+
+    src += stride;
+  }
+}
+
+static void capture_bitmap(rygar_t *rygar, bitmap_t *bitmap, char const *filename) {
+  uint32_t buffer[SCREEN_WIDTH*SCREEN_HEIGHT];
+
+  /* skip the first 16 lines */
+  uint16_t *data = bitmap_data(bitmap, 0, 16);
+
+  /* copy the bitmap data to the output buffer */
+  apply_palette(rygar->palette, data, bitmap->stride, buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+  /* write the snapshot */
+  stbi_write_png(filename, SCREEN_WIDTH, SCREEN_HEIGHT, 4, buffer, SCREEN_WIDTH*4);
+}
+
+/**
+ * Adds the time since the last lap to the given render stage.
+ */
+static inline void rygar_profile(rygar_t *rygar, int stage, uint64_t *lap) {
+  if (rygar->profile) {
+    rygar->render_time[stage] += (uint64_t)stm_ns(stm_laptime(lap));
+  }
+}
+
+/**
+ * Starts streaming the display state to spectators connecting to the given
+ * port, and returns false if the port can't be opened.
+ */
+static bool rygar_spectator_listen(rygar_t *rygar, int port) {
+  if (!rygar->spectator) {
+    rygar->spectator = malloc(sizeof(spectator_server_t));
+    spectator_server_init(rygar->spectator);
+  }
+
+  if (!spectator_listen(rygar->spectator, port)) {
+    free(rygar->spectator);
+    rygar->spectator = 0;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Sends the display state to any spectators.
+ */
+static void rygar_send_spectator_frame(rygar_t *rygar) {
+  uint8_t sprites[SPECTATOR_REGION_SIZE];
+  uint8_t registers[] = {
+    rygar->main.fg_scroll[0], rygar->main.fg_scroll[1], rygar->main.fg_scroll[2],
+    rygar->main.bg_scroll[0], rygar->main.bg_scroll[1], rygar->main.bg_scroll[2],
+    rygar->main.flip_screen,
+  };
+
+  spectator_pack_sprites(rygar->main.sprite_ram, sprites);
+
+  const uint8_t *regions[SPECTATOR_NUM_REGIONS] = {
+    rygar->main.char_ram,
+    rygar->main.fg_ram,
+    rygar->main.bg_ram,
+    rygar->main.palette_ram,
+    sprites,
+    registers,
+  };
+
+  const int sizes[SPECTATOR_NUM_REGIONS] = {
+    CHAR_RAM_SIZE,
+    FG_RAM_SIZE,
+    BG_RAM_SIZE,
+    PALETTE_RAM_SIZE,
+    SPECTATOR_REGION_SIZE,
+    sizeof(registers),
+  };
+
+  spectator_frame(rygar->spectator, rygar->frame_count, regions, sizes);
+}
+
+/**
+ * Applies display state received from the server when spectating. Instead of
+ * running the emulation, the spectator only updates the video RAM and
+ * registers, and then draws the frame.
+ */
+static void rygar_spectator_write(int region, int offset, const uint8_t *data, int len, void *user) {
+  rygar_t *rygar = user;
+  uint8_t registers[7];
+
+  /* any checkpoint is stale now */
+  rygar->dirty_pages = RAM_ALL_PAGES;
+  rygar_unshare(rygar);
+
+  switch (region) {
+    case SPECTATOR_CHAR_RAM:
+      if (offset + len > CHAR_RAM_SIZE) return;
+      memcpy(rygar->main.char_ram + offset, data, len);
+      for (int i = offset; i < offset + len; i++) tilemap_mark_tile_dirty(&rygar->char_tilemap, i & 0x3ff);
+      break;
+
+    case SPECTATOR_FG_RAM:
+      if (offset + len > FG_RAM_SIZE) return;
+      memcpy(rygar->main.fg_ram + offset, data, len);
+      for (int i = offset; i < offset + len; i++) tilemap_mark_tile_dirty(&rygar->fg_tilemap, i & 0x1ff);
+      break;
+
+    case SPECTATOR_BG_RAM:
+      if (offset + len > BG_RAM_SIZE) return;
+      memcpy(rygar->main.bg_ram + offset, data, len);
+      for (int i = offset; i < offset + len; i++) tilemap_mark_tile_dirty(&rygar->bg_tilemap, i & 0x1ff);
+      break;
+
+    case SPECTATOR_PALETTE_RAM:
+      if (offset + len > PALETTE_RAM_SIZE) return;
+      memcpy(rygar->main.palette_ram + offset, data, len);
+      for (int i = 0; i < len; i++) rygar_update_palette(rygar, offset + i, data[i]);
+      break;
+
+    case SPECTATOR_SPRITES:
+      spectator_unpack_sprites(data, rygar->main.sprite_ram);
+      break;
+
+    case SPECTATOR_REGISTERS:
+      if (offset + len > (int)sizeof(registers)) return;
+      memcpy(registers, rygar->main.fg_scroll, 3);
+      memcpy(registers + 3, rygar->main.bg_scroll, 3);
+      registers[6] = rygar->main.flip_screen;
+      memcpy(registers + offset, data, len);
+      memcpy(rygar->main.fg_scroll, registers, 3);
+      memcpy(rygar->main.bg_scroll, registers + 3, 3);
+      rygar->main.flip_screen = registers[6];
+      rygar_update_scroll(rygar);
+      break;
+  }
+}
+
+/**
+ * Publishes the frame in the frame buffer: the machine state is sent to the
+ * spectators.
+ */
+static void rygar_publish_frame(rygar_t *rygar) {
+  if (rygar->spectator) rygar_send_spectator_frame(rygar);
+}
+
+/**
+ * Draws the graphics layers to the frame buffer.
+ */
+static void rygar_draw(rygar_t *rygar) {
+  if (rygar->skip_render || !rygar->framebuffer) {
+    rygar->flip = rygar->main.flip_screen;
+    rygar->frame_count++;
+    return;
+  }
+
+  uint32_t *buffer = rygar->framebuffer;
+  bitmap_t *bitmap = &rygar->bitmap;
+  uint64_t lap = rygar->profile ? stm_now() : 0;
+
+  /* the video RAM is read directly */
+  rygar_unshare(rygar);
+
+  /* fill bitmap with the background color */
+  bitmap_fill(bitmap, 0x100);
+
+  /* draw layers */
+  tilemap_draw(&rygar->bg_tilemap, bitmap, 0x300, TILE_LAYER3);
+  rygar_profile(rygar, RYGAR_STAGE_BG, &lap);
+  tilemap_draw(&rygar->fg_tilemap, bitmap, 0x200, TILE_LAYER2);
+  rygar_profile(rygar, RYGAR_STAGE_FG, &lap);
+  tilemap_draw(&rygar->char_tilemap, bitmap, 0x100, TILE_LAYER1);
+  rygar_profile(rygar, RYGAR_STAGE_CHAR, &lap);
+  sprite_draw(bitmap, (uint8_t *)&rygar->main.sprite_ram, rygar->main.roms->sprite_rom, 0, TILE_LAYER0);
+  rygar_profile(rygar, RYGAR_STAGE_SPRITE, &lap);
+
+  /* skip the first 16 lines */
+  uint16_t *data = bitmap_data(bitmap, 0, 16);
+
+  /* copy bitmap to 32-bit frame buffer */
+  apply_palette(rygar->palette, data, bitmap->stride, buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+  rygar_profile(rygar, RYGAR_STAGE_PALETTE, &lap);
+
+  /* Latch the flip screen register along with the frame. The frame is always
+   * rendered unflipped, and flipped when it is presented. */
+  rygar->flip = rygar->main.flip_screen;
+
+  rygar->frame_count++;
+
+  if (rygar->speculative) return;
+
+  rygar_publish_frame(rygar);
+
+  if (rygar->capture) {
+    printf("capturing...\n");
+
+    bitmap_fill(bitmap, 0);
+    sprite_draw(bitmap, (uint8_t *)&rygar->main.sprite_ram, rygar->main.roms->sprite_rom, 0, TILE_LAYER0);
+    capture_bitmap(rygar, bitmap, "sprite.png");
+
+    bitmap_fill(bitmap, 0);
+    tilemap_draw(&rygar->char_tilemap, bitmap, 0x100, TILE_LAYER1);
+    capture_bitmap(rygar, bitmap, "char.png");
+
+    bitmap_fill(bitmap, 0);
+    tilemap_draw(&rygar->fg_tilemap, bitmap, 0x200, TILE_LAYER2);
+    capture_bitmap(rygar, bitmap, "foreground.png");
+
+    bitmap_fill(bitmap, 0);
+    tilemap_draw(&rygar->bg_tilemap, bitmap, 0x300, TILE_LAYER3);
+    capture_bitmap(rygar, bitmap, "background.png");
+
+    rygar->capture = false;
+  }
+}
+
+/**
+ * Exports the scene of the current frame. The sprite and tile RAM are decoded
+ * directly, nothing is drawn.
+ */
+static void rygar_observe(rygar_t *rygar, scene_t *scene) {
+  mainboard_t *main = &rygar->main;
+  tile_t tile;
+  int count = 0;
+
+  /* the RAM is read through the memory map, so a clone's shared pages aren't
+   * copied */
+  uint8_t *char_ram = rygar_read_region(rygar, CHAR_RAM_START, CHAR_RAM_SIZE);
+  uint8_t *fg_ram = rygar_read_region(rygar, FG_RAM_START, FG_RAM_SIZE);
+  uint8_t *bg_ram = rygar_read_region(rygar, BG_RAM_START, BG_RAM_SIZE);
+  uint8_t *sprite_ram = rygar_read_region(rygar, SPRITE_RAM_START, SPRITE_RAM_SIZE);
+
+  scene->frame = rygar->frame_count;
+  scene->fg_scroll_x = main->fg_scroll[1] << 8 | main->fg_scroll[0];
+  scene->fg_scroll_y = main->fg_scroll[2];
+  scene->bg_scroll_x = main->bg_scroll[1] << 8 | main->bg_scroll[0];
+  scene->bg_scroll_y = main->bg_scroll[2];
+  scene->flip_screen = main->flip_screen;
+
+  for (int addr = 0; addr < SPRITE_RAM_SIZE; addr += SPRITE_SIZE) {
+    sprite_t sprite;
+
+    if (!sprite_decode(sprite_ram + addr, &sprite)) continue;
+
+    scene->sprite_code[count] = sprite.code;
+    scene->sprite_size[count] = sprite.size * TILE_WIDTH;
+    scene->sprite_x[count] = sprite.x;
+    scene->sprite_y[count] = sprite.y;
+    scene->sprite_flip[count] = sprite.flip_x | sprite.flip_y << 1;
+    scene->sprite_color[count] = sprite.color;
+    scene->sprite_priority[count] = sprite.priority;
+    count++;
+  }
+
+  scene->sprite_count = count;
+
+  for (int i = 0; i < SCENE_CHAR_TILES; i++) {
+    char_tile_info(char_ram, &tile, i);
+    scene->char_code[i] = tile.code;
+    scene->char_color[i] = tile.color;
+  }
+
+  for (int i = 0; i < SCENE_FG_TILES; i++) {
+    fg_tile_info(fg_ram, &tile, i);
+    scene->fg_code[i] = tile.code;
+    scene->fg_color[i] = tile.color;
+  }
+
+  for (int i = 0; i < SCENE_BG_TILES; i++) {
+    bg_tile_info(bg_ram, &tile, i);
+    scene->bg_code[i] = tile.code;
+    scene->bg_color[i] = tile.color;
+  }
+}
+
+/**
+ * Initialises a thumbnail renderer for the machine's decoded ROMs.
+ */
+static void rygar_init_thumbnail(rygar_t *rygar, thumbnail_t *thumbnail) {
+  rygar_roms_t *roms = rygar->main.roms;
+
+  thumbnail_init(thumbnail);
+  thumbnail_init_layer(thumbnail, THUMBNAIL_SPRITE, roms->sprite_rom, 8 * 8, 4096);
+  thumbnail_init_layer(thumbnail, THUMBNAIL_CHAR, roms->char_rom, 8 * 8, 1024);
+  thumbnail_init_layer(thumbnail, THUMBNAIL_FG, roms->fg_rom, 16 * 16, 1024);
+  thumbnail_init_layer(thumbnail, THUMBNAIL_BG, roms->bg_rom, 16 * 16, 1024);
+}
+
+/**
+ * Renders a THUMBNAIL_WIDTH*THUMBNAIL_HEIGHT thumbnail of the current frame,
+ * with a pixel for each 8x8 block of the screen. The sprite and tile RAM are
+ * read directly, nothing is drawn.
+ *
+ * Each block is the average color of the tile under its center in each layer,
+ * and each 8x8 tile of a sprite is splatted onto the block under its center.
+ * Sprite priorities are ignored. Like the frame buffer, the thumbnail is never
+ * flipped.
+ */
+static void rygar_thumbnail(rygar_t *rygar, thumbnail_t *thumbnail, uint32_t *pixels) {
+  tile_t tile;
+
+  /* the RAM is read through the memory map, so a clone's shared pages aren't
+   * copied */
+  uint8_t *char_ram = rygar_read_region(rygar, CHAR_RAM_START, CHAR_RAM_SIZE);
+  uint8_t *fg_ram = rygar_read_region(rygar, FG_RAM_START, FG_RAM_SIZE);
+  uint8_t *bg_ram = rygar_read_region(rygar, BG_RAM_START, BG_RAM_SIZE);
+  uint8_t *sprite_ram = rygar_read_region(rygar, SPRITE_RAM_START, SPRITE_RAM_SIZE);
+
+  thumbnail_update_palette(thumbnail, rygar->palette);
+
+  for (int by = 0; by < THUMBNAIL_HEIGHT; by++) {
+    /* skip the first 16 lines, and sample the center of each block */
+    int y = (by + 2) * THUMBNAIL_BLOCK + THUMBNAIL_BLOCK / 2;
+
+    for (int bx = 0; bx < THUMBNAIL_WIDTH; bx++) {
+      int x = bx * THUMBNAIL_BLOCK + THUMBNAIL_BLOCK / 2;
+      uint32_t color = rygar->palette[0x100];
+
+      /* the background and foreground tilemaps are 512x256 pixels */
+      int u = (x + rygar->bg_tilemap.scroll_x) & 0x1ff;
+      int v = (y + rygar->bg_tilemap.scroll_y) & 0xff;
+      bg_tile_info(bg_ram, &tile, (v >> 4) * 32 + (u >> 4));
+      color = thumbnail_blend(color, thumbnail_tile_color(thumbnail, THUMBNAIL_BG, tile.code, tile.color));
+
+      u = (x + rygar->fg_tilemap.scroll_x) & 0x1ff;
+      v = (y + rygar->fg_tilemap.scroll_y) & 0xff;
+      fg_tile_info(fg_ram, &tile, (v >> 4) * 32 + (u >> 4));
+      color = thumbnail_blend(color, thumbnail_tile_color(thumbnail, THUMBNAIL_FG, tile.code, tile.color));
+
+      /* the char tiles line up with the blocks */
+      char_tile_info(char_ram, &tile, (y >> 3) * 32 + bx);
+      color = thumbnail_blend(color, thumbnail_tile_color(thumbnail, THUMBNAIL_CHAR, tile.code, tile.color));
+
+      pixels[by * THUMBNAIL_WIDTH + bx] = color;
+    }
+  }
+
+  /* the sprites are splatted in the same order as they are drawn */
+  for (int addr = SPRITE_RAM_SIZE - SPRITE_SIZE; addr >= 0; addr -= SPRITE_SIZE) {
+    sprite_t sprite;
+
+    if (!sprite_decode(sprite_ram + addr, &sprite)) continue;
+
+    for (int row = 0; row < sprite.size; row++) {
+      for (int col = 0; col < sprite.size; col++) {
+        int x = sprite.x + TILE_WIDTH * (sprite.flip_x ? (sprite.size - 1 - col) : col) + TILE_WIDTH / 2;
+        int y = sprite.y + TILE_HEIGHT * (sprite.flip_y ? (sprite.size - 1 - row) : row) + TILE_HEIGHT / 2;
+        int bx = x >> 3;
+        int by = (y >> 3) - 2;
+
+        if (bx < 0 || bx >= THUMBNAIL_WIDTH || by < 0 || by >= THUMBNAIL_HEIGHT) continue;
+
+        uint32_t *pixel = &pixels[by * THUMBNAIL_WIDTH + bx];
+        *pixel = thumbnail_blend(*pixel, thumbnail_tile_color(thumbnail, THUMBNAIL_SPRITE, sprite.code + sprite_tile_offset_table[row][col], sprite.color));
+      }
+    }
+  }
+}
+
+/**
+ * Saves the CPU, registers, and counters to the given snapshot.
+ */
+static void rygar_save_registers(rygar_t *rygar, rygar_snapshot_t *snapshot) {
+  snapshot->magic = SNAPSHOT_MAGIC;
+  snapshot->version = SNAPSHOT_VERSION;
+
+  snapshot->cpu = rygar->main.cpu;
+  snapshot->pins = rygar->main.pins;
+
+  snapshot->current_bank = rygar->main.current_bank;
+  snapshot->joystick = rygar->main.joystick;
+  snapshot->buttons = rygar->main.buttons;
+  snapshot->sys = rygar->main.sys;
+  memcpy(snapshot->fg_scroll, rygar->main.fg_scroll, sizeof(snapshot->fg_scroll));
+  memcpy(snapshot->bg_scroll, rygar->main.bg_scroll, sizeof(snapshot->bg_scroll));
+  snapshot->flip_screen = rygar->main.flip_screen;
+
+  snapshot->overclock = rygar->overclock;
+  snapshot->vsync_count = rygar->vsync_count;
+  snapshot->vblank_count = rygar->vblank_count;
+  snapshot->cycles = rygar->cycles;
+  snapshot->frame_count = rygar->frame_count;
+}
+
+/**
+ * Restores the CPU, registers, and counters from the given snapshot.
+ */
+static void rygar_load_registers(rygar_t *rygar, const rygar_snapshot_t *snapshot) {
+  rygar->main.cpu = snapshot->cpu;
+  rygar->main.pins = snapshot->pins;
+
+  rygar->main.current_bank = snapshot->current_bank;
+  rygar->main.joystick = snapshot->joystick;
+  rygar->main.buttons = snapshot->buttons;
+  rygar->main.sys = snapshot->sys;
+  memcpy(rygar->main.fg_scroll, snapshot->fg_scroll, sizeof(snapshot->fg_scroll));
+  memcpy(rygar->main.bg_scroll, snapshot->bg_scroll, sizeof(snapshot->bg_scroll));
+  rygar->main.flip_screen = snapshot->flip_screen;
+
+  /* the counters were saved at this clock */
+  rygar_set_overclock(rygar, snapshot->overclock);
+
+  rygar->vsync_count = snapshot->vsync_count;
+  rygar->vblank_count = snapshot->vblank_count;
+  rygar->cycles = snapshot->cycles;
+  rygar->frame_count = snapshot->frame_count;
+
+  rygar_update_scroll(rygar);
+}
+
+/**
+ * Copies the given RAM pages between two sets of RAM regions, and returns the
+ * number of pages copied.
+ */
+static int rygar_copy_pages(uint8_t *const dst[], uint8_t *const src[], uint64_t pages) {
+  int count = 0;
+
+  for (int r = 0; r < RAM_NUM_REGIONS; r++) {
+    int first = (ram_region_start[r] - RAM_START) >> RAM_PAGE_SHIFT;
+    int n = ram_region_size[r] >> RAM_PAGE_SHIFT;
+    uint64_t mask = (pages >> first) & ((1ull << n) - 1);
+
+    for (int i = 0; mask; i++, mask >>= 1) {
+      if (mask & 1) {
+        memcpy(dst[r] + (i << RAM_PAGE_SHIFT), src[r] + (i << RAM_PAGE_SHIFT), RAM_PAGE_SIZE);
+        count++;
+      }
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Rebuilds the palette cache and redraws the tiles for the given RAM pages,
+ * after they have been restored.
+ */
+static void rygar_invalidate_pages(rygar_t *rygar, uint64_t pages) {
+  for (int page = 0; page < RAM_NUM_PAGES; page++) {
+    if (!(pages & (1ull << page))) continue;
+
+    uint16_t addr = RAM_START + (page << RAM_PAGE_SHIFT);
+
+    /* pages don't cross region boundaries */
+    if (BETWEEN(addr, CHAR_RAM_START, CHAR_RAM_END)) {
+      for (int i = 0; i < RAM_PAGE_SIZE; i++) {
+        tilemap_mark_tile_dirty(&rygar->char_tilemap, (addr - CHAR_RAM_START + i) & 0x3ff);
+      }
+    } else if (BETWEEN(addr, FG_RAM_START, FG_RAM_END)) {
+      for (int i = 0; i < RAM_PAGE_SIZE; i++) {
+        tilemap_mark_tile_dirty(&rygar->fg_tilemap, (addr - FG_RAM_START + i) & 0x1ff);
+      }
+    } else if (BETWEEN(addr, BG_RAM_START, BG_RAM_END)) {
+      for (int i = 0; i < RAM_PAGE_SIZE; i++) {
+        tilemap_mark_tile_dirty(&rygar->bg_tilemap, (addr - BG_RAM_START + i) & 0x1ff);
+      }
+    } else if (BETWEEN(addr, PALETTE_RAM_START, PALETTE_RAM_END)) {
+      for (int i = addr - PALETTE_RAM_START; i < addr - PALETTE_RAM_START + RAM_PAGE_SIZE; i++) {
+        rygar_update_palette(rygar, i, rygar->main.palette_ram[i]);
+      }
+    }
+  }
+}
+
+/**
+ * Maps the RAM pages for reading from the given machine, sharing them until
+ * they are written, or from the machine's own RAM if it is null.
+ */
+static void rygar_share_pages(rygar_t *rygar, rygar_t *src) {
+  if (!src && !rygar->shared_pages) return;
+
+  for (int addr = RAM_START; addr <= RAM_END; addr += MEM_PAGE_SIZE) {
+    mem_page_t *mem_page = &rygar->main.mem.page_table[addr >> MEM_PAGE_SHIFT];
+    const uint8_t *ptr = src ? src->main.mem.page_table[addr >> MEM_PAGE_SHIFT].read_ptr : mem_page->write_ptr;
+
+    mem_map_rw(&rygar->main.mem, 0, addr, MEM_PAGE_SIZE, ptr, mem_page->write_ptr);
+  }
+
+  rygar->shared_pages = src ? RAM_ALL_MEM_PAGES : 0;
+}
+
+/**
+ * Saves the mutable machine state to the given snapshot.
+ */
+static void rygar_save_snapshot(rygar_t *rygar, rygar_snapshot_t *snapshot) {
+  uint8_t *dst[] = RAM_REGIONS(snapshot);
+  uint8_t *src[] = RAM_REGIONS(&rygar->main);
+
+  rygar_unshare(rygar);
+  memset(snapshot, 0, sizeof(rygar_snapshot_t));
+  rygar_copy_pages(dst, src, RAM_ALL_PAGES);
+  rygar_save_registers(rygar, snapshot);
+}
+
+/**
+ * Restores the machine state from the given snapshot, and returns false if
+ * the snapshot isn't valid.
+ */
+static bool rygar_load_snapshot(rygar_t *rygar, const rygar_snapshot_t *snapshot) {
+  if (snapshot->magic != SNAPSHOT_MAGIC || snapshot->version != SNAPSHOT_VERSION) return false;
+
+  uint8_t *dst[] = RAM_REGIONS(&rygar->main);
+  uint8_t *src[] = RAM_REGIONS((rygar_snapshot_t *)snapshot);
+
+  rygar_share_pages(rygar, 0);
+  rygar_copy_pages(dst, src, RAM_ALL_PAGES);
+  rygar_load_registers(rygar, snapshot);
+
+  /* rebuild the caches derived from the RAM */
+  for (int i = 0; i < PALETTE_RAM_SIZE; i++) {
+    rygar_update_palette(rygar, i, rygar->main.palette_ram[i]);
+  }
+
+  tilemap_mark_all_dirty(&rygar->char_tilemap);
+  tilemap_mark_all_dirty(&rygar->fg_tilemap);
+  tilemap_mark_all_dirty(&rygar->bg_tilemap);
+
+  /* any checkpoint is stale now */
+  rygar->dirty_pages = RAM_ALL_PAGES;
+
+  return true;
+}
+
+/**
+ * Marks the given checkpoint as being in sync with the machine.
+ */
+static void rygar_checkpoint_sync(rygar_t *rygar, rygar_checkpoint_t *checkpoint) {
+  checkpoint->owner = rygar;
+  checkpoint->epoch = ++rygar->checkpoint_epoch;
+  rygar->dirty_pages = 0;
+}
+
+/**
+ * Returns the RAM pages that may differ between the machine and the given
+ * checkpoint.
+ */
+static uint64_t rygar_checkpoint_pages(rygar_t *rygar, const rygar_checkpoint_t *checkpoint) {
+  if (checkpoint->owner == rygar && checkpoint->epoch == rygar->checkpoint_epoch) {
+    return rygar->dirty_pages;
+  } else {
+    return RAM_ALL_PAGES;
+  }
+}
+
+/**
+ * Saves the machine state to the given checkpoint, copying only the RAM pages
+ * that have been written since the checkpoint was last in sync.
+ */
+static void rygar_checkpoint_save(rygar_t *rygar, rygar_checkpoint_t *checkpoint) {
+  uint8_t *dst[] = RAM_REGIONS(&checkpoint->snapshot);
+  uint8_t *src[] = RAM_REGIONS(&rygar->main);
+
+  rygar_unshare(rygar);
+  checkpoint->pages = rygar_copy_pages(dst, src, rygar_checkpoint_pages(rygar, checkpoint));
+  rygar_save_registers(rygar, &checkpoint->snapshot);
+  rygar_checkpoint_sync(rygar, checkpoint);
+}
+
+/**
+ * Restores the machine state from the given checkpoint, reverting only the RAM
+ * pages that have been written since the checkpoint was last in sync, and
+ * returns false if the checkpoint has never been saved.
+ */
+static bool rygar_checkpoint_restore(rygar_t *rygar, rygar_checkpoint_t *checkpoint) {
+  if (checkpoint->snapshot.magic != SNAPSHOT_MAGIC) return false;
+
+  uint8_t *dst[] = RAM_REGIONS(&rygar->main);
+  uint8_t *src[] = RAM_REGIONS(&checkpoint->snapshot);
+  uint64_t pages = rygar_checkpoint_pages(rygar, checkpoint);
+
+  rygar_unshare(rygar);
+  checkpoint->pages = rygar_copy_pages(dst, src, pages);
+  rygar_load_registers(rygar, &checkpoint->snapshot);
+  rygar_invalidate_pages(rygar, pages);
+  rygar_checkpoint_sync(rygar, checkpoint);
+
+  return true;
+}
+
+/**
+ * Copies the CPU, registers, counters, and caches of the source machine to
+ * the clone.
+ */
+static void rygar_clone_registers(rygar_t *src, rygar_t *dst) {
+  dst->main.cpu = src->main.cpu;
+  dst->main.pins = src->main.pins;
+  dst->main.current_bank = src->main.current_bank;
+  dst->main.joystick = src->main.joystick;
+  dst->main.buttons = src->main.buttons;
+  dst->main.sys = src->main.sys;
+  memcpy(dst->main.fg_scroll, src->main.fg_scroll, sizeof(dst->main.fg_scroll));
+  memcpy(dst->main.bg_scroll, src->main.bg_scroll, sizeof(dst->main.bg_scroll));
+  dst->main.flip_screen = src->main.flip_screen;
+
+  dst->overclock = src->overclock;
+  dst->cpu_freq = src->cpu_freq;
+  dst->vsync_period = src->vsync_period;
+  dst->vblank_duration = src->vblank_duration;
+  dst->vsync_count = src->vsync_count;
+  dst->vblank_count = src->vblank_count;
+  dst->cycles = src->cycles;
+  dst->frame_count = src->frame_count;
+  dst->flip = src->flip;
+
+  memcpy(dst->palette, src->palette, sizeof(dst->palette));
+
+  if (dst->framebuffer) {
+    tilemap_mark_all_dirty(&dst->char_tilemap);
+    tilemap_mark_all_dirty(&dst->fg_tilemap);
+    tilemap_mark_all_dirty(&dst->bg_tilemap);
+  }
+
+  rygar_update_scroll(dst);
+
+  /* any checkpoint is stale now */
+  dst->dirty_pages = RAM_ALL_PAGES;
+}
+
+/**
+ * Copies the mutable state of the source machine to the clone, which must have
+ * been initialised with rygar_init_clone. Only the RAM and registers are
+ * copied, the ROMs and decoded graphics are shared.
+ */
+static void rygar_clone(rygar_t *src, rygar_t *dst) {
+  rygar_share_pages(dst, 0);
+
+  for (int addr = RAM_START; addr <= RAM_END; addr += MEM_PAGE_SIZE) {
+    const uint8_t *ptr = src->main.mem.page_table[addr >> MEM_PAGE_SHIFT].read_ptr;
+    memcpy(dst->main.mem.page_table[addr >> MEM_PAGE_SHIFT].write_ptr, ptr, MEM_PAGE_SIZE);
+  }
+
+  rygar_clone_registers(src, dst);
+}
+
+/**
+ * Clones the source machine like rygar_clone, except that the RAM pages are
+ * shared with the source until the clone writes them. The source must not run,
+ * or be shut down, while it shares pages with a clone.
+ */
+static void rygar_clone_cow(rygar_t *src, rygar_t *dst) {
+  rygar_share_pages(dst, src);
+  rygar_clone_registers(src, dst);
+}
+
+/**
+ * Saves a compressed snapshot to the given file. The snapshot and compression
+ * buffers are allocated for each call, so machines can save at the same time.
+ */
+static bool rygar_save_state(rygar_t *rygar, const char *filename) {
+  rygar_snapshot_t *snapshot = malloc(sizeof(rygar_snapshot_t));
+  lz_writer_t *writer = malloc(sizeof(lz_writer_t));
+  FILE *file = snapshot && writer ? fopen(filename, "wb") : 0;
+  bool ok = file != 0;
+
+  if (file) {
+    rygar_save_snapshot(rygar, snapshot);
+
+    lz_writer_init(writer, file);
+    lz_write(writer, snapshot, sizeof(rygar_snapshot_t));
+    lz_writer_flush(writer);
+
+    if (writer->error) ok = false;
+    if (fclose(file) != 0) ok = false;
+  }
+
+  free(writer);
+  free(snapshot);
+
+  return ok;
+}
+
+/**
+ * Loads a compressed snapshot from the given file.
+ */
+static bool rygar_load_state(rygar_t *rygar, const char *filename) {
+  rygar_snapshot_t *snapshot = malloc(sizeof(rygar_snapshot_t));
+  lz_reader_t *reader = malloc(sizeof(lz_reader_t));
+  FILE *file = snapshot && reader ? fopen(filename, "rb") : 0;
+  bool ok = false;
+
+  if (file) {
+    lz_reader_init(reader, file);
+    size_t n = lz_read(reader, snapshot, sizeof(rygar_snapshot_t));
+    fclose(file);
+
+    ok = n == sizeof(rygar_snapshot_t) && rygar_load_snapshot(rygar, snapshot);
+  }
+
+  free(reader);
+  free(snapshot);
+
+  return ok;
+}
+
+/**
+ * Follows the input events read in a frame, by running the copy of the machine
+ * that was cloned at the start of the frame, and so still has the previous
+ * input, until its frame differs from the machine's. When no events are being
+ * followed, the machine is cloned again for the next frame.
+ *
+ * This is called after each frame has been presented. If the presented frame
+ * was run ahead of the machine by the given number of frames, then the copy
+ * also runs ahead to compare it, and then it is rolled back.
+ */
+static void rygar_latency_frame(rygar_t *rygar, int ahead) {
+  rygar_t *shadow = rygar->latency_shadow;
+
+  if (shadow->frame_count + 1 != rygar->frame_count) {
+    /* a frame wasn't presented, so the frames can't be compared */
+    latency_stop(&rygar->latency);
+  } else if (latency_follow(&rygar->latency, rygar->frame_count)) {
+    rygar_snapshot_t snapshot;
+
+    shadow->skip_render = ahead > 0;
+    rygar_run_frame(shadow);
+
+    if (ahead > 0) {
+      rygar_save_snapshot(shadow, &snapshot);
+
+      for (int i = 0; i < ahead; i++) {
+        shadow->skip_render = i < ahead - 1;
+        rygar_run_frame(shadow);
+      }
+    }
+
+    bool differs = memcmp(shadow->framebuffer, rygar->framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)) != 0;
+    latency_frame(&rygar->latency, rygar->frame_count, differs);
+
+    if (ahead > 0) rygar_load_snapshot(shadow, &snapshot);
+  }
+
+  if (latency_start(&rygar->latency, rygar->frame_count)) {
+    rygar_clone(rygar, shadow);
+  }
+}
+
+/**
+ * This is called between ticks after each frame has been drawn, when the
+ * machine state is consistent and can be saved.
+ */
+static void rygar_frame_end(rygar_t *rygar) {
+  if (rygar->latency_shadow && !rygar->speculative && !rygar->skip_render) {
+    rygar_latency_frame(rygar, 0);
+  }
+
+  if (!rygar->speculative && replay_keyframe_due(&rygar->recorder, rygar->frame_count)) {
+    rygar_snapshot_t snapshot;
+
+    rygar_save_snapshot(rygar, &snapshot);
+    replay_record_keyframe(&rygar->recorder, rygar->frame_count, rygar->cycles, &snapshot);
+  }
+}
+
+/**
+ * Runs the emulation for the given number of CPU ticks, and returns the number
+ * of ticks that were run. The emulation stops early if a breakpoint or
+ * watchpoint is hit.
+ */
+static uint32_t rygar_run(rygar_t *rygar, uint32_t ticks_to_run) {
+  uint64_t pins = rygar->main.pins;
+  uint32_t frame_count = rygar->frame_count;
+  uint32_t tick;
+
+  for (tick = 0; tick < ticks_to_run && !rygar->debug.stopped; tick++) {
+    pins = rygar_tick_main(rygar, pins);
+
+    if (rygar->frame_count != frame_count) {
+      rygar->main.pins = pins;
+      frame_count = rygar->frame_count;
+      rygar_frame_end(rygar);
+    }
+  }
+
+  rygar->main.pins = pins;
+
+  return tick;
+}
+
+/**
+ * Runs the emulation until the next frame has been drawn, and returns false if
+ * it was stopped early by a breakpoint or watchpoint.
+ */
+static bool rygar_run_frame(rygar_t *rygar) {
+  uint64_t pins = rygar->main.pins;
+  uint32_t frame_count = rygar->frame_count;
+
+  while (rygar->frame_count == frame_count && !rygar->debug.stopped) {
+    pins = rygar_tick_main(rygar, pins);
+  }
+
+  rygar->main.pins = pins;
+
+  if (rygar->frame_count == frame_count) return false;
+
+  rygar_frame_end(rygar);
+
+  return true;
+}
+
+/**
+ * Runs the emulation for the given host frame time.
+ *
+ * Frames are rendered to the frame buffer as the emulated machine reaches
+ * VBLANK, so the frame buffer always contains the most recently completed
+ * frame.
+ */
+static void rygar_exec(rygar_t *rygar, uint32_t delta) {
+  rygar_run(rygar, clk_us_to_ticks(rygar->cpu_freq, delta));
+}
+
+/**
+ * Sets the main CPU clock as a percentage of the original clock.
+ *
+ * The game slows down when its logic can't finish within a frame, so running
+ * the CPU faster removes the slowdown. The video timing stays at 60Hz, so the
+ * VSYNC and VBLANK periods are scaled to the new clock.
+ */
+static void rygar_set_overclock(rygar_t *rygar, int percent) {
+  if (percent < MIN_OVERCLOCK) percent = MIN_OVERCLOCK;
+  if (percent > MAX_OVERCLOCK) percent = MAX_OVERCLOCK;
+
+  rygar->overclock = percent;
+  rygar->cpu_freq = (uint64_t)CPU_FREQ * percent / 100;
+  rygar->vsync_period = (uint64_t)VSYNC_PERIOD_4MHZ * percent / 100;
+  rygar->vblank_duration = (uint64_t)VBLANK_DURATION_4MHZ * percent / 100;
+
+  if (rygar->vsync_count > rygar->vsync_period) rygar->vsync_count = rygar->vsync_period;
+}
+
+/**
+ * Starts recording a replay from the current frame.
+ */
+static bool rygar_record_start(rygar_t *rygar, const char *filename, int keyframe_interval) {
+  rygar_snapshot_t snapshot;
+
+  if (!replay_record_start(&rygar->recorder, filename, sizeof(rygar_snapshot_t), keyframe_interval, rygar->cpu_freq)) return false;
+
+  rygar_save_snapshot(rygar, &snapshot);
+  replay_record_keyframe(&rygar->recorder, rygar->frame_count, rygar->cycles, &snapshot);
+
+  return true;
+}
+
+/**
+ * Stops recording, saving the hash of the final machine state.
+ */
+static bool rygar_record_stop(rygar_t *rygar) {
+  rygar_snapshot_t snapshot;
+
+  if (!replay_recording(&rygar->recorder)) return false;
+
+  rygar_save_snapshot(rygar, &snapshot);
+
+  return replay_record_stop(&rygar->recorder, rygar->frame_count, rygar->cycles, &snapshot);
+}
+
+/**
+ * Seeks to the given frame of the replay being played back, by restoring the
+ * nearest keyframe at or before it and fast-forwarding. Only the target frame
+ * is rendered.
+ */
+static bool rygar_seek(rygar_t *rygar, uint32_t frame) {
+  const rygar_snapshot_t *snapshot = replay_keyframe(&rygar->player, replay_find(&rygar->player, frame));
+
+  if (!snapshot || !rygar_load_snapshot(rygar, snapshot)) return false;
+
+  rygar->skip_render = true;
+  while (rygar->frame_count + 1 < frame && rygar_run_frame(rygar)) {}
+  rygar->skip_render = false;
+
+  if (rygar->frame_count < frame) {
+    rygar_run_frame(rygar);
+  } else {
+    /* The keyframe was saved just after its frame was drawn, so the frame is
+     * drawn again from the restored video RAM. */
+    rygar->frame_count--;
+    rygar_draw(rygar);
+  }
+
+  return true;
+}
+
+/**
+ * Opens a replay, and restores its first keyframe.
+ */
+static bool rygar_replay_open(rygar_t *rygar, const char *filename) {
+  if (!replay_open(&rygar->player, filename)) return false;
+
+  if (rygar->player.header->snapshot_size != sizeof(rygar_snapshot_t)) {
+    fprintf(stderr, "replay: incompatible snapshot size\n");
+    replay_close(&rygar->player);
+    return false;
+  }
+
+  /* the replay must run at the clock it was recorded with */
+  rygar_set_overclock(rygar, (uint64_t)rygar->player.header->cpu_freq * 100 / CPU_FREQ);
+
+  if (!rygar_seek(rygar, 0)) {
+    replay_close(&rygar->player);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,84 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include "sprite.h"
+
+#define SCENE_MAX_SPRITES (SPRITE_RAM_SIZE / SPRITE_SIZE)
+#define SCENE_CHAR_TILES (32 * 32)
+#define SCENE_FG_TILES (32 * 16)
+#define SCENE_BG_TILES (32 * 16)
+
+/* A structured observation of a frame, for bots and analytics. It contains
+ * the decoded sprites, tilemaps, and scroll registers, rather than pixels.
+ *
+ * The fields are stored as a struct of arrays, so each one can be used as a
+ * flat array. The sprites are in the same order as the sprite RAM, which is
+ * from the highest to the lowest priority, and only the first sprite_count
+ * entries are valid. The tiles are in row-major order. */
+typedef struct {
+  uint32_t frame;
+
+  /* scroll registers, the X registers are 16-bit */
+  uint16_t fg_scroll_x;
+  uint16_t fg_scroll_y;
+  uint16_t bg_scroll_x;
+  uint16_t bg_scroll_y;
+  uint8_t flip_screen;
+
+  /* sprites */
+  uint16_t sprite_count;
+  uint16_t sprite_code[SCENE_MAX_SPRITES];
+  uint8_t sprite_size[SCENE_MAX_SPRITES]; /* in pixels (8, 16, 32, or 64) */
+  int16_t sprite_x[SCENE_MAX_SPRITES];
+  int16_t sprite_y[SCENE_MAX_SPRITES];
+  uint8_t sprite_flip[SCENE_MAX_SPRITES]; /* bit 0 is flip X, bit 1 is flip Y */
+  uint8_t sprite_color[SCENE_MAX_SPRITES];
+  uint8_t sprite_priority[SCENE_MAX_SPRITES];
+
+  /* tilemaps */
+  uint16_t char_code[SCENE_CHAR_TILES];
+  uint8_t char_color[SCENE_CHAR_TILES];
+  uint16_t fg_code[SCENE_FG_TILES];
+  uint8_t fg_color[SCENE_FG_TILES];
+  uint16_t bg_code[SCENE_BG_TILES];
+  uint8_t bg_color[SCENE_BG_TILES];
+} scene_t;
@@ -0,0 +1,612 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lz.h"
+#include "sprite.h"
+
+/* Streams the display state to spectators over TCP, so they can render the
+ * game with the same tile renderer without running the emulation.
+ *
+ * After every frame the server sends a message containing the spans of the
+ * tile RAM, palette RAM, active sprite list, and video registers which have
+ * changed since the previous frame. A client which has just connected (or
+ * which fell behind) is sent a keyframe containing the whole state instead.
+ *
+ * Each message is a header followed by the (compressed) spans, where each
+ * span is a region id byte, a 16-bit offset, a 16-bit length, and the data. */
+#define SPECTATOR_MAGIC 0x56475952 /* "RYGV" */
+
+/* regions */
+#define SPECTATOR_CHAR_RAM 0
+#define SPECTATOR_FG_RAM 1
+#define SPECTATOR_BG_RAM 2
+#define SPECTATOR_PALETTE_RAM 3
+#define SPECTATOR_SPRITES 4
+#define SPECTATOR_REGISTERS 5
+#define SPECTATOR_NUM_REGIONS 6
+
+#define SPECTATOR_REGION_SIZE 0x800
+
+/* Active sprites are sent as a list, containing the six bytes used by each
+ * sprite, preceded by a 16-bit count. */
+#define SPECTATOR_SPRITE_SIZE 6
+
+/* Spans separated by fewer unchanged bytes than this are merged, because each
+ * span has a five byte header. */
+#define SPECTATOR_SPAN_HEADER_SIZE 5
+#define SPECTATOR_SPAN_GAP 6
+
+/* the largest possible message payload */
+#define SPECTATOR_MESSAGE_SIZE (SPECTATOR_NUM_REGIONS * (SPECTATOR_REGION_SIZE + SPECTATOR_SPAN_HEADER_SIZE))
+
+#define SPECTATOR_MAX_CLIENTS 4
+#define SPECTATOR_BUFFER_SIZE 0x10000
+
+typedef struct {
+  uint32_t magic;
+  uint32_t frame;
+  uint32_t raw_size;
+  uint32_t packed_size;
+} spectator_header_t;
+
+/**
+ * Packs the active sprites into a list.
+ */
+void spectator_pack_sprites(const uint8_t *sprite_ram, uint8_t *packed) {
+  int count = 0;
+
+  memset(packed, 0, SPECTATOR_REGION_SIZE);
+
+  for (int addr = 0; addr < SPRITE_RAM_SIZE; addr += SPRITE_SIZE) {
+    if (sprite_ram[addr] & 0x04) {
+      memcpy(packed + 2 + count * SPECTATOR_SPRITE_SIZE, sprite_ram + addr, SPECTATOR_SPRITE_SIZE);
+      count++;
+    }
+  }
+
+  packed[0] = count & 0xff;
+  packed[1] = count >> 8;
+}
+
+/**
+ * Unpacks a list of active sprites into the sprite RAM. The sprites keep
+ * their order, so they are drawn with the same priority.
+ */
+void spectator_unpack_sprites(const uint8_t *packed, uint8_t *sprite_ram) {
+  int count = packed[0] | packed[1] << 8;
+
+  if (count > SPRITE_RAM_SIZE / SPRITE_SIZE) count = SPRITE_RAM_SIZE / SPRITE_SIZE;
+
+  memset(sprite_ram, 0, SPRITE_RAM_SIZE);
+
+  for (int i = 0; i < count; i++) {
+    memcpy(sprite_ram + i * SPRITE_SIZE, packed + 2 + i * SPECTATOR_SPRITE_SIZE, SPECTATOR_SPRITE_SIZE);
+  }
+}
+
+static uint8_t *spectator_write_span(uint8_t *out, int region, int offset, const uint8_t *data, int len) {
+  *out++ = region;
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  *out++ = len & 0xff;
+  *out++ = len >> 8;
+  memcpy(out, data, len);
+
+  return out + len;
+}
+
+/**
+ * Writes the spans of the region which differ from the previous frame.
+ */
+static uint8_t *spectator_write_delta(uint8_t *out, int region, const uint8_t *prev, const uint8_t *data, int size) {
+  int i = 0;
+
+  while (i < size) {
+    if (prev[i] == data[i]) {
+      i++;
+      continue;
+    }
+
+    int end = i + 1;
+
+    for (int j = end, same = 0; j < size && same < SPECTATOR_SPAN_GAP; j++) {
+      if (prev[j] == data[j]) {
+        same++;
+      } else {
+        same = 0;
+        end = j + 1;
+      }
+    }
+
+    out = spectator_write_span(out, region, i, data + i, end - i);
+    i = end;
+  }
+
+  return out;
+}
+
+#if !defined(__EMSCRIPTEN__) && !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* a connection to a spectator */
+typedef struct {
+  int socket;
+
+  /* whether the next message must be a keyframe */
+  bool sync;
+
+  /* data waiting to be sent */
+  int len;
+  uint8_t buffer[SPECTATOR_BUFFER_SIZE];
+} spectator_conn_t;
+
+typedef struct {
+  int socket;
+  spectator_conn_t conns[SPECTATOR_MAX_CLIENTS];
+
+  /* the regions sent in the previous frame */
+  uint8_t prev[SPECTATOR_NUM_REGIONS][SPECTATOR_REGION_SIZE];
+
+  /* message buffers */
+  uint8_t raw[SPECTATOR_MESSAGE_SIZE];
+  uint8_t delta[sizeof(spectator_header_t) + LZ_COMPRESS_BOUND(SPECTATOR_MESSAGE_SIZE)];
+  uint8_t keyframe[sizeof(spectator_header_t) + LZ_COMPRESS_BOUND(SPECTATOR_MESSAGE_SIZE)];
+
+  /* stats */
+  uint32_t frames;
+  uint64_t delta_bytes;
+} spectator_server_t;
+
+typedef struct {
+  int socket;
+
+  /* data received, but not yet applied */
+  int len;
+  uint8_t buffer[SPECTATOR_BUFFER_SIZE];
+  uint8_t raw[SPECTATOR_MESSAGE_SIZE];
+
+  /* the active sprite list */
+  uint8_t sprites[SPECTATOR_REGION_SIZE];
+
+  /* stats */
+  uint32_t frame;
+  uint32_t frames;
+  uint64_t bytes;
+} spectator_client_t;
+
+void spectator_server_init(spectator_server_t *server) {
+  server->socket = -1;
+}
+
+static void spectator_set_nonblocking(int fd) {
+  int one = 1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * Starts listening for spectators on the given port. Only connections from
+ * the loopback interface are accepted.
+ */
+bool spectator_listen(spectator_server_t *server, int port) {
+  memset(server, 0, sizeof(spectator_server_t));
+
+  for (int i = 0; i < SPECTATOR_MAX_CLIENTS; i++) server->conns[i].socket = -1;
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SPECTATOR_MAX_CLIENTS) < 0) {
+    fprintf(stderr, "spectator: failed to listen on port %d\n", port);
+    if (fd >= 0) close(fd);
+    server->socket = -1;
+    return false;
+  }
+
+  server->socket = fd;
+  printf("spectator: listening on port %d\n", port);
+
+  return true;
+}
+
+/**
+ * Accepts a spectator, waiting up to the given time for one to connect.
+ */
+bool spectator_accept(spectator_server_t *server, int timeout_ms) {
+  struct pollfd pfd = { .fd = server->socket, .events = POLLIN };
+
+  if (server->socket < 0 || poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+  int fd = accept(server->socket, 0, 0);
+
+  if (fd < 0) return false;
+
+  for (int i = 0; i < SPECTATOR_MAX_CLIENTS; i++) {
+    spectator_conn_t *conn = &server->conns[i];
+
+    if (conn->socket < 0) {
+      spectator_set_nonblocking(fd);
+      conn->socket = fd;
+      conn->sync = true;
+      conn->len = 0;
+      printf("spectator: client connected\n");
+      return true;
+    }
+  }
+
+  close(fd);
+
+  return false;
+}
+
+static void spectator_flush(spectator_conn_t *conn) {
+  int sent = 0;
+
+  while (sent < conn->len) {
+    ssize_t n = send(conn->socket, conn->buffer + sent, conn->len - sent, MSG_NOSIGNAL);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+    if (n <= 0) {
+      printf("spectator: client disconnected\n");
+      close(conn->socket);
+      conn->socket = -1;
+      conn->len = 0;
+      return;
+    }
+
+    sent += n;
+  }
+
+  memmove(conn->buffer, conn->buffer + sent, conn->len - sent);
+  conn->len -= sent;
+}
+
+/**
+ * Builds a message from the given regions, either a keyframe or the changes
+ * since the previous frame, and returns its size.
+ */
+static int spectator_build(spectator_server_t *server, uint8_t *message, uint32_t frame, const uint8_t *const regions[], const int sizes[], bool keyframe) {
+  uint8_t *out = server->raw;
+
+  for (int i = 0; i < SPECTATOR_NUM_REGIONS; i++) {
+    if (keyframe) {
+      out = spectator_write_span(out, i, 0, regions[i], sizes[i]);
+    } else {
+      out = spectator_write_delta(out, i, server->prev[i], regions[i], sizes[i]);
+    }
+  }
+
+  spectator_header_t header = {
+    .magic = SPECTATOR_MAGIC,
+    .frame = frame,
+    .raw_size = out - server->raw,
+  };
+
+  uint8_t *payload = message + sizeof(header);
+  int packed_size = lz_compress(server->raw, header.raw_size, payload, LZ_COMPRESS_BOUND(SPECTATOR_MESSAGE_SIZE));
+
+  /* send small or incompressible messages raw */
+  if (packed_size <= 0 || packed_size >= (int)header.raw_size) {
+    packed_size = header.raw_size;
+    memcpy(payload, server->raw, packed_size);
+  }
+
+  header.packed_size = packed_size;
+  memcpy(message, &header, sizeof(header));
+
+  return sizeof(header) + packed_size;
+}
+
+/**
+ * Sends the display state for a frame to every spectator. The regions must be
+ * given in the order of the region ids.
+ */
+void spectator_frame(spectator_server_t *server, uint32_t frame, const uint8_t *const regions[], const int sizes[]) {
+  if (server->socket < 0) return;
+
+  spectator_accept(server, 0);
+
+  int delta_len = -1;
+  int keyframe_len = -1;
+
+  for (int i = 0; i < SPECTATOR_MAX_CLIENTS; i++) {
+    spectator_conn_t *conn = &server->conns[i];
+
+    if (conn->socket < 0) continue;
+
+    const uint8_t *message;
+    int len;
+
+    if (conn->sync) {
+      if (keyframe_len < 0) keyframe_len = spectator_build(server, server->keyframe, frame, regions, sizes, true);
+      message = server->keyframe;
+      len = keyframe_len;
+    } else {
+      if (delta_len < 0) delta_len = spectator_build(server, server->delta, frame, regions, sizes, false);
+      message = server->delta;
+      len = delta_len;
+    }
+
+    if (conn->len + len <= SPECTATOR_BUFFER_SIZE) {
+      memcpy(conn->buffer + conn->len, message, len);
+      conn->len += len;
+      conn->sync = false;
+    } else {
+      /* the client has fallen behind, so it needs a keyframe once it has
+       * caught up */
+      conn->sync = true;
+    }
+
+    spectator_flush(conn);
+  }
+
+  if (delta_len >= 0) {
+    server->frames++;
+    server->delta_bytes += delta_len;
+  }
+
+  for (int i = 0; i < SPECTATOR_NUM_REGIONS; i++) {
+    memcpy(server->prev[i], regions[i], sizes[i]);
+  }
+}
+
+void spectator_server_shutdown(spectator_server_t *server) {
+  if (server->frames > 0) {
+    printf("spectator: %u frames sent, %.0f bytes/frame, %.1f KB/s at 60fps\n",
+      server->frames,
+      (double)server->delta_bytes / server->frames,
+      (double)server->delta_bytes / server->frames * 60 / 1024);
+  }
+
+  for (int i = 0; i < SPECTATOR_MAX_CLIENTS; i++) {
+    if (server->conns[i].socket >= 0) close(server->conns[i].socket);
+  }
+
+  if (server->socket >= 0) close(server->socket);
+
+  server->socket = -1;
+}
+
+/**
+ * Connects to a server at the given HOST:PORT address.
+ */
+bool spectator_connect(spectator_client_t *client, const char *address) {
+  char host[256];
+  const char *port = strrchr(address, ':');
+
+  memset(client, 0, sizeof(spectator_client_t));
+  client->socket = -1;
+
+  if (!port || port - address >= (int)sizeof(host)) {
+    fprintf(stderr, "spectator: invalid address %s\n", address);
+    return false;
+  }
+
+  memcpy(host, address, port - address);
+  host[port - address] = 0;
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *info;
+
+  if (getaddrinfo(host, port + 1, &hints, &info) != 0) {
+    fprintf(stderr, "spectator: failed to resolve %s\n", host);
+    return false;
+  }
+
+  for (struct addrinfo *ai = info; ai; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      spectator_set_nonblocking(fd);
+      client->socket = fd;
+      break;
+    }
+
+    if (fd >= 0) close(fd);
+  }
+
+  freeaddrinfo(info);
+
+  if (client->socket < 0) {
+    fprintf(stderr, "spectator: failed to connect to %s\n", address);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Applies the spans in a message payload, and returns false if it is
+ * malformed.
+ */
+static bool spectator_apply(spectator_client_t *client, const uint8_t *data, int size, void (*write_cb)(int region, int offset, const uint8_t *data, int len, void *user), void *user) {
+  const uint8_t *end = data + size;
+  bool sprites = false;
+
+  while (data < end) {
+    if (end - data < SPECTATOR_SPAN_HEADER_SIZE) return false;
+
+    int region = data[0];
+    int offset = data[1] | data[2] << 8;
+    int len = data[3] | data[4] << 8;
+
+    data += SPECTATOR_SPAN_HEADER_SIZE;
+
+    if (region >= SPECTATOR_NUM_REGIONS || offset + len > SPECTATOR_REGION_SIZE || end - data < len) return false;
+
+    if (region == SPECTATOR_SPRITES) {
+      memcpy(client->sprites + offset, data, len);
+      sprites = true;
+    } else {
+      write_cb(region, offset, data, len, user);
+    }
+
+    data += len;
+  }
+
+  /* the sprite list is only meaningful as a whole */
+  if (sprites) write_cb(SPECTATOR_SPRITES, 0, client->sprites, SPECTATOR_REGION_SIZE, user);
+
+  return true;
+}
+
+/**
+ * Receives messages from the server, waiting up to the given time for data,
+ * and writes the changes with the given callback (which is passed the user
+ * data). Returns the number of
+ * frames received, or -1 if the connection was closed.
+ */
+int spectator_poll(spectator_client_t *client, int timeout_ms, void (*write_cb)(int region, int offset, const uint8_t *data, int len, void *user), void *user) {
+  struct pollfd pfd = { .fd = client->socket, .events = POLLIN };
+  int frames = 0;
+
+  if (client->socket < 0) return -1;
+  if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+
+  for (;;) {
+    ssize_t n = recv(client->socket, client->buffer + client->len, SPECTATOR_BUFFER_SIZE - client->len, 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+    if (n <= 0) {
+      close(client->socket);
+      client->socket = -1;
+      return frames > 0 ? frames : -1;
+    }
+
+    client->len += n;
+    client->bytes += n;
+
+    /* apply every complete message */
+    int pos = 0;
+
+    while (client->len - pos >= (int)sizeof(spectator_header_t)) {
+      spectator_header_t header;
+      memcpy(&header, client->buffer + pos, sizeof(header));
+
+      if (header.magic != SPECTATOR_MAGIC ||
+          header.raw_size > SPECTATOR_MESSAGE_SIZE ||
+          header.packed_size > header.raw_size) {
+        fprintf(stderr, "spectator: invalid message\n");
+        close(client->socket);
+        client->socket = -1;
+        return -1;
+      }
+
+      if (client->len - pos < (int)(sizeof(header) + header.packed_size)) break;
+
+      const uint8_t *payload = client->buffer + pos + sizeof(header);
+      int raw_size = header.raw_size;
+
+      if (header.packed_size < header.raw_size) {
+        raw_size = lz_decompress(payload, header.packed_size, client->raw, SPECTATOR_MESSAGE_SIZE);
+        payload = client->raw;
+      }
+
+      if (raw_size != (int)header.raw_size || !spectator_apply(client, payload, raw_size, write_cb, user)) {
+        fprintf(stderr, "spectator: invalid message\n");
+        close(client->socket);
+        client->socket = -1;
+        return -1;
+      }
+
+      pos += sizeof(header) + header.packed_size;
+      client->frame = header.frame;
+      client->frames++;
+      frames++;
+    }
+
+    memmove(client->buffer, client->buffer + pos, client->len - pos);
+    client->len -= pos;
+  }
+
+  return frames;
+}
+
+void spectator_client_shutdown(spectator_client_t *client) {
+  if (client->frames > 0) {
+    printf("spectator: %u frames received, %.0f bytes/frame, %.1f KB/s at 60fps\n",
+      client->frames,
+      (double)client->bytes / client->frames,
+      (double)client->bytes / client->frames * 60 / 1024);
+  }
+
+  if (client->socket >= 0) close(client->socket);
+
+  client->socket = -1;
+}
+
+#else
+
+typedef struct { int socket; } spectator_server_t;
+typedef struct { int socket; } spectator_client_t;
+
+void spectator_server_init(spectator_server_t *server) { server->socket = -1; }
+bool spectator_listen(spectator_server_t *server, int port) { server->socket = -1; return false; }
+bool spectator_accept(spectator_server_t *server, int timeout_ms) { return false; }
+void spectator_frame(spectator_server_t *server, uint32_t frame, const uint8_t *const regions[], const int sizes[]) {}
+void spectator_server_shutdown(spectator_server_t *server) {}
+bool spectator_connect(spectator_client_t *client, const char *address) { client->socket = -1; return false; }
+int spectator_poll(spectator_client_t *client, int timeout_ms, void (*write_cb)(int region, int offset, const uint8_t *data, int len, void *user), void *user) { return -1; }
+void spectator_client_shutdown(spectator_client_t *client) {}
+
+#endif
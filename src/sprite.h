@@ -37,6 +37,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "bitmap.h"
@@ -69,8 +70,29 @@ static const uint8_t sprite_tile_offset_table[TILE_HEIGHT][TILE_WIDTH] = {
   { 42, 43, 46, 47, 58, 59, 62, 63 }
 };
 
+/* a decoded sprite */
+typedef struct {
+  /* the code of the first tile, with the bits for the tile offsets masked */
+  uint16_t code;
+
+  /* the number of 8x8 tiles along each side (1, 2, 4, or 8) */
+  int size;
+
+  /* position, including the 9th bits */
+  int x;
+  int y;
+
+  bool flip_x;
+  bool flip_y;
+  uint8_t color;
+
+  /* the layers which obscure the sprite (0-3) */
+  uint8_t priority;
+} sprite_t;
+
 /**
- * Draws the sprites to the given bitmap.
+ * Decodes the sprite at the given address in the sprite RAM, and returns false
+ * if it isn't enabled.
  *
  * The sprites are stored in the following format:
  *
@@ -91,57 +113,66 @@ static const uint8_t sprite_tile_offset_table[TILE_HEIGHT][TILE_WIDTH] = {
  *       6 | -------- |
  *       7 | -------- |
  */
+static inline bool sprite_decode(const uint8_t *ram, sprite_t *sprite) {
+  if (!(ram[0] & 0x04)) return false;
+
+  uint8_t bank = ram[0];
+  uint8_t b3 = ram[3];
+  int size = ram[2] & 0x03;
+
+  /* Ensure the lower sprite code bits are masked. This is required because
+   * we add the tile code offset from the lookup table for the different
+   * sprite sizes. */
+  sprite->code = ((bank & 0xf0) << 4 | ram[1]) & ~((1 << (size * 2)) - 1);
+
+  /* the size is the number of 8x8 tiles (8x8, 16x16, 32x32, 64x64) */
+  sprite->size = 1 << size;
+
+  sprite->x = ram[5] - ((b3 & 0x10) << 4);
+  sprite->y = ram[4] - ((b3 & 0x20) << 3);
+  sprite->flip_x = bank & 0x01;
+  sprite->flip_y = bank & 0x02;
+  sprite->color = b3 & 0x0f;
+  sprite->priority = b3 >> 6;
+
+  return true;
+}
+
+/**
+ * Draws the sprites to the given bitmap.
+ */
 void sprite_draw(bitmap_t *bitmap, uint8_t *ram, uint8_t *rom, uint16_t palette_offset, uint8_t flags) {
   /* Sprites are sorted from highest to lowest priority, so we need to iterate
    * backwards to ensure that the sprites with the highest priority are drawn
    * last */
   for (int addr = SPRITE_RAM_SIZE - SPRITE_SIZE; addr >= 0; addr -= SPRITE_SIZE) {
-    bool enable = ram[addr] & 0x04;
+    sprite_t sprite;
 
-		if (enable) {
-      uint8_t bank = ram[addr];
-      uint16_t code = (bank & 0xf0)<<4 | ram[addr + 1];
-      int size = ram[addr + 2] & 0x03;
-
-      /* Ensure the lower sprite code bits are masked. This is required because
-       * we add the tile code offset from the lookup table for the different
-       * sprite sizes. */
-      code &= ~((1 << (size * 2)) - 1);
-
-      /* the size is the number of 8x8 tiles (8x8, 16x16, 32x32, 64x64) */
-      size = 1 << size;
-
-      uint8_t b3 = ram[addr + 3];
-			int xpos = ram[addr + 5] - ((b3 & 0x10) << 4);
-			int ypos = ram[addr + 4] - ((b3 & 0x20) << 3);
-
-			bool flip_x = bank & 0x01;
-			bool flip_y = bank & 0x02;
-      uint8_t color = b3 & 0x0f;
+    if (sprite_decode(ram + addr, &sprite)) {
       uint8_t priority_mask;
 
-			switch (b3 >> 6) {
-				default:
-				case 0x0: priority_mask = TILE_LAYER0; break; /* obscured by other sprites */
-				case 0x1: priority_mask = TILE_LAYER0 | TILE_LAYER1; break; /* obscured by text layer */
-				case 0x2: priority_mask = TILE_LAYER0 | TILE_LAYER1 | TILE_LAYER2; break; /* obscured by foreground */
-				case 0x3: priority_mask = TILE_LAYER0 | TILE_LAYER1 | TILE_LAYER2 | TILE_LAYER3; break; /* obscured by background */
-			}
+      switch (sprite.priority) {
+        default:
+        case 0x0: priority_mask = TILE_LAYER0; break; /* obscured by other sprites */
+        case 0x1: priority_mask = TILE_LAYER0 | TILE_LAYER1; break; /* obscured by text layer */
+        case 0x2: priority_mask = TILE_LAYER0 | TILE_LAYER1 | TILE_LAYER2; break; /* obscured by foreground */
+        case 0x3: priority_mask = TILE_LAYER0 | TILE_LAYER1 | TILE_LAYER2 | TILE_LAYER3; break; /* obscured by background */
+      }
 
-      for (int row = 0; row < size; row++) {
-        for (int col = 0; col < size; col++) {
-          int x = xpos + TILE_WIDTH * (flip_x ? (size - 1 - col) : col);
-          int y = ypos + TILE_HEIGHT * (flip_y ? (size - 1 - row) : row);
+      for (int row = 0; row < sprite.size; row++) {
+        for (int col = 0; col < sprite.size; col++) {
+          int x = sprite.x + TILE_WIDTH * (sprite.flip_x ? (sprite.size - 1 - col) : col);
+          int y = sprite.y + TILE_HEIGHT * (sprite.flip_y ? (sprite.size - 1 - row) : row);
 
           tile_draw(
             bitmap,
             rom,
-            code + sprite_tile_offset_table[row][col],
-            color,
+            sprite.code + sprite_tile_offset_table[row][col],
+            sprite.color,
             palette_offset,
             x, y,
             TILE_WIDTH, TILE_HEIGHT,
-            flip_x, flip_y,
+            sprite.flip_x, sprite.flip_y,
             priority_mask,
             flags
           );
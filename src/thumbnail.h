@@ -0,0 +1,210 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the thumbnail has a pixel for each 8x8 block of the screen */
+#define THUMBNAIL_BLOCK 8
+#define THUMBNAIL_WIDTH 32
+#define THUMBNAIL_HEIGHT 28
+
+/* layers, in the same order as the palette */
+#define THUMBNAIL_SPRITE 0
+#define THUMBNAIL_CHAR 1
+#define THUMBNAIL_FG 2
+#define THUMBNAIL_BG 3
+#define THUMBNAIL_NUM_LAYERS 4
+
+/* every layer has 16 colors of 16 pens */
+#define THUMBNAIL_COLORS 16
+#define THUMBNAIL_PENS 16
+
+/* The thumbnail renderer draws each tile as a single pixel of its average
+ * color, rather than drawing its pixels.
+ *
+ * The number of pixels of each pen in every tile is counted once. The average
+ * color of a tile in a color is derived from the counts and the palette the
+ * first time it is needed, and cached until the palette entries of that color
+ * change. The alpha channel of an average color is the fraction of the tile
+ * which isn't transparent. */
+/* a cached average color, which is only valid if its tag matches the epoch of
+ * its color */
+typedef struct {
+  uint32_t color;
+  uint32_t tag;
+} thumbnail_entry_t;
+
+typedef struct {
+  int count;
+
+  /* the number of pixels of each pen in each tile */
+  uint16_t (*pens)[THUMBNAIL_PENS];
+
+  /* the average color of each tile in each color */
+  thumbnail_entry_t *entries;
+  uint32_t epochs[THUMBNAIL_COLORS];
+
+  /* the palette entries of the layer */
+  const uint32_t *palette;
+} thumbnail_layer_t;
+
+typedef struct {
+  thumbnail_layer_t layers[THUMBNAIL_NUM_LAYERS];
+
+  /* the palette the cached colors were calculated with */
+  uint32_t palette[THUMBNAIL_NUM_LAYERS * THUMBNAIL_COLORS * THUMBNAIL_PENS];
+} thumbnail_t;
+
+void thumbnail_init(thumbnail_t *thumbnail) {
+  memset(thumbnail, 0, sizeof(thumbnail_t));
+}
+
+/**
+ * Counts the pens of the tiles in a layer. The tiles must have been decoded
+ * with one byte per pixel.
+ */
+void thumbnail_init_layer(thumbnail_t *thumbnail, int layer, const uint8_t *rom, int tile_size, int count) {
+  thumbnail_layer_t *l = &thumbnail->layers[layer];
+
+  l->count = count;
+  l->pens = calloc(count, sizeof(*l->pens));
+  l->entries = calloc(count * THUMBNAIL_COLORS, sizeof(thumbnail_entry_t));
+  l->palette = &thumbnail->palette[layer * THUMBNAIL_COLORS * THUMBNAIL_PENS];
+
+  /* a tag of zero is never valid */
+  for (int i = 0; i < THUMBNAIL_COLORS; i++) l->epochs[i] = 1;
+
+  for (int code = 0; code < count; code++) {
+    const uint8_t *tile = rom + code * tile_size;
+
+    for (int i = 0; i < tile_size; i++) l->pens[code][tile[i] & 0xf]++;
+  }
+}
+
+void thumbnail_shutdown(thumbnail_t *thumbnail) {
+  for (int i = 0; i < THUMBNAIL_NUM_LAYERS; i++) {
+    free(thumbnail->layers[i].pens);
+    free(thumbnail->layers[i].entries);
+  }
+
+  memset(thumbnail, 0, sizeof(thumbnail_t));
+}
+
+/**
+ * Invalidates the cached colors for the palette entries which have changed.
+ * The palette has 16 colors of 16 pens for each layer.
+ */
+void thumbnail_update_palette(thumbnail_t *thumbnail, const uint32_t *palette) {
+  for (int layer = 0; layer < THUMBNAIL_NUM_LAYERS; layer++) {
+    thumbnail_layer_t *l = &thumbnail->layers[layer];
+
+    for (int color = 0; color < THUMBNAIL_COLORS; color++) {
+      int offset = (layer * THUMBNAIL_COLORS + color) * THUMBNAIL_PENS;
+      size_t size = THUMBNAIL_PENS * sizeof(uint32_t);
+
+      if (memcmp(&thumbnail->palette[offset], &palette[offset], size) == 0) continue;
+
+      memcpy(&thumbnail->palette[offset], &palette[offset], size);
+
+      if (++l->epochs[color] == 0) {
+        /* the epoch has wrapped, so old tags could match it again */
+        for (int code = 0; code < l->count; code++) l->entries[code * THUMBNAIL_COLORS + color].tag = 0;
+        l->epochs[color] = 1;
+      }
+    }
+  }
+}
+
+/**
+ * Calculates the average color of a tile.
+ */
+static uint32_t thumbnail_average(const thumbnail_layer_t *layer, int code, int color) {
+  const uint16_t *pens = layer->pens[code];
+  const uint32_t *palette = &layer->palette[color * THUMBNAIL_PENS];
+  uint32_t r = 0, g = 0, b = 0, opaque = 0;
+
+  /* pen zero is transparent */
+  for (int pen = 1; pen < THUMBNAIL_PENS; pen++) {
+    uint32_t c = palette[pen];
+
+    r += (c & 0xff) * pens[pen];
+    g += (c >> 8 & 0xff) * pens[pen];
+    b += (c >> 16 & 0xff) * pens[pen];
+    opaque += pens[pen];
+  }
+
+  if (opaque == 0) return 0;
+
+  return (opaque * 255 / (opaque + pens[0])) << 24 | (b / opaque) << 16 | (g / opaque) << 8 | (r / opaque);
+}
+
+/**
+ * Returns the average color of a tile.
+ */
+static inline uint32_t thumbnail_tile_color(thumbnail_t *thumbnail, int layer, int code, int color) {
+  thumbnail_layer_t *l = &thumbnail->layers[layer];
+  thumbnail_entry_t *entry = &l->entries[code * THUMBNAIL_COLORS + color];
+
+  if (entry->tag != l->epochs[color]) {
+    entry->color = thumbnail_average(l, code, color);
+    entry->tag = l->epochs[color];
+  }
+
+  return entry->color;
+}
+
+/**
+ * Blends an average color over a pixel, by the fraction of the tile which is
+ * opaque.
+ */
+static inline uint32_t thumbnail_blend(uint32_t dst, uint32_t src) {
+  uint32_t a = src >> 24;
+
+  if (a == 0) return dst;
+  if (a == 255) return src;
+
+  uint32_t rb = ((src & 0xff00ff) * a + (dst & 0xff00ff) * (255 - a)) >> 8 & 0xff00ff;
+  uint32_t g = ((src & 0x00ff00) * a + (dst & 0x00ff00) * (255 - a)) >> 8 & 0x00ff00;
+
+  return 0xff000000 | rb | g;
+}
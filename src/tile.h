@@ -168,7 +168,7 @@ void tile_draw(
       /* ensure we're inside the bitmap */
       if (x + u < 0 || x + u >= bitmap->width) continue;
 
-      int offset = (v * bitmap->width) + u;
+      int offset = (v * bitmap->stride) + u;
       uint8_t pen = tile[(v ^ flip_mask_y) * width + (u ^ flip_mask_x)] & 0xf;
 
       tile_draw_pixel(
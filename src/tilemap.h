@@ -62,6 +62,9 @@ typedef struct {
   uint8_t *ram;
   uint8_t *rom;
 
+  /* arena for the pixel data, or null if the tilemap is never drawn */
+  arena_t *arena;
+
   /* dimensions */
   int tile_width;
   int tile_height;
@@ -114,7 +117,8 @@ void tilemap_init(tilemap_t *tilemap, const tilemap_desc_t *desc) {
   tilemap->rows = desc->rows;
   tilemap->tile_cb = desc->tile_cb;
 
-  bitmap_init(&tilemap->bitmap, width, height);
+  /* the pixel data isn't needed if the tilemap is never drawn */
+  if (desc->arena) bitmap_init(&tilemap->bitmap, width, height, desc->arena);
 }
 
 /**
@@ -131,6 +135,15 @@ void tilemap_mark_tile_dirty(tilemap_t *tilemap, const int index) {
   tilemap->tiles[index].flags |= TILEMAP_TILE_DIRTY;
 }
 
+/**
+ * Marks every tile as dirty, so the whole tilemap is redrawn.
+ */
+void tilemap_mark_all_dirty(tilemap_t *tilemap) {
+  for (int i = 0; i < tilemap->rows * tilemap->cols; i++) {
+    tilemap->tiles[i].flags |= TILEMAP_TILE_DIRTY;
+  }
+}
+
 /**
  * Sets the horizontal scroll offset.
  */
@@ -0,0 +1,171 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+/* trace file format
+ *
+ * A trace file is a trace_header_t followed by `count` trace_record_t
+ * structs, ordered from oldest to newest. All values are little-endian. */
+#define TRACE_MAGIC 0x54475952 /* "RYGT" */
+#define TRACE_VERSION 1
+
+/* memory access flags */
+#define TRACE_MEM_RD 0x01
+#define TRACE_MEM_WR 0x02
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint32_t count;
+  uint32_t reserved;
+} trace_header_t;
+
+/* a single instruction fetch (M1 cycle), with the registers as they were
+ * before the instruction executed, and the last memory access it made */
+typedef struct {
+  uint64_t cycle;
+  uint16_t pc;
+  uint16_t af;
+  uint16_t bc;
+  uint16_t de;
+  uint16_t hl;
+  uint16_t ix;
+  uint16_t iy;
+  uint16_t sp;
+  uint16_t mem_addr;
+  uint8_t mem_data;
+  uint8_t mem_flags;
+  uint8_t opcode;
+  uint8_t bank;
+  uint16_t reserved;
+} trace_record_t;
+
+#ifdef RYGAR_TRACE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chips/z80.h"
+
+/* number of records in the ring buffer (must be a power of two) */
+#define TRACE_SIZE 0x10000
+
+typedef struct {
+  trace_record_t records[TRACE_SIZE];
+
+  /* total number of records written */
+  uint64_t count;
+} trace_t;
+
+void trace_init(trace_t *trace) {
+  memset(trace, 0, sizeof(trace_t));
+}
+
+/**
+ * Records a CPU tick. Instruction fetches start a new record, and any other
+ * memory access is added to the current record.
+ */
+static inline void trace_tick(trace_t *trace, z80_t *cpu, uint64_t pins, uint8_t bank, uint64_t cycle) {
+  if (!(pins & Z80_MREQ)) return;
+
+  if ((pins & (Z80_M1 | Z80_RD)) == (Z80_M1 | Z80_RD)) {
+    trace_record_t *record = &trace->records[trace->count++ & (TRACE_SIZE - 1)];
+
+    *record = (trace_record_t) {
+      .cycle = cycle,
+      .pc = Z80_GET_ADDR(pins),
+      .af = cpu->af,
+      .bc = cpu->bc,
+      .de = cpu->de,
+      .hl = cpu->hl,
+      .ix = cpu->ix,
+      .iy = cpu->iy,
+      .sp = cpu->sp,
+      .opcode = Z80_GET_DATA(pins),
+      .bank = bank,
+    };
+  } else if (trace->count > 0 && (pins & (Z80_RD | Z80_WR))) {
+    trace_record_t *record = &trace->records[(trace->count - 1) & (TRACE_SIZE - 1)];
+
+    record->mem_addr = Z80_GET_ADDR(pins);
+    record->mem_data = Z80_GET_DATA(pins);
+    record->mem_flags = (pins & Z80_WR) ? TRACE_MEM_WR : TRACE_MEM_RD;
+  }
+}
+
+/**
+ * Writes the contents of the ring buffer to a file.
+ */
+bool trace_dump(trace_t *trace, const char *filename) {
+  FILE *file = fopen(filename, "wb");
+
+  if (!file) return false;
+
+  uint32_t count = trace->count < TRACE_SIZE ? (uint32_t)trace->count : TRACE_SIZE;
+  uint64_t start = trace->count - count;
+
+  trace_header_t header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .record_size = sizeof(trace_record_t),
+    .count = count,
+  };
+
+  fwrite(&header, sizeof(header), 1, file);
+
+  for (uint64_t i = start; i < trace->count; i++) {
+    fwrite(&trace->records[i & (TRACE_SIZE - 1)], sizeof(trace_record_t), 1, file);
+  }
+
+  fclose(file);
+
+  return true;
+}
+
+#define TRACE_TICK(trace, cpu, pins, bank, cycle) trace_tick(trace, cpu, pins, bank, cycle)
+
+#else
+
+#define TRACE_TICK(trace, cpu, pins, bank, cycle) ((void)0)
+
+#endif /* RYGAR_TRACE */
@@ -0,0 +1,104 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * Prints a Z80 execution trace file written by the emulator.
+ *
+ * Usage: tracedump FILE
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s FILE\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(argv[1], "rb");
+
+  if (!file) {
+    fprintf(stderr, "tracedump: failed to open %s\n", argv[1]);
+    return 1;
+  }
+
+  trace_header_t header;
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != TRACE_MAGIC ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "tracedump: %s is not a trace file\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  printf("cycle        pc   op bk af   bc   de   hl   ix   iy   sp   mem\n");
+
+  trace_record_t record;
+
+  for (uint32_t i = 0; i < header.count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+    printf("%012llu %04x %02x %02x %04x %04x %04x %04x %04x %04x %04x",
+      (unsigned long long)record.cycle,
+      record.pc,
+      record.opcode,
+      record.bank,
+      record.af,
+      record.bc,
+      record.de,
+      record.hl,
+      record.ix,
+      record.iy,
+      record.sp);
+
+    if (record.mem_flags & TRACE_MEM_WR) {
+      printf(" %04x<-%02x", record.mem_addr, record.mem_data);
+    } else if (record.mem_flags & TRACE_MEM_RD) {
+      printf(" %04x->%02x", record.mem_addr, record.mem_data);
+    }
+
+    putchar('\n');
+  }
+
+  fclose(file);
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rygar.h"
+
+/* Verifies that a replay plays back deterministically, using every core.
+ *
+ * Each segment of a replay starts with a keyframe, and ends where the next
+ * keyframe starts, so the segments can be verified independently. A worker
+ * thread restores the keyframe at the start of a segment, runs the segment
+ * without rendering, and checks that the hash of the machine state at the end
+ * matches the hash of the next keyframe, or the hash in the trailer for the
+ * last segment. The ROMs are decoded once, and shared by the machines of the
+ * worker threads. */
+#define VERIFY_MAX_THREADS 64
+
+typedef struct {
+  const char *filename;
+  uint32_t segments;
+
+  /* the machine which the workers share the decoded ROMs with */
+  rygar_t *src;
+
+  /* the next segment to be verified */
+  atomic_uint next;
+
+  /* results */
+  atomic_uint frames;
+  atomic_uint failures;
+  atomic_bool error;
+} verify_t;
+
+/**
+ * Returns the hash of the given data, which is the hash a replay stores of the
+ * final machine state.
+ */
+static uint64_t verify_hash(const void *data, size_t size) {
+  return replay_hash(data, size);
+}
+
+static void *verify_worker(void *arg) {
+  verify_t *verify = arg;
+  rygar_t *rygar = malloc(sizeof(rygar_t));
+  rygar_snapshot_t *actual = malloc(sizeof(rygar_snapshot_t));
+
+  /* the machine state doesn't depend on rendering, so there is no frame
+   * buffer */
+  rygar_init_clone(rygar, verify->src, 0);
+
+  if (!rygar_replay_open(rygar, verify->filename)) {
+    atomic_store(&verify->error, true);
+  } else {
+    for (;;) {
+      uint32_t segment = atomic_fetch_add(&verify->next, 1);
+
+      if (segment >= verify->segments) break;
+
+      /* The last segment ends where the recording stopped, and the others end
+       * at the next keyframe. That keyframe is decoded first, as decoding a
+       * keyframe moves playback to its segment. */
+      uint64_t end_cycle = rygar->player.end_cycle;
+      uint64_t expected_hash = rygar->player.end_hash;
+      bool corrupt = false;
+
+      if (segment + 1 < rygar->player.count) {
+        const void *end = replay_keyframe(&rygar->player, segment + 1);
+
+        end_cycle = rygar->player.index[segment + 1].cycle;
+
+        if (end) {
+          expected_hash = verify_hash(end, sizeof(rygar_snapshot_t));
+        } else {
+          corrupt = true;
+        }
+      }
+
+      const void *start = replay_keyframe(&rygar->player, segment);
+
+      if (corrupt || !start || !rygar_load_snapshot(rygar, start)) {
+        printf("verify: segment %u has a corrupt keyframe\n", segment);
+        atomic_fetch_add(&verify->failures, 1);
+        continue;
+      }
+
+      /* the segment is run to the cycle it ends at, because the recording
+       * may have stopped partway through a frame */
+      uint32_t start_frame = rygar->frame_count;
+
+      while (rygar->cycles < end_cycle) {
+        uint64_t ticks = end_cycle - rygar->cycles;
+        if (!rygar_run(rygar, (ticks > UINT32_MAX) ? UINT32_MAX : (uint32_t)ticks)) break;
+      }
+
+      uint32_t end_frame = rygar->frame_count;
+
+      rygar_save_snapshot(rygar, actual);
+
+      uint64_t actual_hash = verify_hash(actual, sizeof(rygar_snapshot_t));
+
+      if (actual_hash != expected_hash) {
+        printf("verify: segment %u (frames %u-%u) diverged, state %016llx != %016llx\n",
+          segment, start_frame, end_frame,
+          (unsigned long long)actual_hash,
+          (unsigned long long)expected_hash);
+        atomic_fetch_add(&verify->failures, 1);
+
+#ifdef RYGAR_TRACE
+        char trace_filename[32];
+        snprintf(trace_filename, sizeof(trace_filename), "verify-%u.trace", segment);
+        printf("verify: writing %s\n", trace_filename);
+        trace_dump(&rygar->trace, trace_filename);
+#endif
+      }
+
+      atomic_fetch_add(&verify->frames, end_frame - start_frame);
+    }
+  }
+
+  rygar_shutdown(rygar);
+  free(actual);
+  free(rygar);
+
+  return 0;
+}
+
+/**
+ * Verifies every segment of the given replay, using the given number of
+ * threads, and returns true if they all match.
+ */
+bool verify_replay(const char *filename, int threads) {
+  replay_player_t player;
+  pthread_t workers[VERIFY_MAX_THREADS];
+  verify_t verify = { .filename = filename };
+
+  if (!replay_open(&player, filename)) return false;
+
+  verify.segments = player.count;
+  replay_close(&player);
+
+  if (threads < 1) threads = 1;
+  if (threads > VERIFY_MAX_THREADS) threads = VERIFY_MAX_THREADS;
+  if (threads > (int)verify.segments) threads = verify.segments;
+
+  verify.src = malloc(sizeof(rygar_t));
+  rygar_init(verify.src, 0);
+
+  uint64_t start = stm_now();
+  int started = 0;
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], 0, verify_worker, &verify) == 0) started++;
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], 0);
+  }
+
+  double seconds = stm_sec(stm_since(start));
+
+  rygar_shutdown(verify.src);
+  free(verify.src);
+  uint32_t frames = atomic_load(&verify.frames);
+  uint32_t failures = atomic_load(&verify.failures);
+
+  printf("verify: %u segments (%u frames) on %d threads in %.3fs (%.1fx realtime), %u failed\n",
+    verify.segments, frames, started, seconds,
+    seconds > 0 ? frames / 60.0 / seconds : 0,
+    failures);
+
+  return started > 0 && failures == 0 && !atomic_load(&verify.error);
+}
@@ -0,0 +1,431 @@
+/*
+ *   __   __     __  __     __         __
+ *  /\ "-.\ \   /\ \/\ \   /\ \       /\ \
+ *  \ \ \-.  \  \ \ \_\ \  \ \ \____  \ \ \____
+ *   \ \_\\"\_\  \ \_____\  \ \_____\  \ \_____\
+ *    \/_/ \/_/   \/_____/   \/_____/   \/_____/
+ *   ______     ______       __     ______     ______     ______
+ *  /\  __ \   /\  == \     /\ \   /\  ___\   /\  ___\   /\__  _\
+ *  \ \ \/\ \  \ \  __<    _\_\ \  \ \  __\   \ \ \____  \/_/\ \/
+ *   \ \_____\  \ \_____\ /\_____\  \ \_____\  \ \_____\    \ \_\
+ *    \/_____/   \/_____/ \/_____/   \/_____/   \/_____/     \/_/
+ *
+ * https://joshbassett.info
+ * https://twitter.com/nullobject
+ * https://github.com/nullobject
+ *
+ * Copyright (c) 2020 Josh Bassett
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Presents the RGBA frame buffer to an X11 window through the MIT shared
+ * memory extension, for hosts without a usable GL driver. The frame buffer is
+ * scaled by integer factors directly into the shared image, so the only copy
+ * is the one the X server makes when it draws the image. If the extension is
+ * not available (e.g. a remote display) the image is sent over the wire
+ * instead. */
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+
+#include <X11/XKBlib.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/keysym.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+
+#define XSHM_AVAILABLE
+
+/* there's no vsync, so frames are paced by the clock (in nanoseconds) */
+#define XSHM_FRAME_PERIOD (1000000000 / 60)
+
+typedef struct {
+  Display *display;
+  Window window;
+  GC gc;
+  Atom wm_delete_window;
+
+  /* whether the image is in shared memory */
+  bool use_shm;
+  XShmSegmentInfo shm;
+  XImage *image;
+
+  /* source frame buffer dimensions */
+  int src_width;
+  int src_height;
+
+  /* window dimensions */
+  int width;
+  int height;
+
+  /* integer scale factors, and the position of the image in the window */
+  int scale_x;
+  int scale_y;
+  int x;
+  int y;
+
+  /* frame pacing */
+  uint64_t deadline;
+  uint64_t last_frame;
+
+  /* time taken to present the most recent frame, and the totals (in
+   * nanoseconds) */
+  uint64_t present_time;
+  uint64_t present_total;
+  uint64_t present_max;
+  uint32_t present_count;
+} xshm_t;
+
+static uint64_t xshm_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* set by the error handler while attaching the shared memory */
+static bool xshm_attach_error;
+
+static int xshm_attach_error_handler(Display *display, XErrorEvent *event) {
+  (void)display;
+  (void)event;
+
+  xshm_attach_error = true;
+  return 0;
+}
+
+/**
+ * Attaches the shared memory segment to the X server. This fails with an X
+ * error rather than a return value, e.g. if the server can't access the
+ * segment, so errors are trapped while attaching.
+ */
+static bool xshm_attach(xshm_t *xshm) {
+  xshm_attach_error = false;
+
+  XErrorHandler handler = XSetErrorHandler(xshm_attach_error_handler);
+  bool attached = XShmAttach(xshm->display, &xshm->shm);
+  XSync(xshm->display, False);
+  XSetErrorHandler(handler);
+
+  return attached && !xshm_attach_error;
+}
+
+static void xshm_destroy_image(xshm_t *xshm) {
+  if (!xshm->image) return;
+
+  if (xshm->use_shm) {
+    XShmDetach(xshm->display, &xshm->shm);
+    XSync(xshm->display, False);
+    shmdt(xshm->shm.shmaddr);
+  }
+
+  XDestroyImage(xshm->image);
+  xshm->image = 0;
+}
+
+/**
+ * Creates an image for the current scale factors.
+ */
+static bool xshm_create_image(xshm_t *xshm) {
+  Display *display = xshm->display;
+  Visual *visual = DefaultVisual(display, DefaultScreen(display));
+  int depth = DefaultDepth(display, DefaultScreen(display));
+  int width = xshm->src_width * xshm->scale_x;
+  int height = xshm->src_height * xshm->scale_y;
+
+  xshm_destroy_image(xshm);
+
+  if (xshm->use_shm) {
+    xshm->image = XShmCreateImage(display, visual, depth, ZPixmap, 0, &xshm->shm, width, height);
+
+    if (xshm->image) {
+      xshm->shm.shmid = shmget(IPC_PRIVATE, xshm->image->bytes_per_line * height, IPC_CREAT | 0600);
+
+      if (xshm->shm.shmid >= 0) {
+        xshm->shm.shmaddr = shmat(xshm->shm.shmid, 0, 0);
+        xshm->shm.readOnly = False;
+
+        bool attached = xshm->shm.shmaddr != (char *)-1 && xshm_attach(xshm);
+
+        /* the segment is destroyed once both sides have detached */
+        shmctl(xshm->shm.shmid, IPC_RMID, 0);
+
+        if (attached) {
+          xshm->image->data = xshm->shm.shmaddr;
+          return true;
+        }
+
+        if (xshm->shm.shmaddr != (char *)-1) shmdt(xshm->shm.shmaddr);
+      }
+
+      XDestroyImage(xshm->image);
+      xshm->image = 0;
+    }
+
+    /* fall back to sending the image over the wire */
+    xshm->use_shm = false;
+  }
+
+  xshm->image = XCreateImage(display, visual, depth, ZPixmap, 0, 0, width, height, 32, 0);
+
+  if (!xshm->image) return false;
+
+  xshm->image->data = malloc(xshm->image->bytes_per_line * height);
+
+  return xshm->image->data != 0;
+}
+
+/**
+ * Fits the largest integer scaled image in the window.
+ */
+static bool xshm_resize(xshm_t *xshm, int width, int height) {
+  int scale_x = width / xshm->src_width;
+  int scale_y = height / xshm->src_height;
+
+  if (scale_x < 1) scale_x = 1;
+  if (scale_y < 1) scale_y = 1;
+
+  xshm->width = width;
+  xshm->height = height;
+  xshm->x = (width - xshm->src_width * scale_x) / 2;
+  xshm->y = (height - xshm->src_height * scale_y) / 2;
+
+  XClearWindow(xshm->display, xshm->window);
+
+  if (xshm->image && scale_x == xshm->scale_x && scale_y == xshm->scale_y) return true;
+
+  xshm->scale_x = scale_x;
+  xshm->scale_y = scale_y;
+
+  return xshm_create_image(xshm);
+}
+
+/**
+ * Destroys the image and the window, and closes the display.
+ */
+static void xshm_close(xshm_t *xshm) {
+  xshm_destroy_image(xshm);
+  XFreeGC(xshm->display, xshm->gc);
+  XDestroyWindow(xshm->display, xshm->window);
+  XCloseDisplay(xshm->display);
+  xshm->display = 0;
+}
+
+/**
+ * Opens a window for presenting frames of the given size, and returns false
+ * if there is no display, or it doesn't have a 32-bit RGB visual.
+ */
+bool xshm_init(xshm_t *xshm, const char *title, int src_width, int src_height, int width, int height) {
+  memset(xshm, 0, sizeof(xshm_t));
+
+  xshm->display = XOpenDisplay(0);
+
+  if (!xshm->display) {
+    fprintf(stderr, "xshm: failed to open display\n");
+    return false;
+  }
+
+  Display *display = xshm->display;
+  int screen = DefaultScreen(display);
+  Visual *visual = DefaultVisual(display, screen);
+
+  if (DefaultDepth(display, screen) < 24 || visual->red_mask != 0xff0000 || visual->green_mask != 0x00ff00 || visual->blue_mask != 0x0000ff) {
+    fprintf(stderr, "xshm: unsupported visual\n");
+    XCloseDisplay(display);
+    return false;
+  }
+
+  xshm->src_width = src_width;
+  xshm->src_height = src_height;
+  xshm->use_shm = XShmQueryExtension(display);
+
+  xshm->window = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0, width, height, 0, 0, BlackPixel(display, screen));
+  xshm->gc = XCreateGC(display, xshm->window, 0, 0);
+  xshm->wm_delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
+
+  XStoreName(display, xshm->window, title);
+  XSetWMProtocols(display, xshm->window, &xshm->wm_delete_window, 1);
+  XSelectInput(display, xshm->window, KeyPressMask | KeyReleaseMask | StructureNotifyMask | ExposureMask);
+
+  /* only report key releases when the key is actually released */
+  XkbSetDetectableAutoRepeat(display, True, 0);
+
+  XMapWindow(display, xshm->window);
+
+  if (!xshm_resize(xshm, width, height)) {
+    fprintf(stderr, "xshm: failed to create image\n");
+    xshm_close(xshm);
+    return false;
+  }
+
+  xshm->deadline = xshm->last_frame = xshm_now();
+
+  printf("xshm: %s\n", xshm->use_shm ? "using shared memory" : "shared memory not available");
+
+  return true;
+}
+
+void xshm_shutdown(xshm_t *xshm) {
+  if (!xshm->display) return;
+
+  if (xshm->present_count > 0) {
+    printf("xshm: %u frames presented, %.3fms average / %.3fms max\n",
+      xshm->present_count,
+      xshm->present_total / 1e6 / xshm->present_count,
+      xshm->present_max / 1e6);
+  }
+
+  xshm_close(xshm);
+}
+
+/**
+ * Handles pending window events, calling the key callback for key presses and
+ * releases. Returns false when the window is closed.
+ */
+bool xshm_poll(xshm_t *xshm, void (*key_cb)(KeySym key, bool pressed)) {
+  while (XPending(xshm->display)) {
+    XEvent event;
+    XNextEvent(xshm->display, &event);
+
+    switch (event.type) {
+      case KeyPress:
+      case KeyRelease:
+        key_cb(XLookupKeysym(&event.xkey, 0), event.type == KeyPress);
+        break;
+
+      case ConfigureNotify:
+        if (event.xconfigure.width != xshm->width || event.xconfigure.height != xshm->height) {
+          if (!xshm_resize(xshm, event.xconfigure.width, event.xconfigure.height)) return false;
+        }
+        break;
+
+      case ClientMessage:
+        if ((Atom)event.xclient.data.l[0] == xshm->wm_delete_window) return false;
+        break;
+
+      case DestroyNotify:
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Scales the RGBA frame buffer into the image, and draws it to the window.
+ * The frame buffer is rotated 180 degrees if the flip flag is set.
+ *
+ * Each source row is converted to the X pixel format and scaled horizontally
+ * once, and then the scaled row is copied for the vertical scale factor.
+ */
+void xshm_present(xshm_t *xshm, const uint32_t *framebuffer, bool flip) {
+  uint64_t start = xshm_now();
+  XImage *image = xshm->image;
+  int scale_x = xshm->scale_x;
+  int scale_y = xshm->scale_y;
+  int width = xshm->src_width;
+  int height = xshm->src_height;
+  int row_size = width * scale_x * 4;
+  uint8_t *dst = (uint8_t *)image->data;
+
+  for (int y = 0; y < height; y++) {
+    const uint32_t *src = framebuffer + (flip ? (height - 1 - y) * width + width - 1 : y * width);
+    int step = flip ? -1 : 1;
+    uint32_t *row = (uint32_t *)dst;
+
+    for (int x = 0; x < width; x++) {
+      /* RGBA (ABGR in memory) to xRGB */
+      uint32_t c = *src;
+      uint32_t p = (c & 0xff) << 16 | (c & 0xff00) | (c >> 16 & 0xff);
+
+      src += step;
+
+      for (int i = 0; i < scale_x; i++) *row++ = p;
+    }
+
+    for (int i = 1; i < scale_y; i++) {
+      memcpy(dst + i * image->bytes_per_line, dst, row_size);
+    }
+
+    dst += scale_y * image->bytes_per_line;
+  }
+
+  if (xshm->use_shm) {
+    XShmPutImage(xshm->display, xshm->window, xshm->gc, image, 0, 0, xshm->x, xshm->y, image->width, image->height, False);
+  } else {
+    XPutImage(xshm->display, xshm->window, xshm->gc, image, 0, 0, xshm->x, xshm->y, image->width, image->height);
+  }
+
+  /* wait for the server to finish reading the image, so the next frame
+   * doesn't overwrite it while it's being drawn */
+  XSync(xshm->display, False);
+
+  xshm->present_time = xshm_now() - start;
+  xshm->present_total += xshm->present_time;
+  xshm->present_count++;
+
+  if (xshm->present_time > xshm->present_max) xshm->present_max = xshm->present_time;
+}
+
+/**
+ * Waits for the next frame, and returns the time since the previous frame (in
+ * microseconds). If the caller falls more than a frame behind, the deadline
+ * is reset rather than running frames back to back to catch up.
+ */
+uint32_t xshm_wait_frame(xshm_t *xshm) {
+  uint64_t now = xshm_now();
+
+  xshm->deadline += XSHM_FRAME_PERIOD;
+
+  if (xshm->deadline + XSHM_FRAME_PERIOD < now) {
+    xshm->deadline = now;
+  }
+
+  struct timespec ts = {
+    .tv_sec = xshm->deadline / 1000000000,
+    .tv_nsec = xshm->deadline % 1000000000,
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) != 0) {}
+
+  now = xshm_now();
+  uint32_t frame_time = (now - xshm->last_frame) / 1000;
+  xshm->last_frame = now;
+
+  return frame_time;
+}
+
+/**
+ * Sets the window title.
+ */
+void xshm_set_title(xshm_t *xshm, const char *title) {
+  XStoreName(xshm->display, xshm->window, title);
+}
+
+#endif